@@ -10,6 +10,9 @@
 #include "prefab.h"
 #include "gltf_loader.h"
 #include "renderer.h"
+#include "glstate.h"
+#include "streambuffer.h"
+#include "profiler.h"
 
 #include <cmath>
 #include <string>
@@ -28,7 +31,7 @@ Texture* texture = nullptr;
 
 float cam_speed = 10;
 
-Application::Application(int window_width, int window_height, SDL_Window* window)
+Application::Application(int window_width, int window_height, SDL_Window* window, const char* scene_filename)
 {
 	this->window_width = window_width;
 	this->window_height = window_height;
@@ -46,14 +49,9 @@ Application::Application(int window_width, int window_height, SDL_Window* window
 	elapsed_time = 0.0f;
 	mouse_locked = false;
 
-	//loads and compiles several shaders from one single file
-    //change to "data/shader_atlas_osx.txt" if you are in XCODE
-#ifdef __APPLE__
-    const char* shader_atlas_filename = "data/shader_atlas_osx.txt";
-#else
-    const char* shader_atlas_filename = "data/shader_atlas.txt";
-#endif
-	if(!Shader::LoadAtlas(shader_atlas_filename))
+	//loads and compiles several shaders from one single file, the same in every platform
+	//(they use the GLSL of the compatibility profile, the one of every context the app creates)
+	if(!Shader::LoadAtlas("data/shader_atlas.txt"))
         exit(1);
     checkGLErrors();
 
@@ -67,7 +65,7 @@ Application::Application(int window_width, int window_height, SDL_Window* window
 	//prefab = GTR::Prefab::Get("data/prefabs/gmc/scene.gltf");
 
 	scene = new GTR::Scene();
-	if (!scene->load("data/scene.json"))
+	if (!scene->load(scene_filename))
 		exit(1);
 
 	camera->lookAt(scene->main_camera.eye, scene->main_camera.center, Vector3(0, 1, 0));
@@ -87,7 +85,8 @@ Application::Application(int window_width, int window_height, SDL_Window* window
     selected_light_entity = scene->light_entities[renderer->selected_light];
 
 	//hide the cursor
-	SDL_ShowCursor(!mouse_locked); //hide or show the mouse
+	if (window)
+		SDL_ShowCursor(!mouse_locked); //hide or show the mouse
 }
 
 //what to do when the image has to be draw
@@ -96,14 +95,20 @@ void Application::render(void)
 	//be sure no errors present in opengl before start
 	checkGLErrors();
 
+	//the gui changes the state without telling us, so the cached state is not valid anymore
+	GLState::newFrame();
+
+	//the per draw data of this frame goes to the next region of the stream (it waits if the GPU still reads it)
+	StreamBuffer::getFrameStream()->nextFrame();
+
 	//set the camera as default (used by some functions in the framework)
 	camera->enable();
 
 	//set default flags
-	glDisable(GL_BLEND);
+	GLState::disable(GL_BLEND);
     
-	glEnable(GL_DEPTH_TEST);
-	glEnable(GL_CULL_FACE);
+	GLState::enable(GL_DEPTH_TEST);
+	GLState::enable(GL_CULL_FACE);
 	if(render_wireframe)
 		glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
 	else
@@ -119,7 +124,7 @@ void Application::render(void)
 //    if(render_debug)
 //        drawGrid();
 
-    glDisable(GL_DEPTH_TEST);
+    GLState::disable(GL_DEPTH_TEST);
     //render anything in the gui after this
 
 	//the swap buffers is done in the main loop after this function
@@ -274,6 +279,18 @@ void Application::renderDebugGUI(void)
 	ImGui::ColorEdit3("BG color", scene->background_color.v);
 	ImGui::ColorEdit3("Ambient Light", scene->ambient_light.v);
 
+	//add info to the debug panel about the renderer
+	if (ImGui::TreeNode(renderer, "Renderer")) {
+		renderer->renderInMenu();
+		ImGui::TreePop();
+	}
+
+	//timers of the frame
+	if (ImGui::TreeNode(Profiler::get(), "Profiler")) {
+		Profiler::get()->renderInMenu();
+		ImGui::TreePop();
+	}
+
 	//add info to the debug panel about the camera
 	if (ImGui::TreeNode(camera, "Camera")) {
 		camera->renderInMenu();
@@ -32,7 +32,8 @@ public:
 	bool mouse_locked; //tells if the mouse is locked (blocked in the center and not visible)
 	bool render_wireframe; //in case we want to render everything in wireframe mode
 
-	Application( int window_width, int window_height, SDL_Window* window );
+	//window is NULL in the headless mode (the frames go to GLState::default_framebuffer)
+	Application( int window_width, int window_height, SDL_Window* window, const char* scene_filename = "data/scene.json" );
 
 	//main functions
 	void render( void );
@@ -0,0 +1,149 @@
+#include "cascades.h"
+#include "camera.h"
+#include <cmath>
+#include <algorithm>
+#include <cassert>
+#include <iostream>
+
+void GTR::computeCascadeSplits(float near_plane, float far_plane, int num_cascades, float lambda, float* splits)
+{
+	assert(num_cascades > 0 && num_cascades <= MAX_CASCADES);
+	near_plane = std::max(near_plane, 0.001f);
+	for (int i = 1; i <= num_cascades; ++i)
+	{
+		float f = i / (float)num_cascades;
+		float log_split = near_plane * pow(far_plane / near_plane, f);
+		float uniform_split = near_plane + (far_plane - near_plane) * f;
+		splits[i - 1] = lambda * log_split + (1.0f - lambda) * uniform_split;
+	}
+	//avoid rounding errors in the last one
+	splits[num_cascades - 1] = far_plane;
+}
+
+void GTR::fitCascadeCamera(Camera* camera, float split_near, float split_far, Vector3 light_direction, float depth_range, int tile_size, Camera* cascade_camera)
+{
+	assert(tile_size > 0);
+
+	//basis of the camera
+	Vector3 front = (camera->center - camera->eye).normalize();
+	Vector3 right = cross(front, camera->up).normalize();
+	Vector3 up = cross(right, front);
+
+	//corners of the slice of the frustum
+	Vector3 corners[8];
+	float distances[2] = { split_near, split_far };
+	for (int i = 0; i < 2; ++i)
+	{
+		float half_width, half_height;
+		if (camera->type == Camera::ORTHOGRAPHIC)
+		{
+			half_width = (camera->right - camera->left) * 0.5f;
+			half_height = (camera->top - camera->bottom) * 0.5f;
+		}
+		else
+		{
+			half_height = distances[i] * tan(camera->fov * 0.5f * DEG2RAD);
+			half_width = half_height * camera->aspect;
+		}
+		Vector3 slice_center = camera->eye + front * distances[i];
+		corners[i * 4 + 0] = slice_center + right * half_width + up * half_height;
+		corners[i * 4 + 1] = slice_center - right * half_width + up * half_height;
+		corners[i * 4 + 2] = slice_center + right * half_width - up * half_height;
+		corners[i * 4 + 3] = slice_center - right * half_width - up * half_height;
+	}
+
+	//bounding sphere of the slice, its radius only depends on the splits so it is stable when rotating
+	Vector3 center;
+	for (int i = 0; i < 8; ++i)
+		center = center + corners[i];
+	center = center * (1.0f / 8.0f);
+	float radius = 0;
+	for (int i = 0; i < 8; ++i)
+		radius = std::max(radius, center.distance(corners[i]));
+	//round it so float errors don't change the texel size every frame
+	radius = ceil(radius * 16.0f) / 16.0f;
+
+	//basis of the light
+	Vector3 light_front = light_direction.normalize();
+	Vector3 reference_up = fabs(light_front.y) > 0.99f ? Vector3(1, 0, 0) : Vector3(0, 1, 0);
+	Vector3 light_right = cross(light_front, reference_up).normalize();
+	Vector3 light_up = cross(light_right, light_front);
+
+	//move the center to a multiple of the texel size in light space
+	float texel_size = 2.0f * radius / tile_size;
+	float x = dot(center, light_right);
+	float y = dot(center, light_up);
+	float snapped_x = floor(x / texel_size) * texel_size;
+	float snapped_y = floor(y / texel_size) * texel_size;
+	center = center + light_right * (snapped_x - x) + light_up * (snapped_y - y);
+
+	//the depth has to include at least the whole sphere
+	depth_range = std::max(depth_range, radius);
+	cascade_camera->setOrthographic(-radius, radius, -radius, radius, -depth_range, depth_range);
+	cascade_camera->lookAt(center, center + light_front, light_up);
+}
+
+bool GTR::testCascades()
+{
+	//the splits of several ranges, numbers of cascades and lambdas
+	bool splits_correct = true;
+	const float ranges[3][2] = { { 0.1f, 100.0f }, { 1.0f, 10000.0f }, { 0.5f, 0.6f } };
+	const float lambdas[5] = { 0.0f, 0.25f, 0.5f, 0.75f, 1.0f };
+	for (int r = 0; r < 3; ++r)
+		for (int n = 1; n <= MAX_CASCADES; ++n)
+			for (int l = 0; l < 5; ++l)
+			{
+				float near_plane = ranges[r][0], far_plane = ranges[r][1];
+				float splits[MAX_CASCADES];
+				computeCascadeSplits(near_plane, far_plane, n, lambdas[l], splits);
+				bool correct = splits[n - 1] == far_plane && splits[0] > near_plane;
+				for (int i = 1; i < n; ++i)
+					correct = correct && splits[i] > splits[i - 1];
+				//the extremes are the uniform and the logarithmic splits
+				for (int i = 0; i < n && (lambdas[l] == 0.0f || lambdas[l] == 1.0f); ++i)
+				{
+					float f = (i + 1) / (float)n;
+					float expected = lambdas[l] == 0.0f ? near_plane + (far_plane - near_plane) * f : near_plane * pow(far_plane / near_plane, f);
+					correct = correct && fabs(splits[i] - expected) <= expected * 1e-5f;
+				}
+				if (!correct)
+					std::cout << " + Cascade splits ERROR: near " << near_plane << ", far " << far_plane << ", " << n << " cascades, lambda " << lambdas[l] << std::endl;
+				splits_correct = splits_correct && correct;
+			}
+
+	//the camera moves in steps of a fifth of a texel, a point of the world has to stay in the same place of the tile
+	//(or jump whole texels when the center crosses to the next one, once per texel moved)
+	const int tile_size = 1024;
+	const int num_steps = 10;
+	Vector3 light_direction = Vector3(-1, -2, -0.5f).normalize();
+	Camera camera;
+	camera.setPerspective(60.0f, 16.0f / 9.0f, 0.1f, 100.0f);
+	camera.lookAt(Vector3(10, 5, 10), Vector3(0, 0, 0), Vector3(0, 1, 0));
+	Camera cascade_camera;
+	fitCascadeCamera(&camera, 0.1f, 20.0f, light_direction, 100.0f, tile_size, &cascade_camera);
+	float texel_size = (cascade_camera.right - cascade_camera.left) / tile_size;
+	Vector3 step = cross(light_direction, Vector3(0, 1, 0)).normalize() * (texel_size * 0.2f);
+
+	Vector3 point(1, 0.5f, -2);
+	Vector3 first = cascade_camera.project(point, (float)tile_size, (float)tile_size);
+	Vector3 previous = first;
+	int num_jumps = 0;
+	bool snapping_correct = true;
+	for (int i = 1; i <= num_steps; ++i)
+	{
+		camera.lookAt(camera.eye + step, camera.center + step, camera.up);
+		fitCascadeCamera(&camera, 0.1f, 20.0f, light_direction, 100.0f, tile_size, &cascade_camera);
+		Vector3 pixel = cascade_camera.project(point, (float)tile_size, (float)tile_size);
+		float dx = pixel.x - previous.x, dy = pixel.y - previous.y;
+		if (fabs(dx) > 0.01f || fabs(dy) > 0.01f)
+			num_jumps++;
+		if (fabs(dx - floor(dx + 0.5f)) > 0.01f || fabs(dy - floor(dy + 0.5f)) > 0.01f)
+			snapping_correct = false;
+		previous = pixel;
+	}
+	snapping_correct = snapping_correct && num_jumps <= 3;
+
+	std::cout << " + Cascade splits " << (splits_correct ? "OK" : "FAILED") << ", texel snapping " << (snapping_correct ? "OK" : "FAILED") << ": "
+		<< "the shadow map moved in " << num_jumps << " of " << num_steps << " moves of 0.2 texels" << std::endl;
+	return splits_correct && snapping_correct;
+}
@@ -0,0 +1,29 @@
+#ifndef CASCADES_H
+#define CASCADES_H
+
+#include "framework.h"
+
+class Camera;
+
+// Math to fit the cascaded shadow maps of a directional light to the camera frustum.
+// It only uses the CPU (no OpenGL calls) so it can be checked on its own
+namespace GTR {
+
+	#define MAX_CASCADES 4
+
+	// Distances from the camera where every cascade ends (splits[num_cascades-1] is far_plane).
+	// lambda mixes logarithmic splits (1.0, more resolution close to the camera) with uniform splits (0.0)
+	void computeCascadeSplits(float near_plane, float far_plane, int num_cascades, float lambda, float* splits);
+
+	// Fits an orthographic camera to the slice [split_near, split_far] of the camera frustum seen from light_direction.
+	// The slice is wrapped in a sphere so the size doesn't change when the camera rotates,
+	// and the center is snapped to the texels of the tile so the shadow edges don't shimmer when the camera moves.
+	// depth_range is how far behind and in front of the slice we look for casters
+	void fitCascadeCamera(Camera* camera, float split_near, float split_far, Vector3 light_direction, float depth_range, int tile_size, Camera* cascade_camera);
+
+	// Checks the splits (increasing, ending at far, uniform with lambda 0 and logarithmic with 1) and that moving the camera
+	// less than a texel doesn't move the shadow map (only whole texels), prints the results and returns false if one fails
+	bool testCascades();
+};
+
+#endif
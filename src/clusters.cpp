@@ -0,0 +1,370 @@
+#include "clusters.h"
+#include "scene.h"
+#include "camera.h"
+#include "shader.h"
+#include "texture.h"
+#include "glstate.h"
+#include "jobsystem.h"
+#include <cmath>
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+
+using namespace GTR;
+
+//width in texels of the data textures, the data is stored row by row
+#define CLUSTER_TEXTURE_WIDTH 1024
+
+LightClusters::LightClusters()
+{
+	num_overflows = 0;
+	lights_texture = NULL;
+	grid_texture = NULL;
+	indices_texture = NULL;
+	near_plane = 1.0f;
+	depth_scale = 1.0f;
+	depth_bias = 0.0f;
+	viewport_size = Vector2(1, 1);
+}
+
+LightClusters::~LightClusters()
+{
+	delete lights_texture;
+	delete grid_texture;
+	delete indices_texture;
+}
+
+void LightClusters::setLights(std::vector<LightEntity*>& scene_lights)
+{
+	lights.clear();
+	directional_lights.clear();
+	for (int i = 0; i < scene_lights.size(); ++i)
+	{
+		LightEntity* light = scene_lights[i];
+		if (!light->visible)
+			continue;
+		if (light->light_type == DIRECTIONAL)
+		{
+			if (directional_lights.size() < MAX_CLUSTER_DIRECTIONAL_LIGHTS)
+				directional_lights.push_back(light);
+			continue;
+		}
+		sClusterLight cluster_light;
+		cluster_light.position = light->model.getTranslation();
+		cluster_light.max_distance = light->max_distance;
+		cluster_light.color = light->color;
+		cluster_light.light_type = light->light_type;
+		cluster_light.direction = light->model.frontVector().normalize();
+		cluster_light.cone_angle = light->cone_angle;
+		lights.push_back(cluster_light);
+	}
+}
+
+//sphere around what the light can reach, for a spot it is the sphere around its cone
+static Vector4 computeLightSphere(const sClusterLight& light)
+{
+	float angle = light.cone_angle;
+	float range = light.max_distance;
+	if (light.light_type != SPOT || angle >= PI * 0.5f)
+		return Vector4(light.position.x, light.position.y, light.position.z, range);
+
+	Vector3 center;
+	float radius;
+	if (angle > PI * 0.25f)
+	{
+		//the circle at the end of the cone
+		center = light.position + light.direction * (range * cos(angle));
+		radius = range * sin(angle);
+	}
+	else
+	{
+		//the sphere that touches the apex and the end of the cone
+		radius = range / (2.0f * cos(angle));
+		center = light.position + light.direction * radius;
+	}
+	return Vector4(center.x, center.y, center.z, radius);
+}
+
+//half of the width and height of the view at a depth
+static void getViewHalfSize(Camera* camera, float depth, float& half_width, float& half_height)
+{
+	if (camera->type == Camera::ORTHOGRAPHIC)
+	{
+		half_width = (camera->right - camera->left) * 0.5f;
+		half_height = (camera->top - camera->bottom) * 0.5f;
+		return;
+	}
+	half_height = depth * tan(camera->fov * 0.5f * DEG2RAD);
+	half_width = half_height * camera->aspect;
+}
+
+void LightClusters::assignLights(Camera* camera, JobSystem* job_system)
+{
+	//basis of the camera, the clusters are computed in view space (x right, y up, z depth)
+	camera_eye = camera->eye;
+	camera_front = (camera->center - camera->eye).normalize();
+	Vector3 right = cross(camera_front, camera->up).normalize();
+	Vector3 up = cross(right, camera_front);
+
+	near_plane = std::max(camera->near_plane, 0.01f);
+	float far_plane = std::max(camera->far_plane, near_plane * 2.0f);
+	depth_scale = CLUSTERS_Z / log(far_plane / near_plane);
+	depth_bias = log(near_plane) * depth_scale;
+
+	view_spheres.resize(lights.size());
+	for (int i = 0; i < lights.size(); ++i)
+	{
+		Vector4 sphere = computeLightSphere(lights[i]);
+		Vector3 to_center = Vector3(sphere.x, sphere.y, sphere.z) - camera_eye;
+		view_spheres[i] = Vector4(dot(to_center, right), dot(to_center, up), dot(to_center, camera_front), sphere.w);
+	}
+
+	//every slice only writes its own lists, so they can be filled in parallel without locks
+	slice_pairs.resize(CLUSTERS_Z);
+	slice_counts.resize(CLUSTERS_Z);
+	slice_indices.resize(CLUSTERS_Z);
+	if (job_system && job_system->getNumThreads() > 1)
+		job_system->parallelFor(CLUSTERS_Z, [&](int z, int thread) { assignSlice(z, camera); });
+	else
+		for (int z = 0; z < CLUSTERS_Z; ++z)
+			assignSlice(z, camera);
+
+	//merge the slices in order, the result is the same with any number of threads
+	offsets.resize(NUM_CLUSTERS);
+	counts.resize(NUM_CLUSTERS);
+	indices.clear();
+	num_overflows = 0;
+	for (int z = 0; z < CLUSTERS_Z; ++z)
+	{
+		int slice_offset = 0;
+		for (int c = 0; c < CLUSTERS_X * CLUSTERS_Y; ++c)
+		{
+			int cluster = z * CLUSTERS_X * CLUSTERS_Y + c;
+			int count = slice_counts[z][c];
+			if (count > MAX_LIGHTS_PER_CLUSTER)
+				num_overflows++;
+			offsets[cluster] = (int)indices.size();
+			counts[cluster] = std::min(count, MAX_LIGHTS_PER_CLUSTER);
+			indices.insert(indices.end(), slice_indices[z].begin() + slice_offset, slice_indices[z].begin() + slice_offset + counts[cluster]);
+			slice_offset += count;
+		}
+	}
+}
+
+void LightClusters::assignSlice(int z, Camera* camera)
+{
+	//depth range of the slice
+	float depth_near = exp((z + depth_bias) / depth_scale);
+	float depth_far = exp((z + 1 + depth_bias) / depth_scale);
+	float near_half_width, near_half_height, far_half_width, far_half_height;
+	getViewHalfSize(camera, depth_near, near_half_width, near_half_height);
+	getViewHalfSize(camera, depth_far, far_half_width, far_half_height);
+
+	//pairs of (cluster in the slice, light)
+	std::vector<int>& pairs = slice_pairs[z];
+	pairs.clear();
+	for (int i = 0; i < view_spheres.size(); ++i)
+	{
+		const Vector4& sphere = view_spheres[i];
+		float min_depth = std::max(sphere.z - sphere.w, depth_near);
+		float max_depth = std::min(sphere.z + sphere.w, depth_far);
+		if (min_depth > max_depth)
+			continue;
+
+		//range of tiles covered by the part of the sphere inside the slice
+		float min_half_width, min_half_height, max_half_width, max_half_height;
+		getViewHalfSize(camera, min_depth, min_half_width, min_half_height);
+		getViewHalfSize(camera, max_depth, max_half_width, max_half_height);
+		float min_x = std::min((sphere.x - sphere.w) / min_half_width, (sphere.x - sphere.w) / max_half_width);
+		float max_x = std::max((sphere.x + sphere.w) / min_half_width, (sphere.x + sphere.w) / max_half_width);
+		float min_y = std::min((sphere.y - sphere.w) / min_half_height, (sphere.y - sphere.w) / max_half_height);
+		float max_y = std::max((sphere.y + sphere.w) / min_half_height, (sphere.y + sphere.w) / max_half_height);
+		if (max_x < -1.0f || min_x > 1.0f || max_y < -1.0f || min_y > 1.0f)
+			continue;
+		int start_x = clamp(floor((min_x * 0.5f + 0.5f) * CLUSTERS_X), 0, CLUSTERS_X - 1);
+		int end_x = clamp(floor((max_x * 0.5f + 0.5f) * CLUSTERS_X), 0, CLUSTERS_X - 1);
+		int start_y = clamp(floor((min_y * 0.5f + 0.5f) * CLUSTERS_Y), 0, CLUSTERS_Y - 1);
+		int end_y = clamp(floor((max_y * 0.5f + 0.5f) * CLUSTERS_Y), 0, CLUSTERS_Y - 1);
+
+		for (int y = start_y; y <= end_y; ++y)
+		{
+			float ndc_bottom = -1.0f + 2.0f * y / CLUSTERS_Y;
+			float ndc_top = -1.0f + 2.0f * (y + 1) / CLUSTERS_Y;
+			float bottom = std::min(ndc_bottom * near_half_height, ndc_bottom * far_half_height);
+			float top = std::max(ndc_top * near_half_height, ndc_top * far_half_height);
+			for (int x = start_x; x <= end_x; ++x)
+			{
+				float ndc_left = -1.0f + 2.0f * x / CLUSTERS_X;
+				float ndc_right = -1.0f + 2.0f * (x + 1) / CLUSTERS_X;
+				float left = std::min(ndc_left * near_half_width, ndc_left * far_half_width);
+				float right = std::max(ndc_right * near_half_width, ndc_right * far_half_width);
+
+				//sphere against the box around the cluster
+				float dx = sphere.x - clamp(sphere.x, left, right);
+				float dy = sphere.y - clamp(sphere.y, bottom, top);
+				float dz = sphere.z - clamp(sphere.z, depth_near, depth_far);
+				if (dx * dx + dy * dy + dz * dz > sphere.w * sphere.w)
+					continue;
+				pairs.push_back(y * CLUSTERS_X + x);
+				pairs.push_back(i);
+			}
+		}
+	}
+
+	//sort the pairs by cluster keeping the order of the lights (counting sort)
+	std::vector<int>& slice_count = slice_counts[z];
+	slice_count.assign(CLUSTERS_X * CLUSTERS_Y, 0);
+	for (int i = 0; i < pairs.size(); i += 2)
+		slice_count[pairs[i]]++;
+	int cluster_offsets[CLUSTERS_X * CLUSTERS_Y];
+	int offset = 0;
+	for (int c = 0; c < CLUSTERS_X * CLUSTERS_Y; ++c)
+	{
+		cluster_offsets[c] = offset;
+		offset += slice_count[c];
+	}
+	std::vector<int>& slice_index = slice_indices[z];
+	slice_index.resize(pairs.size() / 2);
+	for (int i = 0; i < pairs.size(); i += 2)
+		slice_index[cluster_offsets[pairs[i]]++] = pairs[i + 1];
+}
+
+//uploads num_texels RGBA texels to a texture of CLUSTER_TEXTURE_WIDTH texels per row, it only grows
+static void uploadTexels(Texture*& texture, std::vector<float>& data, int num_texels)
+{
+	int height = std::max(1, (num_texels + CLUSTER_TEXTURE_WIDTH - 1) / CLUSTER_TEXTURE_WIDTH);
+	if (!texture || texture->height < height)
+	{
+		int texture_height = texture ? (int)texture->height : 1;
+		while (texture_height < height)
+			texture_height *= 2;
+		data.resize(CLUSTER_TEXTURE_WIDTH * texture_height * 4, 0.0f);
+		if (!texture)
+			texture = new Texture();
+		texture->create(CLUSTER_TEXTURE_WIDTH, texture_height, GL_RGBA, GL_FLOAT, false, (Uint8*)&data[0]);
+	}
+	else
+	{
+		data.resize(CLUSTER_TEXTURE_WIDTH * (int)texture->height * 4, 0.0f);
+		texture->upload(GL_RGBA, GL_FLOAT, false, (Uint8*)&data[0]);
+	}
+
+	//the shader reads exact texels, no filtering
+	GLState::bindTexture(GL_TEXTURE_2D, texture->texture_id);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	GLState::bindTexture(GL_TEXTURE_2D, 0);
+}
+
+void LightClusters::upload()
+{
+	//lights
+	texture_data.assign(lights.size() * 3 * 4, 0.0f);
+	for (int i = 0; i < lights.size(); ++i)
+	{
+		const sClusterLight& light = lights[i];
+		float* texels = &texture_data[i * 3 * 4];
+		texels[0] = light.position.x; texels[1] = light.position.y; texels[2] = light.position.z; texels[3] = light.max_distance;
+		texels[4] = light.color.x; texels[5] = light.color.y; texels[6] = light.color.z; texels[7] = (float)light.light_type;
+		texels[8] = light.direction.x; texels[9] = light.direction.y; texels[10] = light.direction.z; texels[11] = light.cone_angle;
+	}
+	uploadTexels(lights_texture, texture_data, (int)lights.size() * 3);
+
+	//offset and count of every cluster
+	texture_data.assign(NUM_CLUSTERS * 4, 0.0f);
+	for (int i = 0; i < NUM_CLUSTERS; ++i)
+	{
+		texture_data[i * 4 + 0] = (float)offsets[i];
+		texture_data[i * 4 + 1] = (float)counts[i];
+	}
+	uploadTexels(grid_texture, texture_data, NUM_CLUSTERS);
+
+	//light indices, packed 4 per texel
+	texture_data.assign(indices.begin(), indices.end());
+	uploadTexels(indices_texture, texture_data, ((int)indices.size() + 3) / 4);
+
+	//the shader finds the cluster of a pixel from its position in the viewport
+	GLint viewport[4];
+	glGetIntegerv(GL_VIEWPORT, viewport);
+	viewport_size = Vector2((float)viewport[2], (float)viewport[3]);
+}
+
+void LightClusters::setUniforms(Shader* shader)
+{
+	assert(lights_texture && "upload the clusters before rendering with them");
+	shader->setUniform("u_cluster_lights", lights_texture, 5);
+	shader->setUniform("u_cluster_grid", grid_texture, 6);
+	shader->setUniform("u_cluster_indices", indices_texture, 7);
+	shader->setUniform("u_cluster_texture_heights", Vector3(lights_texture->height, grid_texture->height, indices_texture->height));
+	shader->setUniform("u_cluster_depth", Vector2(depth_scale, depth_bias));
+	shader->setUniform("u_viewport_size", viewport_size);
+	shader->setUniform("u_camera_front", camera_front);
+
+	//directional lights reach every cluster
+	int num_directional = (int)directional_lights.size();
+	Vector3 color[MAX_CLUSTER_DIRECTIONAL_LIGHTS];
+	Vector3 position[MAX_CLUSTER_DIRECTIONAL_LIGHTS];
+	Vector3 direction[MAX_CLUSTER_DIRECTIONAL_LIGHTS];
+	float max_distance[MAX_CLUSTER_DIRECTIONAL_LIGHTS];
+	for (int i = 0; i < num_directional; ++i)
+	{
+		color[i] = directional_lights[i]->color;
+		position[i] = directional_lights[i]->model.getTranslation();
+		direction[i] = directional_lights[i]->model.frontVector();
+		max_distance[i] = directional_lights[i]->max_distance;
+	}
+	shader->setUniform("u_num_directional_lights", num_directional);
+	if (num_directional)
+	{
+		shader->setUniform3Array("u_directional_color", (float*)color, num_directional);
+		shader->setUniform3Array("u_directional_position", (float*)position, num_directional);
+		shader->setUniform3Array("u_directional_direction", (float*)direction, num_directional);
+		shader->setUniform1Array("u_directional_max_distance", max_distance, num_directional);
+	}
+}
+
+bool GTR::benchmarkLightClusters(JobSystem* job_system)
+{
+	bool correct = true;
+	Camera camera;
+	camera.setPerspective(45.0f, 16.0f / 9.0f, 1.0f, 10000.0f);
+	camera.lookAt(Vector3(0, 0, 0), Vector3(0, 0, -1), Vector3(0, 1, 0));
+
+	int light_counts[2] = { 1000, 10000 };
+	for (int n = 0; n < 2; ++n)
+	{
+		//random point and spot lights in front of the camera, always the same ones
+		LightClusters serial_clusters;
+		srand(n);
+		for (int i = 0; i < light_counts[n]; ++i)
+		{
+			sClusterLight light;
+			light.position = Vector3(random(2000.0f, -1000), random(2000.0f, -1000), -random(3000.0f));
+			light.max_distance = 20.0f + random(180.0f);
+			light.color = Vector3(1, 1, 1);
+			light.light_type = i % 2 ? SPOT : POINT;
+			light.direction = Vector3(random(2.0f, -1), random(2.0f, -1), random(2.0f, -1)).normalize();
+			light.cone_angle = 0.2f + random(1.0f);
+			serial_clusters.lights.push_back(light);
+		}
+		LightClusters parallel_clusters;
+		parallel_clusters.lights = serial_clusters.lights;
+
+		const int iterations = 20;
+		std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+		for (int i = 0; i < iterations; ++i)
+			serial_clusters.assignLights(&camera, NULL);
+		std::chrono::high_resolution_clock::time_point middle = std::chrono::high_resolution_clock::now();
+		for (int i = 0; i < iterations; ++i)
+			parallel_clusters.assignLights(&camera, job_system);
+		std::chrono::high_resolution_clock::time_point end = std::chrono::high_resolution_clock::now();
+
+		double serial_ms = std::chrono::duration<double, std::milli>(middle - start).count() / iterations;
+		double parallel_ms = std::chrono::duration<double, std::milli>(end - middle).count() / iterations;
+		bool same = serial_clusters.indices == parallel_clusters.indices && serial_clusters.counts == parallel_clusters.counts;
+		correct = correct && same;
+		std::cout << " + Clusters with " << light_counts[n] << " lights: " << serial_ms << " ms serial, " << parallel_ms << " ms with "
+			<< job_system->getNumThreads() << " threads, " << serial_clusters.indices.size() << " indices" << (same ? "" : " (ERROR: results differ)") << std::endl;
+	}
+	return correct;
+}
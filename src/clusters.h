@@ -0,0 +1,89 @@
+#ifndef CLUSTERS_H
+#define CLUSTERS_H
+
+#include "framework.h"
+#include <vector>
+
+class Camera;
+class Shader;
+class Texture;
+class JobSystem;
+
+namespace GTR {
+
+	class LightEntity;
+
+	// grid of clusters in the view frustum (the slices in depth grow exponentially)
+	#define CLUSTERS_X 16
+	#define CLUSTERS_Y 9
+	#define CLUSTERS_Z 24
+	#define NUM_CLUSTERS (CLUSTERS_X * CLUSTERS_Y * CLUSTERS_Z)
+	// lights the shader reads per cluster (MAX_CLUSTER_LIGHTS in clustered.fs)
+	#define MAX_LIGHTS_PER_CLUSTER 128
+	// directional lights reach every cluster, they go in uniforms (MAX_DIRECTIONAL_LIGHTS in clustered.fs)
+	#define MAX_CLUSTER_DIRECTIONAL_LIGHTS 4
+
+	// A point or spot light as the clusters need it
+	struct sClusterLight {
+		Vector3 position;
+		float max_distance;
+		Vector3 color;
+		int light_type;
+		Vector3 direction;
+		float cone_angle;
+	};
+
+	// Clustered forward shading: every cluster has the list of lights that reach it,
+	// so a pixel only evaluates the lights of its cluster.
+	// The assignment is done in the CPU (one job per depth slice) and the lists are uploaded in float textures
+	class LightClusters
+	{
+	public:
+		std::vector<sClusterLight> lights;
+		std::vector<LightEntity*> directional_lights;
+
+		// result of the assignment, the lights of cluster i are indices[offsets[i]...offsets[i]+counts[i]]
+		std::vector<int> offsets;
+		std::vector<int> counts;
+		std::vector<int> indices;
+		int num_overflows; // clusters with more lights than MAX_LIGHTS_PER_CLUSTER in the last assignment
+
+		Texture* lights_texture; // 3 texels per light: position and range, color and type, direction and cone
+		Texture* grid_texture; // 1 texel per cluster: offset and count
+		Texture* indices_texture; // 4 indices per texel
+
+		LightClusters();
+		~LightClusters();
+
+		// Takes the visible lights of the scene
+		void setLights(std::vector<LightEntity*>& lights);
+		// Builds the light list of every cluster of the camera (no OpenGL calls), job_system can be NULL
+		void assignLights(Camera* camera, JobSystem* job_system);
+		// Sends the lists to the textures
+		void upload();
+		void setUniforms(Shader* shader);
+
+	private:
+		std::vector<Vector4> view_spheres; // sphere of every light in view space
+		std::vector< std::vector<int> > slice_pairs; // (cluster, light) pairs found by the job of every slice
+		std::vector< std::vector<int> > slice_indices; // lights of every cluster of a slice, filled by its job
+		std::vector< std::vector<int> > slice_counts;
+		std::vector<float> texture_data;
+		Vector2 viewport_size;
+
+		// camera of the last assignment
+		Vector3 camera_eye;
+		Vector3 camera_front;
+		float near_plane;
+		float depth_scale; // slice = log(depth) * depth_scale - depth_bias
+		float depth_bias;
+
+		void assignSlice(int z, Camera* camera);
+	};
+
+	// Times the CPU assignment of 1k and 10k random lights, serial and with the job system, and prints it
+	// (false if the two give different lists)
+	bool benchmarkLightClusters(JobSystem* job_system);
+};
+
+#endif
@@ -0,0 +1,329 @@
+#include "commandlist.h"
+#include "shader.h"
+#include "texture.h"
+#include "mesh.h"
+#include "glstate.h"
+#include "uniformbuffer.h"
+#include "streambuffer.h"
+#include <cassert>
+#include <cstring>
+
+//every command starts with this, its data follows (the size includes the header and keeps the next command aligned)
+struct sCommandHeader {
+	int type;
+	int size;
+};
+
+struct sUniformCommand {
+	const UniformHandle* handle;
+	int type;
+	int count; //the values follow (ints are stored as they are)
+};
+
+struct sTextureCommand {
+	int slot;
+	int target;
+	unsigned int texture_id;
+};
+
+struct sUniformBlockCommand {
+	int binding;
+	int size; //the data follows
+};
+
+struct sBufferRangeCommand {
+	UniformBuffer* buffer;
+	int offset;
+	int size;
+};
+
+struct sDrawCommand {
+	Mesh* mesh;
+	int primitive;
+	int num_instances; //the models follow
+};
+
+#define COMMAND_ALIGNMENT 16
+
+static int getUniformSize(eUniformType type)
+{
+	switch (type)
+	{
+		case UNIFORM_VECTOR3: return 3 * sizeof(float);
+		case UNIFORM_VECTOR4: return 4 * sizeof(float);
+		case UNIFORM_MATRIX44: return 16 * sizeof(float);
+		default: return 4;
+	}
+}
+
+CommandList::CommandList()
+{
+	clear();
+}
+
+void CommandList::clear()
+{
+	data.clear();
+	num_commands = 0;
+	num_draws = 0;
+	num_draws_saved = 0;
+	num_material_uploads = 0;
+}
+
+void* CommandList::push(eCommandType type, int size)
+{
+	int total = (sizeof(sCommandHeader) + size + COMMAND_ALIGNMENT - 1) / COMMAND_ALIGNMENT * COMMAND_ALIGNMENT;
+	int offset = (int)data.size();
+	data.resize(offset + total);
+	sCommandHeader* header = (sCommandHeader*)&data[offset];
+	header->type = type;
+	header->size = total;
+	num_commands++;
+	return &data[offset + sizeof(sCommandHeader)];
+}
+
+void CommandList::bindPipeline(const sPipelineState& state)
+{
+	*(sPipelineState*)push(CMD_BIND_PIPELINE, sizeof(sPipelineState)) = state;
+}
+
+void CommandList::setUniform(const UniformHandle& handle, int value)
+{
+	setUniformArray(handle, UNIFORM_INT, &value, 1);
+}
+
+void CommandList::setUniform(const UniformHandle& handle, float value)
+{
+	setUniformArray(handle, UNIFORM_FLOAT, &value, 1);
+}
+
+void CommandList::setUniform(const UniformHandle& handle, const Vector3& value)
+{
+	setUniformArray(handle, UNIFORM_VECTOR3, &value.x, 1);
+}
+
+void CommandList::setUniform(const UniformHandle& handle, const Vector4& value)
+{
+	setUniformArray(handle, UNIFORM_VECTOR4, &value.x, 1);
+}
+
+void CommandList::setUniform(const UniformHandle& handle, const Matrix44& value)
+{
+	setUniformArray(handle, UNIFORM_MATRIX44, value.m, 1);
+}
+
+void CommandList::setUniformArray(const UniformHandle& handle, eUniformType type, const void* values, int count)
+{
+	int size = getUniformSize(type) * count;
+	sUniformCommand* command = (sUniformCommand*)push(CMD_SET_UNIFORM, sizeof(sUniformCommand) + size);
+	command->handle = &handle;
+	command->type = type;
+	command->count = count;
+	memcpy(command + 1, values, size);
+}
+
+void CommandList::bindTexture(int slot, Texture* texture)
+{
+	sTextureCommand* command = (sTextureCommand*)push(CMD_BIND_TEXTURE, sizeof(sTextureCommand));
+	command->slot = slot;
+	command->target = texture->texture_type;
+	command->texture_id = texture->texture_id;
+}
+
+void CommandList::setUniformBlock(int binding, const void* block, int size)
+{
+	sUniformBlockCommand* command = (sUniformBlockCommand*)push(CMD_SET_UNIFORM_BLOCK, sizeof(sUniformBlockCommand) + size);
+	command->binding = binding;
+	command->size = size;
+	memcpy(command + 1, block, size);
+	num_material_uploads++;
+}
+
+void CommandList::bindBufferRange(UniformBuffer* buffer, int offset, int size)
+{
+	sBufferRangeCommand* command = (sBufferRangeCommand*)push(CMD_BIND_BUFFER_RANGE, sizeof(sBufferRangeCommand));
+	command->buffer = buffer;
+	command->offset = offset;
+	command->size = size;
+}
+
+void CommandList::draw(Mesh* mesh, int primitive, const Matrix44* instanced_models, int num_instances)
+{
+	//the models start aligned after the command
+	int models_offset = (sizeof(sDrawCommand) + COMMAND_ALIGNMENT - 1) / COMMAND_ALIGNMENT * COMMAND_ALIGNMENT;
+	sDrawCommand* command = (sDrawCommand*)push(CMD_DRAW, models_offset + num_instances * sizeof(Matrix44));
+	command->mesh = mesh;
+	command->primitive = primitive;
+	command->num_instances = num_instances;
+	if (num_instances)
+		memcpy((char*)command + models_offset, instanced_models, num_instances * sizeof(Matrix44));
+	num_draws++;
+}
+
+void CommandList::replay(CommandBackend* backend) const
+{
+	int models_offset = (sizeof(sDrawCommand) + COMMAND_ALIGNMENT - 1) / COMMAND_ALIGNMENT * COMMAND_ALIGNMENT;
+	for (int offset = 0; offset < data.size(); )
+	{
+		const sCommandHeader* header = (const sCommandHeader*)&data[offset];
+		const char* command = &data[offset + sizeof(sCommandHeader)];
+		switch (header->type)
+		{
+			case CMD_BIND_PIPELINE:
+				backend->bindPipeline(*(const sPipelineState*)command);
+				break;
+			case CMD_SET_UNIFORM:
+			{
+				const sUniformCommand* uniform = (const sUniformCommand*)command;
+				backend->setUniform(uniform->handle, (eUniformType)uniform->type, uniform + 1, uniform->count);
+				break;
+			}
+			case CMD_BIND_TEXTURE:
+			{
+				const sTextureCommand* texture = (const sTextureCommand*)command;
+				backend->bindTexture(texture->slot, texture->target, texture->texture_id);
+				break;
+			}
+			case CMD_SET_UNIFORM_BLOCK:
+			{
+				const sUniformBlockCommand* block = (const sUniformBlockCommand*)command;
+				backend->setUniformBlock(block->binding, block + 1, block->size);
+				break;
+			}
+			case CMD_BIND_BUFFER_RANGE:
+			{
+				const sBufferRangeCommand* range = (const sBufferRangeCommand*)command;
+				backend->bindBufferRange(range->buffer, range->offset, range->size);
+				break;
+			}
+			case CMD_DRAW:
+			{
+				const sDrawCommand* draw = (const sDrawCommand*)command;
+				backend->draw(draw->mesh, draw->primitive, draw->num_instances ? (const Matrix44*)(command + models_offset) : NULL, draw->num_instances);
+				break;
+			}
+			default:
+				assert(0 && "unknown command");
+		}
+		offset += header->size;
+	}
+}
+
+void GLCommandBackend::bindPipeline(const sPipelineState& state)
+{
+	if (Shader::current != state.shader)
+		state.shader->enable();
+	GLState::set(GL_BLEND, state.blend);
+	if (state.blend)
+		GLState::blendFunc(state.blend_src, state.blend_dst);
+	GLState::set(GL_CULL_FACE, state.cull_face);
+	GLState::depthFunc(state.depth_func);
+	GLState::depthMask(state.depth_mask);
+}
+
+void GLCommandBackend::setUniform(const UniformHandle* handle, eUniformType type, const void* value, int count)
+{
+	Shader* shader = Shader::current;
+	const float* v = (const float*)value;
+	if (count > 1)
+	{
+		switch (type)
+		{
+			case UNIFORM_INT: shader->setUniform1Array(*handle, (const int*)value, count); break;
+			case UNIFORM_FLOAT: shader->setUniform1Array(*handle, v, count); break;
+			case UNIFORM_VECTOR3: shader->setUniform3Array(*handle, v, count); break;
+			case UNIFORM_VECTOR4: shader->setUniform4Array(*handle, v, count); break;
+			case UNIFORM_MATRIX44: shader->setMatrix44Array(*handle, (const Matrix44*)value, count); break;
+		}
+		return;
+	}
+	switch (type)
+	{
+		case UNIFORM_INT: shader->setUniform(*handle, *(const int*)value); break;
+		case UNIFORM_FLOAT: shader->setUniform(*handle, v[0]); break;
+		case UNIFORM_VECTOR3: shader->setUniform(*handle, Vector3(v[0], v[1], v[2])); break;
+		case UNIFORM_VECTOR4: shader->setUniform(*handle, Vector4(v[0], v[1], v[2], v[3])); break;
+		case UNIFORM_MATRIX44: shader->setUniform(*handle, *(const Matrix44*)value); break;
+	}
+}
+
+void GLCommandBackend::bindTexture(int slot, int target, unsigned int texture_id)
+{
+	GLState::bindTexture(slot, target, texture_id);
+}
+
+void GLCommandBackend::setUniformBlock(int binding, const void* data, int size)
+{
+	//every block gets its own range of the stream, a range read by the previous draws is never overwritten
+	StreamBuffer* stream = StreamBuffer::getFrameStream();
+	int offset = stream->write(data, size, UniformBuffer::getOffsetAlignment());
+	stream->bindUniformRange(binding, offset, size);
+}
+
+void GLCommandBackend::bindBufferRange(UniformBuffer* buffer, int offset, int size)
+{
+	buffer->bindRange(offset, size);
+}
+
+void GLCommandBackend::draw(Mesh* mesh, int primitive, const Matrix44* instanced_models, int num_instances)
+{
+	if (num_instances > 0)
+		mesh->renderInstanced(primitive, instanced_models, num_instances);
+	else
+		mesh->render(primitive);
+}
+
+NullCommandBackend::NullCommandBackend()
+{
+	reset();
+}
+
+void NullCommandBackend::reset()
+{
+	memset(num_commands, 0, sizeof(num_commands));
+	num_triangles = 0;
+	checksum = 0;
+}
+
+void NullCommandBackend::bindPipeline(const sPipelineState& state)
+{
+	num_commands[CMD_BIND_PIPELINE]++;
+	checksum += state.depth_func + state.blend_src;
+}
+
+void NullCommandBackend::setUniform(const UniformHandle* handle, eUniformType type, const void* value, int count)
+{
+	num_commands[CMD_SET_UNIFORM]++;
+	const float* v = (const float*)value;
+	for (int i = 0; i < getUniformSize(type) / 4 * count; ++i)
+		checksum += v[i];
+}
+
+void NullCommandBackend::bindTexture(int slot, int target, unsigned int texture_id)
+{
+	num_commands[CMD_BIND_TEXTURE]++;
+	checksum += texture_id;
+}
+
+void NullCommandBackend::setUniformBlock(int binding, const void* data, int size)
+{
+	num_commands[CMD_SET_UNIFORM_BLOCK]++;
+	const float* v = (const float*)data;
+	for (int i = 0; i < size / 4; ++i)
+		checksum += v[i];
+}
+
+void NullCommandBackend::bindBufferRange(UniformBuffer* buffer, int offset, int size)
+{
+	num_commands[CMD_BIND_BUFFER_RANGE]++;
+	checksum += offset;
+}
+
+void NullCommandBackend::draw(Mesh* mesh, int primitive, const Matrix44* instanced_models, int num_instances)
+{
+	num_commands[CMD_DRAW]++;
+	int num_vertices = mesh->m_indices.size() ? (int)mesh->m_indices.size() : (int)mesh->getNumVertices();
+	num_triangles += num_vertices / 3 * (num_instances ? num_instances : 1);
+	for (int i = 0; i < num_instances; ++i)
+		checksum += instanced_models[i].m[12];
+}
@@ -0,0 +1,126 @@
+#ifndef COMMANDLIST_H
+#define COMMANDLIST_H
+
+#include "includes.h"
+#include "framework.h"
+#include <vector>
+
+class Shader;
+class Texture;
+class Mesh;
+class UniformBuffer;
+class UniformHandle;
+
+//CommandList
+//the draws of a pass written as data (bind a pipeline, set uniforms, bind textures, draw) instead of calling OpenGL,
+//so several threads can record their part of a pass at the same time and the GL thread replays them in order.
+//a backend executes the commands: GLCommandBackend calls OpenGL, NullCommandBackend only reads them (to measure the CPU cost)
+
+enum eCommandType {
+	CMD_BIND_PIPELINE,
+	CMD_SET_UNIFORM,
+	CMD_BIND_TEXTURE,
+	CMD_SET_UNIFORM_BLOCK, //data copied in the list, written to the frame stream when it is replayed
+	CMD_BIND_BUFFER_RANGE,
+	CMD_DRAW,
+	CMD_NUM_TYPES
+};
+
+enum eUniformType {
+	UNIFORM_INT,
+	UNIFORM_FLOAT,
+	UNIFORM_VECTOR3,
+	UNIFORM_VECTOR4,
+	UNIFORM_MATRIX44
+};
+
+//the shader and the fixed function state of a draw
+struct sPipelineState {
+	Shader* shader;
+	bool blend;
+	int blend_src;
+	int blend_dst;
+	bool cull_face;
+	int depth_func;
+	bool depth_mask;
+};
+
+class CommandBackend {
+public:
+	virtual ~CommandBackend() {}
+	virtual void bindPipeline(const sPipelineState& state) = 0;
+	virtual void setUniform(const UniformHandle* handle, eUniformType type, const void* value, int count) = 0;
+	virtual void bindTexture(int slot, int target, unsigned int texture_id) = 0;
+	virtual void setUniformBlock(int binding, const void* data, int size) = 0;
+	virtual void bindBufferRange(UniformBuffer* buffer, int offset, int size) = 0;
+	virtual void draw(Mesh* mesh, int primitive, const Matrix44* instanced_models, int num_instances) = 0;
+};
+
+class CommandList {
+public:
+	//stats of what was recorded since the last clear
+	int num_commands;
+	int num_draws;
+	int num_draws_saved; //calls merged in instanced draws
+	int num_material_uploads;
+
+	CommandList();
+
+	//forgets the commands, the memory is kept for the next recording
+	void clear();
+
+	void bindPipeline(const sPipelineState& state);
+	void setUniform(const UniformHandle& handle, int value);
+	void setUniform(const UniformHandle& handle, float value);
+	void setUniform(const UniformHandle& handle, const Vector3& value);
+	void setUniform(const UniformHandle& handle, const Vector4& value);
+	void setUniform(const UniformHandle& handle, const Matrix44& value);
+	//the values are copied in the list
+	void setUniformArray(const UniformHandle& handle, eUniformType type, const void* values, int count);
+	void bindTexture(int slot, Texture* texture);
+	void setUniformBlock(int binding, const void* data, int size);
+	void bindBufferRange(UniformBuffer* buffer, int offset, int size);
+	//the instance models are copied in the list
+	void draw(Mesh* mesh, int primitive, const Matrix44* instanced_models = NULL, int num_instances = 0);
+
+	//executes the commands in the order they were recorded
+	void replay(CommandBackend* backend) const;
+
+	int getBytes() const { return (int)data.size(); }
+
+private:
+	std::vector<char> data; //the commands one after the other, every one starts with its type and size
+
+	void* push(eCommandType type, int size);
+};
+
+//executes the commands with OpenGL (through GLState, so the state already set is skipped)
+class GLCommandBackend : public CommandBackend {
+public:
+	void bindPipeline(const sPipelineState& state);
+	void setUniform(const UniformHandle* handle, eUniformType type, const void* value, int count);
+	void bindTexture(int slot, int target, unsigned int texture_id);
+	void setUniformBlock(int binding, const void* data, int size);
+	void bindBufferRange(UniformBuffer* buffer, int offset, int size);
+	void draw(Mesh* mesh, int primitive, const Matrix44* instanced_models, int num_instances);
+};
+
+//executes the commands without OpenGL, it only counts them and reads their data
+class NullCommandBackend : public CommandBackend {
+public:
+	int num_commands[CMD_NUM_TYPES];
+	int num_triangles;
+	float checksum; //of the data read, so reading it is not optimized away
+
+	NullCommandBackend();
+	void reset();
+
+	void bindPipeline(const sPipelineState& state);
+	void setUniform(const UniformHandle* handle, eUniformType type, const void* value, int count);
+	void bindTexture(int slot, int target, unsigned int texture_id);
+	void setUniformBlock(int binding, const void* data, int size);
+	void bindBufferRange(UniformBuffer* buffer, int offset, int size);
+	void draw(Mesh* mesh, int primitive, const Matrix44* instanced_models, int num_instances);
+};
+
+#endif
@@ -0,0 +1,97 @@
+#include "culling.h"
+#include "camera.h"
+#include <cmath>
+
+#ifdef USE_SSE
+	#include <xmmintrin.h>
+#endif
+
+//floats in a block: 6 planes * 4 components * 4 frustums
+#define BLOCK_FLOATS (6 * 4 * 4)
+
+void FrustumSet::clear()
+{
+	num_frustums = 0;
+	planes.clear();
+}
+
+int FrustumSet::addFrustum(Camera* camera)
+{
+	if (num_frustums == MAX_FRUSTUMS)
+		return -1;
+
+	int block = num_frustums / 4;
+	int lane = num_frustums % 4;
+	if (lane == 0)
+	{
+		//empty lanes get a plane that never culls (normal zero and positive distance)
+		planes.resize(planes.size() + BLOCK_FLOATS, 0.0f);
+		for (int p = 0; p < 6; ++p)
+			for (int l = 0; l < 4; ++l)
+				planes[block * BLOCK_FLOATS + p * 16 + 12 + l] = 1.0f;
+	}
+
+	for (int p = 0; p < 6; ++p)
+		for (int c = 0; c < 4; ++c)
+			planes[block * BLOCK_FLOATS + p * 16 + c * 4 + lane] = camera->frustum[p][c];
+
+	return num_frustums++;
+}
+
+uint32_t FrustumSet::testBox(const Vector3& center, const Vector3& halfsize) const
+{
+	uint32_t mask = 0;
+	int num_blocks = (num_frustums + 3) / 4;
+	const float* block_planes = planes.empty() ? NULL : &planes[0];
+
+#ifdef USE_SSE
+	const __m128 cx = _mm_set1_ps(center.x);
+	const __m128 cy = _mm_set1_ps(center.y);
+	const __m128 cz = _mm_set1_ps(center.z);
+	const __m128 hx = _mm_set1_ps(halfsize.x);
+	const __m128 hy = _mm_set1_ps(halfsize.y);
+	const __m128 hz = _mm_set1_ps(halfsize.z);
+	const __m128 sign_bit = _mm_set1_ps(-0.0f);
+	const __m128 zero = _mm_setzero_ps();
+
+	for (int b = 0; b < num_blocks; ++b)
+	{
+		__m128 outside = zero;
+		for (int p = 0; p < 6; ++p)
+		{
+			const float* plane = block_planes + b * BLOCK_FLOATS + p * 16;
+			__m128 nx = _mm_loadu_ps(plane);
+			__m128 ny = _mm_loadu_ps(plane + 4);
+			__m128 nz = _mm_loadu_ps(plane + 8);
+			__m128 d = _mm_loadu_ps(plane + 12);
+			//distance of the center to the plane and radius of the box projected on the normal
+			__m128 distance = _mm_add_ps(_mm_add_ps(_mm_mul_ps(nx, cx), _mm_mul_ps(ny, cy)), _mm_add_ps(_mm_mul_ps(nz, cz), d));
+			__m128 radius = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_andnot_ps(sign_bit, nx), hx), _mm_mul_ps(_mm_andnot_ps(sign_bit, ny), hy)), _mm_mul_ps(_mm_andnot_ps(sign_bit, nz), hz));
+			outside = _mm_or_ps(outside, _mm_cmple_ps(_mm_add_ps(distance, radius), zero));
+		}
+		mask |= (uint32_t)(~_mm_movemask_ps(outside) & 0xF) << (b * 4);
+	}
+#else
+	for (int b = 0; b < num_blocks; ++b)
+	{
+		for (int l = 0; l < 4; ++l)
+		{
+			bool outside = false;
+			for (int p = 0; p < 6 && !outside; ++p)
+			{
+				const float* plane = block_planes + b * BLOCK_FLOATS + p * 16;
+				float distance = plane[l] * center.x + plane[4 + l] * center.y + plane[8 + l] * center.z + plane[12 + l];
+				float radius = fabs(plane[l]) * halfsize.x + fabs(plane[4 + l]) * halfsize.y + fabs(plane[8 + l]) * halfsize.z;
+				outside = distance + radius <= 0.0f;
+			}
+			if (!outside)
+				mask |= 1u << (b * 4 + l);
+		}
+	}
+#endif
+
+	//padding lanes of the last block never cull, remove them
+	if (num_frustums < MAX_FRUSTUMS)
+		mask &= (1u << num_frustums) - 1;
+	return mask;
+}
@@ -0,0 +1,39 @@
+/*  FrustumSet
+	Stores the planes of several camera frustums so a box can be tested against all of them at once.
+	The planes are stored in blocks of 4 frustums (one per SSE lane), so each plane test checks 4 cameras
+	and the result is a bitmask with the frustums that see the box.
+*/
+#ifndef CULLING_H
+#define CULLING_H
+
+#include "framework.h"
+#include <vector>
+#include <stdint.h>
+
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+	#define USE_SSE
+#endif
+
+class Camera;
+
+#define MAX_FRUSTUMS 32 //bits in the mask returned by testBox
+
+class FrustumSet {
+public:
+	FrustumSet() { num_frustums = 0; }
+
+	void clear();
+	//returns the index of the frustum (its bit in the mask) or -1 if the set is full
+	int addFrustum(Camera* camera);
+	int getNumFrustums() const { return num_frustums; }
+
+	//bit i is set if the box is not completely outside the frustum i (same test as Camera::testBoxInFrustum)
+	uint32_t testBox(const Vector3& center, const Vector3& halfsize) const;
+
+private:
+	int num_frustums;
+	//for every block of 4 frustums and every plane: nx[4], ny[4], nz[4], d[4]
+	std::vector<float> planes;
+};
+
+#endif
@@ -1,6 +1,7 @@
 #include "fbo.h"
 #include <cassert>
 #include "utils.h"
+#include "glstate.h"
 
 FBO::FBO()
 {
@@ -20,7 +21,10 @@ FBO::~FBO()
 {
 	freeTextures();
 	if (fbo_id)
+	{
+		GLState::releaseFramebuffer(fbo_id);
 		glDeleteFramebuffers(1, &fbo_id);
+	}
 	if (renderbuffer_color)
 		glDeleteRenderbuffersEXT(1, &renderbuffer_color);
 	if (renderbuffer_depth)
@@ -64,7 +68,7 @@ bool FBO::create( int width, int height, int num_textures, int format, int type,
 	for (int i = 0; i < num_textures; ++i)
 	{
 		Texture* colortex = textures[i] = new Texture(width, height, format, type, false); //,NULL, format == GL_RGBA ? GL_RGBA8 : GL_RGB8 
-		glBindTexture(colortex->texture_type, colortex->texture_id);	//we activate this id to tell opengl we are going to use this texture
+		GLState::bindTexture(colortex->texture_type, colortex->texture_id);	//we activate this id to tell opengl we are going to use this texture
 		glTexParameteri(colortex->texture_type, GL_TEXTURE_MAG_FILTER, GL_NEAREST);	//set the min filter
 		glTexParameteri(colortex->texture_type, GL_TEXTURE_MIN_FILTER, GL_NEAREST);   //set the mag filter
 		glTexParameteri(colortex->texture_type, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
@@ -116,7 +120,7 @@ bool FBO::setTextures(std::vector<Texture*> textures, Texture* depth_texture, in
 	//create and bind FBO
 	if(fbo_id == 0)
 		glGenFramebuffersEXT(1, &fbo_id);
-	glBindFramebufferEXT(GL_FRAMEBUFFER_EXT, fbo_id);
+	GLState::bindFramebuffer(fbo_id);
 	checkGLErrors();
 
 	if (depth_texture)
@@ -186,7 +190,7 @@ bool FBO::setTextures(std::vector<Texture*> textures, Texture* depth_texture, in
 		assert(0);
 		return false;
 	}
-	glBindFramebufferEXT(GL_FRAMEBUFFER_EXT, 0);
+	GLState::bindFramebuffer(GLState::default_framebuffer);
 
 	checkGLErrors();
 	return true;
@@ -199,17 +203,13 @@ bool FBO::setDepthOnly(int width, int height)
 	num_color_textures = 0;
 
 	glGenFramebuffersEXT(1, &fbo_id);
-	glBindFramebufferEXT(GL_FRAMEBUFFER_EXT, fbo_id);
-
-	glGenRenderbuffersEXT(1, &renderbuffer_color);
-	glBindRenderbufferEXT(GL_RENDERBUFFER_EXT, renderbuffer_color);
-
-	glRenderbufferStorageEXT(GL_RENDERBUFFER_EXT, GL_RGBA, width, height);
-	glFramebufferRenderbufferEXT(GL_FRAMEBUFFER_EXT, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER_EXT, renderbuffer_color);
+	GLState::bindFramebuffer(fbo_id);
 
-	//create texture
+	//only the depth texture, no color buffer is allocated (nothing is drawn or read from it)
 	depth_texture = new Texture(width, height, GL_DEPTH_COMPONENT, GL_UNSIGNED_INT, false);
 	glFramebufferTexture2DEXT(GL_FRAMEBUFFER_EXT, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, depth_texture->texture_id, 0);
+	glDrawBuffer(GL_NONE);
+	glReadBuffer(GL_NONE);
 
 	GLenum status = glCheckFramebufferStatusEXT(GL_FRAMEBUFFER_EXT);
 	if (status != GL_FRAMEBUFFER_COMPLETE_EXT)
@@ -217,7 +217,7 @@ bool FBO::setDepthOnly(int width, int height)
 		std::cout << "Error: Framebuffer object is not completed" << std::endl;
 		return false;
 	}
-	glBindFramebufferEXT(GL_FRAMEBUFFER_EXT, 0);
+	GLState::bindFramebuffer(GLState::default_framebuffer);
 	return true;
 }
 
@@ -226,7 +226,7 @@ void FBO::bind()
 	assert(glGetError() == GL_NO_ERROR);
 	Texture* tex = color_textures[0] ? color_textures[0] : depth_texture;
 	assert(tex && "framebuffer without texture");
-	glBindFramebufferEXT(GL_FRAMEBUFFER_EXT, fbo_id);
+	GLState::bindFramebuffer(fbo_id);
 	checkGLErrors();
 	glPushAttrib(GL_VIEWPORT_BIT);
 	glDrawBuffers(4, bufs);
@@ -240,7 +240,7 @@ void FBO::unbind()
 {
 	// output goes to the FBO and its attached buffers
 	glPopAttrib();
-	glBindFramebufferEXT(GL_FRAMEBUFFER_EXT, 0);
+	GLState::bindFramebuffer(GLState::default_framebuffer);
 	//glDrawBuffers(1, &one_buffer);
 	assert(glGetError() == GL_NO_ERROR);
 }
@@ -0,0 +1,202 @@
+#include "glstate.h"
+
+int GLState::num_changes = 0;
+int GLState::num_skipped = 0;
+int GLState::last_frame_changes = 0;
+int GLState::last_frame_skipped = 0;
+
+int GLState::caps[3] = { UNKNOWN, UNKNOWN, UNKNOWN };
+int GLState::blend_src = UNKNOWN;
+int GLState::blend_dst = UNKNOWN;
+int GLState::depth_func = UNKNOWN;
+int GLState::depth_mask = UNKNOWN;
+int GLState::color_mask = UNKNOWN;
+int GLState::program = UNKNOWN;
+int GLState::active_slot = UNKNOWN;
+int GLState::textures[GLSTATE_MAX_TEXTURE_SLOTS][3];
+int GLState::framebuffer = UNKNOWN;
+GLuint GLState::default_framebuffer = 0;
+int GLState::vertex_array = UNKNOWN;
+
+//start with everything unknown (the textures array can't be filled in its definition)
+static struct sGLStateInit { sGLStateInit() { GLState::invalidate(); } } gl_state_init;
+
+//position of the capability in the cache, -1 if it is not cached
+static int capIndex(GLenum cap)
+{
+	switch (cap)
+	{
+		case GL_BLEND: return 0;
+		case GL_CULL_FACE: return 1;
+		case GL_DEPTH_TEST: return 2;
+	}
+	return -1;
+}
+
+//position of the texture target in the cache, -1 if it is not cached
+static int targetIndex(GLenum target)
+{
+	switch (target)
+	{
+		case GL_TEXTURE_2D: return 0;
+		case GL_TEXTURE_CUBE_MAP: return 1;
+		case GL_TEXTURE_3D: return 2;
+	}
+	return -1;
+}
+
+bool GLState::change(int& cached, int value)
+{
+	if (cached == value)
+	{
+		num_skipped++;
+		return false;
+	}
+	cached = value;
+	num_changes++;
+	return true;
+}
+
+void GLState::set(GLenum cap, bool enabled)
+{
+	int index = capIndex(cap);
+	if (index != -1 && !change(caps[index], enabled))
+		return;
+	if (index == -1)
+		num_changes++;
+
+	if (enabled)
+		glEnable(cap);
+	else
+		glDisable(cap);
+}
+
+void GLState::blendFunc(GLenum sfactor, GLenum dfactor)
+{
+	//both factors are compared together, they are sent in the same call
+	if (blend_src == (int)sfactor && blend_dst == (int)dfactor)
+	{
+		num_skipped++;
+		return;
+	}
+	blend_src = sfactor;
+	blend_dst = dfactor;
+	num_changes++;
+	glBlendFunc(sfactor, dfactor);
+}
+
+void GLState::depthFunc(GLenum func)
+{
+	if (change(depth_func, func))
+		glDepthFunc(func);
+}
+
+void GLState::depthMask(bool write)
+{
+	if (change(depth_mask, write))
+		glDepthMask(write);
+}
+
+void GLState::colorMask(bool r, bool g, bool b, bool a)
+{
+	if (change(color_mask, r | (g << 1) | (b << 2) | (a << 3)))
+		glColorMask(r, g, b, a);
+}
+
+void GLState::useProgram(GLuint program)
+{
+	if (change(GLState::program, program))
+		glUseProgram(program);
+}
+
+void GLState::activeTexture(int slot)
+{
+	if (change(active_slot, slot))
+		glActiveTexture(GL_TEXTURE0 + slot);
+}
+
+void GLState::bindTexture(GLenum target, GLuint texture)
+{
+	int index = targetIndex(target);
+	if (active_slot < 0 || active_slot >= GLSTATE_MAX_TEXTURE_SLOTS || index == -1)
+	{
+		//we don't know where it goes, so we send it and forget what that slot had
+		if (active_slot >= 0 && active_slot < GLSTATE_MAX_TEXTURE_SLOTS)
+			textures[active_slot][0] = textures[active_slot][1] = textures[active_slot][2] = UNKNOWN;
+		num_changes++;
+		glBindTexture(target, texture);
+		return;
+	}
+	if (change(textures[active_slot][index], texture))
+		glBindTexture(target, texture);
+}
+
+void GLState::bindTexture(int slot, GLenum target, GLuint texture)
+{
+	activeTexture(slot);
+	bindTexture(target, texture);
+}
+
+void GLState::bindFramebuffer(GLuint fbo)
+{
+	if (change(framebuffer, fbo))
+		glBindFramebufferEXT(GL_FRAMEBUFFER_EXT, fbo);
+}
+
+void GLState::bindVertexArray(GLuint vao)
+{
+#ifdef USE_VERTEX_ARRAYS
+	if (change(vertex_array, vao))
+		glBindVertexArray(vao);
+#endif
+}
+
+void GLState::releaseProgram(GLuint program)
+{
+	if (GLState::program == (int)program)
+		GLState::program = UNKNOWN;
+}
+
+void GLState::releaseTexture(GLuint texture)
+{
+	for (int i = 0; i < GLSTATE_MAX_TEXTURE_SLOTS; ++i)
+		for (int j = 0; j < 3; ++j)
+			if (textures[i][j] == (int)texture)
+				textures[i][j] = UNKNOWN;
+}
+
+void GLState::releaseFramebuffer(GLuint fbo)
+{
+	if (framebuffer == (int)fbo)
+		framebuffer = UNKNOWN;
+}
+
+void GLState::releaseVertexArray(GLuint vao)
+{
+	if (vertex_array == (int)vao)
+		vertex_array = UNKNOWN;
+}
+
+void GLState::invalidate()
+{
+	caps[0] = caps[1] = caps[2] = UNKNOWN;
+	blend_src = blend_dst = UNKNOWN;
+	depth_func = UNKNOWN;
+	depth_mask = UNKNOWN;
+	color_mask = UNKNOWN;
+	program = UNKNOWN;
+	active_slot = UNKNOWN;
+	for (int i = 0; i < GLSTATE_MAX_TEXTURE_SLOTS; ++i)
+		textures[i][0] = textures[i][1] = textures[i][2] = UNKNOWN;
+	framebuffer = UNKNOWN;
+	vertex_array = UNKNOWN;
+}
+
+void GLState::newFrame()
+{
+	last_frame_changes = num_changes;
+	last_frame_skipped = num_skipped;
+	num_changes = 0;
+	num_skipped = 0;
+	invalidate();
+}
@@ -0,0 +1,76 @@
+/*  GLState
+	Keeps a copy of the OpenGL state we change more often (capabilities, blending, depth, program,
+	textures, framebuffer and vertex array) so calls that would not change anything are skipped.
+	Every change of this state must go through here, if some code changes it directly (like ImGui)
+	call GLState::invalidate() after it so the next calls are issued again.
+*/
+#ifndef GLSTATE_H
+#define GLSTATE_H
+
+#include "includes.h"
+
+#define GLSTATE_MAX_TEXTURE_SLOTS 16
+
+class GLState {
+public:
+	//counters of the current frame
+	static int num_changes; //calls sent to OpenGL
+	static int num_skipped; //calls skipped because the state was already set
+
+	//counters of the last complete frame (to show them in the GUI)
+	static int last_frame_changes;
+	static int last_frame_skipped;
+
+	//capabilities (only GL_BLEND, GL_CULL_FACE and GL_DEPTH_TEST are cached, the rest are always sent)
+	static void enable(GLenum cap) { set(cap, true); }
+	static void disable(GLenum cap) { set(cap, false); }
+	static void set(GLenum cap, bool enabled);
+
+	static void blendFunc(GLenum sfactor, GLenum dfactor);
+	static void depthFunc(GLenum func);
+	static void depthMask(bool write);
+	static void colorMask(bool r, bool g, bool b, bool a);
+
+	static void useProgram(GLuint program);
+
+	static void activeTexture(int slot);
+	static void bindTexture(GLenum target, GLuint texture); //in the active slot
+	static void bindTexture(int slot, GLenum target, GLuint texture);
+
+	static void bindFramebuffer(GLuint fbo);
+	//where the frame goes when no FBO is bound (0 is the window, the headless mode renders to its own FBO)
+	static GLuint default_framebuffer;
+
+	static void bindVertexArray(GLuint vao);
+
+	//call these before deleting an object, OpenGL unbinds it and the id can be reused later
+	static void releaseProgram(GLuint program);
+	static void releaseTexture(GLuint texture);
+	static void releaseFramebuffer(GLuint fbo);
+	static void releaseVertexArray(GLuint vao);
+
+	//forget everything, the next calls will be sent to OpenGL
+	static void invalidate();
+
+	//stores the counters of the frame and invalidates the state (someone else may have changed it)
+	static void newFrame();
+
+private:
+	enum { UNKNOWN = -1 };
+
+	static int caps[3]; //blend, cull face, depth test
+	static int blend_src, blend_dst;
+	static int depth_func;
+	static int depth_mask;
+	static int color_mask;
+	static int program;
+	static int active_slot;
+	static int textures[GLSTATE_MAX_TEXTURE_SLOTS][3]; //2D, cubemap, 3D
+	static int framebuffer;
+	static int vertex_array;
+
+	//returns true when the cached value is different (and updates it), false when the call can be skipped
+	static bool change(int& cached, int value);
+};
+
+#endif
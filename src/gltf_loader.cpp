@@ -10,8 +10,10 @@
 #include "material.h"
 #include "prefab.h"
 #include "utils.h"
+#include "jobsystem.h"
 
 #include <iostream>
+#include <algorithm>
 
 //** PARSING GLTF IS UGLY
 std::string base_folder;
@@ -457,6 +459,130 @@ cgltf_result internalOpenMemory(const struct cgltf_memory_options* memory_option
 	return cgltf_result_success;
 }
 
+//the meshes of the nodes that can have LODs (with indices and without LODs yet), a mesh can be in several nodes
+void collectLODMeshes(GTR::Node* node, std::vector<Mesh*>& meshes)
+{
+	Mesh* mesh = node->mesh;
+	if (mesh && mesh->m_indices.size() && mesh->lods.empty() && std::find(meshes.begin(), meshes.end(), mesh) == meshes.end())
+		meshes.push_back(mesh);
+	for (int i = 0; i < node->children.size(); ++i)
+		collectLODMeshes(node->children[i], meshes);
+}
+
+//change it when the simplification changes, so the LODs in the cache are created again
+#define LOD_CACHE_VERSION 1
+
+template<typename T> void hashLODStream(uint64_t& hash, const std::vector<T>& stream)
+{
+	const unsigned char* bytes = stream.size() ? (const unsigned char*)&stream[0] : NULL;
+	for (size_t i = 0; i < stream.size() * sizeof(T); ++i)
+		hash = (hash ^ bytes[i]) * 1099511628211ULL;
+}
+
+//hash of what the LODs of a mesh are made from (its streams and the settings of the simplification), a LOD in the cache is only used if it matches
+uint64_t hashLODSource(Mesh* mesh)
+{
+	uint64_t hash = 14695981039346656037ULL;
+	std::vector<float> settings = { LOD_CACHE_VERSION, MAX_MESH_LODS, MESH_LOD_ERROR };
+	hashLODStream(hash, settings);
+	hashLODStream(hash, mesh->vertices);
+	hashLODStream(hash, mesh->normals);
+	hashLODStream(hash, mesh->uvs);
+	hashLODStream(hash, mesh->m_uvs1);
+	hashLODStream(hash, mesh->colors);
+	hashLODStream(hash, mesh->interleaved);
+	hashLODStream(hash, mesh->m_indices);
+	return hash;
+}
+
+//name of the .mbin with a LOD of a mesh of the prefab (writeBin adds the extension), with the hash of its source
+std::string getLODFilename(const char* filename, Mesh* mesh, int mesh_index, int level, uint64_t hash)
+{
+	std::string mesh_name = mesh->name.size() ? mesh->name : std::to_string(mesh_index);
+	for (int i = 0; i < mesh_name.size(); ++i)
+		if (!isalnum((unsigned char)mesh_name[i]))
+			mesh_name[i] = '_';
+	char hash_text[17];
+	sprintf(hash_text, "%016llx", (unsigned long long)hash);
+	return std::string(filename) + "." + mesh_name + "." + hash_text + ".lod" + std::to_string(level);
+}
+
+//creates the LODs of the meshes of the prefab (or reads them from the cache), the simplification runs in several threads
+void createPrefabLODs(GTR::Prefab* prefab, const char* filename)
+{
+	std::vector<Mesh*> meshes;
+	collectLODMeshes(&prefab->root, meshes);
+	if (meshes.empty())
+		return;
+
+	//the levels that are in the cache, the files of a mesh that changed have another hash and are not found
+	std::vector<int> pending; //the meshes to simplify
+	std::vector<uint64_t> hashes(meshes.size(), 0);
+	for (int i = 0; i < meshes.size(); ++i)
+	{
+		if (Mesh::use_lod_cache)
+		{
+			hashes[i] = hashLODSource(meshes[i]);
+			for (int level = 1; level <= MAX_MESH_LODS; ++level)
+			{
+				Mesh* lod = new Mesh();
+				if (!lod->readBin((getLODFilename(filename, meshes[i], i, level, hashes[i]) + ".mbin").c_str(), false))
+				{
+					delete lod;
+					break;
+				}
+				lod->name = meshes[i]->name + "::lod" + std::to_string(level);
+				meshes[i]->lods.push_back(lod);
+			}
+			//the simplification of this mesh already gave no levels
+			FILE* marker = meshes[i]->lods.empty() ? fopen((getLODFilename(filename, meshes[i], i, 0, hashes[i]) + ".none").c_str(), "rb") : NULL;
+			if (marker)
+			{
+				fclose(marker);
+				continue;
+			}
+		}
+		if (meshes[i]->lods.empty())
+			pending.push_back(i);
+	}
+
+	//the renderer is not created yet when the scene is loaded, so the loader has its own threads while it simplifies
+	std::vector< std::vector< std::vector<unsigned int> > > lod_indices(pending.size());
+	std::vector< std::vector<float> > lod_errors(pending.size());
+	if (pending.size())
+	{
+		double time = getTime();
+		JobSystem job_system;
+		job_system.parallelFor((int)pending.size(), [&](int index, int thread) {
+			Mesh* mesh = meshes[pending[index]];
+			mesh->simplifyLODs(mesh->box.halfsize.length() * MESH_LOD_ERROR, lod_indices[index], lod_errors[index]);
+		});
+		stdlog(std::string(" - LODs of ") + std::to_string(pending.size()) + " meshes: " + std::to_string((getTime() - time) * 0.001) + " sec");
+	}
+
+	//the meshes are created here (not in the jobs) and the files and the GPU are only used from this thread
+	for (int i = 0; i < pending.size(); ++i)
+	{
+		Mesh* mesh = meshes[pending[i]];
+		for (int level = 0; level < lod_indices[i].size(); ++level)
+		{
+			Mesh* lod = mesh->addLOD(lod_indices[i][level], lod_errors[i][level]);
+			if (Mesh::use_lod_cache)
+				lod->writeBin(getLODFilename(filename, mesh, pending[i], level + 1, hashes[pending[i]]).c_str());
+		}
+		//an empty file marks the meshes without levels, so they are not simplified again in every load
+		if (Mesh::use_lod_cache && lod_indices[i].empty())
+		{
+			FILE* f = fopen((getLODFilename(filename, mesh, pending[i], 0, hashes[pending[i]]) + ".none").c_str(), "wb");
+			if (f)
+				fclose(f);
+		}
+	}
+	for (int i = 0; i < meshes.size(); ++i)
+		for (int level = 0; level < meshes[i]->lods.size(); ++level)
+			meshes[i]->lods[level]->uploadToVRAM();
+}
+
 GTR::Prefab* loadGLTF(const char *filename, cgltf_data *data, cgltf_options& options)
 {
 	cgltf_result result;
@@ -519,8 +645,12 @@ GTR::Prefab* loadGLTF(const char *filename, cgltf_data *data, cgltf_options& opt
 	//prefab->root.model = model;
 
 	prefab->updateNodesByName();
+	prefab->updateNodeIndices();
 	prefab->updateBounding();
 
+	//simplified versions of the meshes to use them far from the camera
+	createPrefabLODs(prefab, filename);
+
 	//frees all data, including bin
 	cgltf_free(data);
 
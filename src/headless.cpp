@@ -0,0 +1,382 @@
+#include "headless.h"
+#include "includes.h"
+#include "application.h"
+#include "camera.h"
+#include "fbo.h"
+#include "glstate.h"
+#include "texture.h"
+#include "renderer.h"
+#include "scene.h"
+#include "utils.h"
+#include "profiler.h"
+#include "tests.h"
+
+#ifdef USE_EGL
+	#include <EGL/egl.h>
+	#include <EGL/eglext.h>
+#elif defined(USE_OSMESA)
+	#include <GL/osmesa.h>
+#endif
+
+#include <chrono>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <cstring>
+#include <cstdlib>
+#include <cstdio>
+
+//globals of the application
+extern Camera* camera;
+extern GTR::Scene* scene;
+extern GTR::Renderer* renderer;
+
+bool parseHeadlessOptions(int argc, char** argv, sHeadlessOptions& options)
+{
+	options.scene_filename = "data/scene.json";
+	options.num_frames = 120;
+	options.width = 1280;
+	options.height = 720;
+	options.output_folder = "headless";
+	options.capture_every = 30;
+	options.path_filename = "";
+	options.run_tests = false;
+	options.benchmarks = false;
+	options.tests_filter = "";
+
+	//the other arguments are only read in the headless mode
+	bool headless = false;
+	for (int i = 1; i < argc; ++i)
+		if (strcmp(argv[i], "--headless") == 0 || strcmp(argv[i], "--test") == 0 || strcmp(argv[i], "--benchmark") == 0)
+			headless = true;
+	if (!headless)
+		return false;
+
+	for (int i = 1; i < argc; ++i)
+	{
+		std::string arg = argv[i];
+		bool has_value = i + 1 < argc;
+		if (arg == "--headless")
+			continue;
+		else if (arg == "--scene" && has_value)
+			options.scene_filename = argv[++i];
+		else if (arg == "--frames" && has_value)
+			options.num_frames = std::max(1, atoi(argv[++i]));
+		else if (arg == "--size" && has_value)
+			sscanf(argv[++i], "%dx%d", &options.width, &options.height);
+		else if (arg == "--output" && has_value)
+			options.output_folder = argv[++i];
+		else if (arg == "--capture" && has_value)
+			options.capture_every = std::max(0, atoi(argv[++i]));
+		else if (arg == "--path" && has_value)
+			options.path_filename = argv[++i];
+		else if (arg == "--test" || arg == "--benchmark")
+		{
+			options.run_tests = true;
+			options.benchmarks = arg == "--benchmark";
+			if (has_value && strncmp(argv[i + 1], "--", 2) != 0)
+				options.tests_filter = argv[++i];
+		}
+		else
+			std::cout << "Unknown argument: " << arg << std::endl;
+	}
+	return true;
+}
+
+// *********************************
+//the offscreen context, one of the three depending on the build
+
+#ifdef USE_EGL
+
+static const char* context_name = "EGL pbuffer";
+static EGLDisplay egl_display = EGL_NO_DISPLAY;
+static EGLSurface egl_surface = EGL_NO_SURFACE;
+static EGLContext egl_context = EGL_NO_CONTEXT;
+
+//without a display server set EGL_PLATFORM=surfaceless (Mesa) so the default display doesn't look for one
+static bool createContext(int width, int height)
+{
+	EGLint major, minor;
+	egl_display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+	if (egl_display == EGL_NO_DISPLAY || !eglInitialize(egl_display, &major, &minor))
+		return false;
+
+	const EGLint config_attributes[] = { EGL_SURFACE_TYPE, EGL_PBUFFER_BIT, EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+		EGL_RED_SIZE, 8, EGL_GREEN_SIZE, 8, EGL_BLUE_SIZE, 8, EGL_ALPHA_SIZE, 8, EGL_DEPTH_SIZE, 24, EGL_NONE };
+	EGLConfig config;
+	EGLint num_configs = 0;
+	if (!eglChooseConfig(egl_display, config_attributes, &config, 1, &num_configs) || !num_configs)
+		return false;
+
+	const EGLint pbuffer_attributes[] = { EGL_WIDTH, width, EGL_HEIGHT, height, EGL_NONE };
+	egl_surface = eglCreatePbufferSurface(egl_display, config, pbuffer_attributes);
+	if (egl_surface == EGL_NO_SURFACE)
+		return false;
+
+	//compatibility profile, the framework still uses some fixed function calls (glPushAttrib, glMatrixMode)
+	eglBindAPI(EGL_OPENGL_API);
+	const EGLint context_attributes[] = { EGL_CONTEXT_MAJOR_VERSION_KHR, 3, EGL_CONTEXT_MINOR_VERSION_KHR, 3,
+		EGL_CONTEXT_OPENGL_PROFILE_MASK_KHR, EGL_CONTEXT_OPENGL_COMPATIBILITY_PROFILE_BIT_KHR, EGL_NONE };
+	egl_context = eglCreateContext(egl_display, config, EGL_NO_CONTEXT, context_attributes);
+	if (egl_context == EGL_NO_CONTEXT)
+		return false;
+	return eglMakeCurrent(egl_display, egl_surface, egl_surface, egl_context) == EGL_TRUE;
+}
+
+static void destroyContext()
+{
+	if (egl_display == EGL_NO_DISPLAY)
+		return;
+	eglMakeCurrent(egl_display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+	if (egl_context != EGL_NO_CONTEXT)
+		eglDestroyContext(egl_display, egl_context);
+	if (egl_surface != EGL_NO_SURFACE)
+		eglDestroySurface(egl_display, egl_surface);
+	eglTerminate(egl_display);
+}
+
+#elif defined(USE_OSMESA)
+
+static const char* context_name = "OSMesa";
+static OSMesaContext osmesa_context = NULL;
+static std::vector<unsigned char> osmesa_buffer; //the default framebuffer lives in memory
+
+static bool createContext(int width, int height)
+{
+	const int attributes[] = { OSMESA_FORMAT, OSMESA_RGBA, OSMESA_DEPTH_BITS, 24, OSMESA_STENCIL_BITS, 8,
+		OSMESA_PROFILE, OSMESA_COMPAT_PROFILE, OSMESA_CONTEXT_MAJOR_VERSION, 3, OSMESA_CONTEXT_MINOR_VERSION, 3, 0 };
+	osmesa_context = OSMesaCreateContextAttribs(attributes, NULL);
+	if (!osmesa_context) //older versions can't ask for a version
+		osmesa_context = OSMesaCreateContextExt(OSMESA_RGBA, 24, 8, 0, NULL);
+	if (!osmesa_context)
+		return false;
+	osmesa_buffer.resize(width * height * 4);
+	return OSMesaMakeCurrent(osmesa_context, &osmesa_buffer[0], GL_UNSIGNED_BYTE, width, height) == GL_TRUE;
+}
+
+static void destroyContext()
+{
+	if (osmesa_context)
+		OSMesaDestroyContext(osmesa_context);
+	osmesa_context = NULL;
+}
+
+#else
+
+static const char* context_name = "hidden SDL window";
+static SDL_Window* hidden_window = NULL;
+static SDL_GLContext sdl_context = NULL;
+
+//needs a display (a virtual one like Xvfb works), build with USE_EGL or USE_OSMESA where there is none
+static bool createContext(int width, int height)
+{
+	if (SDL_Init(SDL_INIT_VIDEO) != 0)
+		return false;
+	SDL_GL_SetAttribute(SDL_GL_RED_SIZE, 8);
+	SDL_GL_SetAttribute(SDL_GL_GREEN_SIZE, 8);
+	SDL_GL_SetAttribute(SDL_GL_BLUE_SIZE, 8);
+	SDL_GL_SetAttribute(SDL_GL_DEPTH_SIZE, 24);
+	hidden_window = SDL_CreateWindow("GTR headless", SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED, width, height, SDL_WINDOW_OPENGL | SDL_WINDOW_HIDDEN);
+	if (!hidden_window)
+		return false;
+	sdl_context = SDL_GL_CreateContext(hidden_window);
+	return sdl_context != NULL;
+}
+
+static void destroyContext()
+{
+	if (sdl_context)
+		SDL_GL_DeleteContext(sdl_context);
+	if (hidden_window)
+		SDL_DestroyWindow(hidden_window);
+	SDL_Quit();
+}
+
+#endif
+
+// *********************************
+
+//keyframes of the camera, an orbit around the center of the scene camera if there is no file
+static bool loadCameraPath(const sHeadlessOptions& options, std::vector<Vector3>& eyes, std::vector<Vector3>& centers)
+{
+	if (options.path_filename.empty())
+	{
+		Vector3 center = scene->main_camera.center;
+		Vector3 offset = scene->main_camera.eye - center;
+		const int num_keys = 32;
+		for (int i = 0; i <= num_keys; ++i)
+		{
+			float angle = i * 2.0f * (float)PI / num_keys;
+			float c = cos(angle), s = sin(angle);
+			eyes.push_back(center + Vector3(offset.x * c - offset.z * s, offset.y, offset.x * s + offset.z * c));
+			centers.push_back(center);
+		}
+		return true;
+	}
+
+	std::string content;
+	if (!readFile(options.path_filename, content))
+		return false;
+	std::stringstream lines(content);
+	std::string line;
+	while (std::getline(lines, line))
+	{
+		Vector3 eye, center;
+		if (sscanf(line.c_str(), "%f %f %f %f %f %f", &eye.x, &eye.y, &eye.z, &center.x, &center.y, &center.z) != 6)
+			continue;
+		eyes.push_back(eye);
+		centers.push_back(center);
+	}
+	return eyes.size() > 0;
+}
+
+//linear interpolation between the keyframes, t in [0,1]
+static void getCameraAt(const std::vector<Vector3>& keys, float t, Vector3& result)
+{
+	if (keys.size() == 1)
+	{
+		result = keys[0];
+		return;
+	}
+	float position = t * (keys.size() - 1);
+	int index = std::min((int)position, (int)keys.size() - 2);
+	float f = position - index;
+	result = keys[index] * (1.0f - f) + keys[index + 1] * f;
+}
+
+static double getPercentile(std::vector<double> values, float percentile)
+{
+	std::sort(values.begin(), values.end());
+	return values[std::min((int)values.size() - 1, (int)(percentile * values.size()))];
+}
+
+//renders the frames of the camera path to the target and writes the results
+static int renderFrames(Application* app, FBO* target, const sHeadlessOptions& options)
+{
+	int width = options.width;
+	int height = options.height;
+
+	std::vector<Vector3> eyes, centers;
+	if (!loadCameraPath(options, eyes, centers))
+	{
+		std::cout << "Error: the camera path " << options.path_filename << " has no keyframes" << std::endl;
+		return 1;
+	}
+
+	std::string stats_filename = options.output_folder + "/stats.csv";
+	createFolder(options.output_folder);
+	std::ofstream stats(stats_filename.c_str());
+	if (!stats)
+	{
+		std::cout << "Error: can't write in " << options.output_folder << std::endl;
+		return 1;
+	}
+	//the calls without instancing are the draws plus the ones merged in instanced draws
+	stats << "frame,frame_ms,gpu_ms,draw_calls,draw_calls_without_instancing" << std::endl;
+
+	//the GPU time is the distance between two timestamps (the first GL_TIME_ELAPSED query of some drivers is wrong)
+	GLuint time_queries[2];
+	glGenQueries(2, time_queries);
+	std::vector<double> frame_times, gpu_times;
+	Image capture;
+	int num_captures = 0;
+	for (int frame = 0; frame < options.num_frames; ++frame)
+	{
+		//a fixed time step, every run renders the same frames
+		float t = options.num_frames > 1 ? frame / (float)(options.num_frames - 1) : 0.0f;
+		Vector3 eye, center;
+		getCameraAt(eyes, t, eye);
+		getCameraAt(centers, t, center);
+		camera->lookAt(eye, center, Vector3(0, 1, 0));
+		app->frame = frame;
+		app->time = frame / 60.0f;
+		app->elapsed_time = 1.0f / 60.0f;
+
+		//the frame time waits for the GPU to finish, so it is the time of the whole frame
+		std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+		Profiler::get()->beginFrame();
+		glQueryCounter(time_queries[0], GL_TIMESTAMP);
+		app->render();
+		glQueryCounter(time_queries[1], GL_TIMESTAMP);
+		Profiler::get()->endFrame();
+		glFinish();
+		double frame_ms = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+		GLuint64 gpu_start = 0, gpu_end = 0;
+		glGetQueryObjectui64v(time_queries[0], GL_QUERY_RESULT, &gpu_start);
+		glGetQueryObjectui64v(time_queries[1], GL_QUERY_RESULT, &gpu_end);
+		double gpu_ms = (gpu_end - gpu_start) / 1000000.0;
+		frame_times.push_back(frame_ms);
+		gpu_times.push_back(gpu_ms);
+		stats << frame << "," << frame_ms << "," << gpu_ms << "," << renderer->num_draw_calls << "," << renderer->num_draw_calls + renderer->num_draw_calls_saved << std::endl;
+
+		if ((options.capture_every && frame % options.capture_every == 0) || frame == options.num_frames - 1)
+		{
+			char filename[32];
+			sprintf(filename, "/frame_%04d.tga", frame);
+			GLState::bindFramebuffer(target->fbo_id);
+			capture.fromScreen(width, height);
+			if (capture.saveTGA((options.output_folder + filename).c_str(), true)) //the rows of the screen start at the bottom
+				num_captures++;
+		}
+		checkGLErrors();
+	}
+	glDeleteQueries(2, time_queries);
+
+	//the scopes of the last frames (the history of the profiler) for chrome://tracing
+	std::string trace_filename = options.output_folder + "/trace.json";
+	Profiler::get()->exportTrace(trace_filename.c_str());
+
+	//the first frames load and upload the resources, they are in the csv but not in the summary
+	int warmup = std::min((int)frame_times.size() - 1, 2);
+	std::vector<double> frames(frame_times.begin() + warmup, frame_times.end());
+	std::vector<double> gpu(gpu_times.begin() + warmup, gpu_times.end());
+	double total = 0, total_gpu = 0;
+	for (int i = 0; i < frames.size(); ++i)
+	{
+		total += frames[i];
+		total_gpu += gpu[i];
+	}
+	std::cout << " + Frames: " << options.num_frames << " (" << warmup << " of warmup), " << num_captures << " captures and the trace in " << options.output_folder << std::endl;
+	std::cout << " + Frame: " << total / frames.size() << " ms average, " << getPercentile(frames, 0.5f) << " median, " << getPercentile(frames, 0.95f) << " p95, "
+		<< *std::max_element(frames.begin(), frames.end()) << " max" << std::endl;
+	std::cout << " + GPU: " << total_gpu / gpu.size() << " ms average, " << getPercentile(gpu, 0.95f) << " p95" << std::endl;
+	return 0;
+}
+
+int runHeadless(const sHeadlessOptions& options)
+{
+	std::cout << "Initiating headless mode..." << std::endl;
+	int width = options.width;
+	int height = options.height;
+	if (!createContext(width, height))
+	{
+		std::cout << "Error: the offscreen context (" << context_name << ") can't be created" << std::endl;
+		return 1;
+	}
+	#ifdef USE_GLEW
+		glewInit();
+	#endif
+	std::cout << " * Context: " << context_name << ", " << width << " x " << height << std::endl;
+	std::cout << " * OpenGL Version: " << glGetString(GL_VERSION) << " (" << glGetString(GL_RENDERER) << ")" << std::endl;
+
+	//the frames are rendered to this FBO, the passes that write the window write here
+	FBO* target = new FBO();
+	target->create(width, height, 1, GL_RGBA, GL_UNSIGNED_BYTE, true);
+	GLState::default_framebuffer = target->fbo_id;
+	GLState::bindFramebuffer(target->fbo_id);
+
+	Application* app = new Application(width, height, NULL, options.scene_filename.c_str());
+	app->render_gui = false;
+	app->render_debug = false;
+
+	int exit_code = 0;
+	if (options.run_tests)
+		exit_code = runTests(options.benchmarks, options.tests_filter) ? 1 : 0;
+	else
+		exit_code = renderFrames(app, target, options);
+
+	delete target;
+	GLState::default_framebuffer = 0;
+	destroyContext();
+	return exit_code;
+}
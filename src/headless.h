@@ -0,0 +1,36 @@
+/*  Headless mode
+	Renders a scene without a window, for regression and performance tests in machines without a display or a GPU.
+	The context is offscreen: an EGL pbuffer (make USE_EGL=1), OSMesa (make USE_OSMESA=1, software rendering with llvmpipe)
+	or a hidden SDL window if none of them is compiled. The frames go to an FBO, the camera follows a path
+	(an orbit around the scene camera or the keyframes of a file) and the captures and the times are written to a folder.
+
+	main --headless [--scene data/scene.json] [--frames 120] [--size 1280x720] [--output headless] [--capture 30] [--path camera_path.txt]
+	main --test [name] or main --benchmark [name] run the tests in the same context instead of the frames (see tests.h)
+
+	The path file has a keyframe per line: eye.x eye.y eye.z center.x center.y center.z, the frames are spread along it.
+*/
+#ifndef HEADLESS_H
+#define HEADLESS_H
+
+#include <string>
+
+struct sHeadlessOptions {
+	std::string scene_filename;
+	int num_frames;
+	int width;
+	int height;
+	std::string output_folder; //created if it doesn't exist, it gets frame_XXXX.tga, stats.csv and trace.json
+	int capture_every; //frames between captures (the last frame is always captured), 0 for none
+	std::string path_filename; //empty for an orbit around the camera of the scene
+	bool run_tests; //--test or --benchmark
+	bool benchmarks;
+	std::string tests_filter; //the name after them, empty for all
+};
+
+//true if the command line asks for the headless mode (or the tests), fills the options
+bool parseHeadlessOptions(int argc, char** argv, sHeadlessOptions& options);
+
+//creates the context, renders the frames and writes the results, returns the exit code of the program
+int runHeadless(const sHeadlessOptions& options);
+
+#endif
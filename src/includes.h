@@ -57,6 +57,37 @@
 
 //OPENGL EXTENSIONS
 
+//instanced rendering needs OpenGL ES3 or desktop OpenGL 3.3 (GL_ARB_instanced_arrays in older contexts)
+#ifndef OPENGL_ES2
+	#define USE_INSTANCING
+#endif
+
+#ifdef __APPLE__
+	//legacy contexts only expose the ARB version of the instancing functions
+	#define glVertexAttribDivisor glVertexAttribDivisorARB
+	#define glDrawElementsInstanced glDrawElementsInstancedARB
+	#define glDrawArraysInstanced glDrawArraysInstancedARB
+	//and vertex arrays are GL_APPLE_vertex_array_object
+	#define glGenVertexArrays glGenVertexArraysAPPLE
+	#define glBindVertexArray glBindVertexArrayAPPLE
+	#define glDeleteVertexArrays glDeleteVertexArraysAPPLE
+#endif
+
+//persistent mapping, ranges and fences for the streaming buffers (OpenGL 3.2/4.4 or their ARB extensions), OSX uses glBufferSubData
+#if !defined(OPENGL_ES2) && !defined(__APPLE__)
+	#define USE_MAPPED_BUFFERS
+#endif
+
+//vertex array objects need OpenGL 3.0 (or GL_ARB_vertex_array_object, GL_APPLE_vertex_array_object in OSX)
+#ifndef OPENGL_ES2
+	#define USE_VERTEX_ARRAYS
+#endif
+
+//uniform buffers need desktop OpenGL 3.1 (GL_ARB_uniform_buffer_object in older contexts), the legacy context of OSX doesn't have them
+#if !defined(OPENGL_ES2) && !defined(__APPLE__)
+	#define USE_UNIFORM_BUFFERS
+#endif
+
 
 //IMGUI
 #ifndef SKIP_IMGUI
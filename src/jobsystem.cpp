@@ -0,0 +1,137 @@
+#include "jobsystem.h"
+#include <algorithm>
+
+JobSystem::JobSystem(int num_threads)
+{
+	if (num_threads <= 0)
+		num_threads = (int)std::thread::hardware_concurrency();
+	if (num_threads <= 0)
+		num_threads = 1;
+
+	generation = 0;
+	quit = false;
+	current_job = NULL;
+	pending = 0;
+	active_workers = 0;
+
+	for (int i = 0; i < num_threads; ++i)
+		queues.push_back(new sQueue());
+	//thread 0 is the one calling parallelFor
+	for (int i = 1; i < num_threads; ++i)
+		workers.push_back(std::thread(&JobSystem::workerLoop, this, i));
+}
+
+JobSystem::~JobSystem()
+{
+	{
+		std::lock_guard<std::mutex> lock(wake_mutex);
+		quit = true;
+	}
+	wake_condition.notify_all();
+	for (int i = 0; i < workers.size(); ++i)
+		workers[i].join();
+	for (int i = 0; i < queues.size(); ++i)
+		delete queues[i];
+}
+
+void JobSystem::parallelFor(int count, const std::function<void(int index, int thread)>& job, int grain_size)
+{
+	if (count <= 0)
+		return;
+	if (grain_size < 1)
+		grain_size = 1;
+
+	//not worth waking anyone
+	if (workers.empty() || count <= grain_size)
+	{
+		for (int i = 0; i < count; ++i)
+			job(i, 0);
+		return;
+	}
+
+	//deal the ranges between the queues, stealing will balance them later
+	int num_queues = (int)queues.size();
+	int queue = 0;
+	for (int start = 0; start < count; start += grain_size)
+	{
+		sRange range = { start, std::min(start + grain_size, count) };
+		std::lock_guard<std::mutex> lock(queues[queue]->mutex);
+		queues[queue]->ranges.push_back(range);
+		queue = (queue + 1) % num_queues;
+	}
+
+	current_job = &job;
+	pending = count;
+	active_workers = (int)workers.size();
+	{
+		std::lock_guard<std::mutex> lock(wake_mutex);
+		generation++;
+	}
+	wake_condition.notify_all();
+
+	runJobs(0);
+
+	//the job belongs to the caller, so wait also for the workers to stop using it
+	while (pending > 0 || active_workers > 0)
+		std::this_thread::yield();
+	current_job = NULL;
+}
+
+void JobSystem::workerLoop(int thread)
+{
+	int last_generation = 0;
+	while (true)
+	{
+		{
+			std::unique_lock<std::mutex> lock(wake_mutex);
+			wake_condition.wait(lock, [&] { return quit || generation != last_generation; });
+			if (quit)
+				return;
+			last_generation = generation;
+		}
+		runJobs(thread);
+		active_workers--;
+	}
+}
+
+void JobSystem::runJobs(int thread)
+{
+	sRange range;
+	while (popRange(thread, range))
+	{
+		for (int i = range.start; i < range.end; ++i)
+			(*current_job)(i, thread);
+		pending -= range.end - range.start;
+	}
+}
+
+bool JobSystem::popRange(int thread, sRange& range)
+{
+	int num_queues = (int)queues.size();
+
+	//first our own queue, from the back (the jobs we pushed last are probably still in cache)
+	{
+		sQueue* queue = queues[thread];
+		std::lock_guard<std::mutex> lock(queue->mutex);
+		if (!queue->ranges.empty())
+		{
+			range = queue->ranges.back();
+			queue->ranges.pop_back();
+			return true;
+		}
+	}
+
+	//then steal from the front of the others
+	for (int i = 1; i < num_queues; ++i)
+	{
+		sQueue* queue = queues[(thread + i) % num_queues];
+		std::lock_guard<std::mutex> lock(queue->mutex);
+		if (!queue->ranges.empty())
+		{
+			range = queue->ranges.front();
+			queue->ranges.pop_front();
+			return true;
+		}
+	}
+	return false;
+}
@@ -0,0 +1,56 @@
+/*  JobSystem
+	A pool of worker threads to split loops in small jobs.
+	Every thread has its own queue of jobs, when a thread runs out of jobs it steals from the others,
+	so a thread that got the heavy jobs doesn't keep the rest waiting.
+	The thread that calls parallelFor works too, it is always the thread 0.
+*/
+#ifndef JOBSYSTEM_H
+#define JOBSYSTEM_H
+
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+
+class JobSystem {
+public:
+	//num_threads counts the calling thread, 0 means one per core
+	JobSystem(int num_threads = 0);
+	~JobSystem();
+
+	//threads that run jobs (the workers plus the calling thread)
+	int getNumThreads() { return (int)queues.size(); }
+
+	//calls job(index, thread) for every index in [0,count) and waits until all of them are done
+	//indices are packed in groups of grain_size, thread is in [0,getNumThreads()) to access per thread data
+	void parallelFor(int count, const std::function<void(int index, int thread)>& job, int grain_size = 1);
+
+private:
+	struct sRange { int start; int end; };
+	struct sQueue {
+		std::mutex mutex;
+		std::deque<sRange> ranges;
+	};
+
+	std::vector<sQueue*> queues; //one per thread
+	std::vector<std::thread> workers;
+
+	std::mutex wake_mutex;
+	std::condition_variable wake_condition;
+	int generation; //increased every parallelFor to wake the workers
+	bool quit;
+
+	const std::function<void(int, int)>* current_job;
+	std::atomic<int> pending; //indices not processed yet
+	std::atomic<int> active_workers; //workers still looking for jobs of the current loop
+
+	void workerLoop(int thread);
+	//runs jobs from its queue and steals from the others until none is left
+	void runJobs(int thread);
+	bool popRange(int thread, sRange& range);
+};
+
+#endif
@@ -15,6 +15,8 @@
 #include "utils.h"
 #include "input.h"
 #include "application.h"
+#include "headless.h"
+#include "profiler.h"
 
 #include <iostream> //to output
 
@@ -39,9 +41,10 @@ SDL_Window* createWindow(const char* caption, int width, int height, bool fullsc
 	SDL_GL_SetAttribute(SDL_GL_STENCIL_SIZE, 8);
 
 #ifndef __APPLE__
+	//compatibility profile, the shader atlas is shared with OSX (its legacy context only knows the old GLSL)
 	SDL_GL_SetAttribute(SDL_GL_CONTEXT_MAJOR_VERSION, 3);
-	SDL_GL_SetAttribute(SDL_GL_CONTEXT_MINOR_VERSION, 1);
-	SDL_GL_SetAttribute(SDL_GL_CONTEXT_PROFILE_MASK, SDL_GL_CONTEXT_PROFILE_CORE);
+	SDL_GL_SetAttribute(SDL_GL_CONTEXT_MINOR_VERSION, 3);
+	SDL_GL_SetAttribute(SDL_GL_CONTEXT_PROFILE_MASK, SDL_GL_CONTEXT_PROFILE_COMPATIBILITY);
 #endif
     
 	//antialiasing (disable this lines if it goes too slow)
@@ -127,12 +130,23 @@ void mainLoop(SDL_Window* window)
 
 	while (!app->must_exit)
 	{
+		Profiler::get()->beginFrame();
+
 		//render frame
-		app->render();
+		{
+			PROFILE_GPU_SCOPE("render");
+			app->render();
+		}
 		if (app->render_gui)
+		{
+			PROFILE_GPU_SCOPE("gui");
 			renderDebug(window, app);
-		// swap between front buffer and back buffer
-		SDL_GL_SwapWindow(window);
+		}
+		// swap between front buffer and back buffer (it can wait for the GPU)
+		{
+			PROFILE_SCOPE("swap");
+			SDL_GL_SwapWindow(window);
+		}
 
 		//update events
 		while(SDL_PollEvent(&sdlEvent))
@@ -195,12 +209,17 @@ void mainLoop(SDL_Window* window)
 		}
 
 		//update app logic
-		app->update(elapsed_time);
+		{
+			PROFILE_SCOPE("update");
+			app->update(elapsed_time);
+		}
 
 		//check errors in opengl only when working in debug
 		#ifdef _DEBUG
 				checkGLErrors();
 		#endif
+
+		Profiler::get()->endFrame();
 	}
 
 	return;
@@ -208,6 +227,11 @@ void mainLoop(SDL_Window* window)
 
 int main(int argc, char **argv)
 {
+	//rendering without a window (batch renders, tests and benchmarks), see headless.h and tests.h
+	sHeadlessOptions headless_options;
+	if (parseHeadlessOptions(argc, argv, headless_options))
+		return runHeadless(headless_options);
+
 	std::cout << "Initiating app..." << std::endl;
 
 	//prepare SDL
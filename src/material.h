@@ -40,6 +40,8 @@ namespace GTR {
 		//static manager to reuse materials
 		static std::map<std::string, Material*> sMaterials;
 		static Material* Get(const char* name);
+		static int s_MaterialID;
+		int m_Id; //unique id, used to group render calls by material
 		std::string name;
 		void registerMaterial(const char* name);
 
@@ -65,7 +67,7 @@ namespace GTR {
 		Sampler normal_texture;	//normalmap
 
 		//ctors
-		Material() : alpha_mode(NO_ALPHA), alpha_cutoff(0.5), color(1, 1, 1, 1), _zMin(0.0f), _zMax(1.0f), two_sided(false), roughness_factor(1), metallic_factor(0) {
+		Material() : m_Id(s_MaterialID++), alpha_mode(NO_ALPHA), alpha_cutoff(0.5), color(1, 1, 1, 1), _zMin(0.0f), _zMax(1.0f), two_sided(false), roughness_factor(1), metallic_factor(0) {
 			//color_texture = emissive_texture = metallic_roughness_texture = occlusion_texture = normal_texture = NULL;
 		}
 		Material(Texture* texture) : Material() { color_texture.texture = texture; }
@@ -4,6 +4,9 @@
 #include "shader.h"
 #include "includes.h"
 #include "framework.h"
+#include "glstate.h"
+#include "streambuffer.h"
+#include "simplify.h"
 
 #include <cassert>
 #include <iostream>
@@ -20,10 +23,14 @@
 bool Mesh::use_binary = false;			//checks if there is .wbin, it there is one tries to read it instead of the other file
 bool Mesh::auto_upload_to_vram = true;	//uploads the mesh to the GPU VRAM to speed up rendering
 bool Mesh::interleave_meshes = true;	//places the geometry in an interleaved array
+bool Mesh::use_vertex_arrays = true;	//the attributes are set once in a vertex array object instead of in every draw
+bool Mesh::use_lod_cache = true;			//the LODs of the prefabs are written in .mbin files and read from them the next time
+std::vector<sVertexLayout> Mesh::vertex_layouts;
 
 std::map<std::string, Mesh*> Mesh::sMeshesLoaded;
 long Mesh::num_meshes_rendered = 0;
 long Mesh::num_triangles_rendered = 0;
+int Mesh::s_MeshID = 0;
 
 #define FORMAT_ASE 1
 #define FORMAT_OBJ 2
@@ -32,7 +39,9 @@ long Mesh::num_triangles_rendered = 0;
 
 Mesh::Mesh()
 {
+	m_Id = s_MeshID++;
 	radius = 0;
+	lod_error = 0;
 	vertices_vbo_id = uvs_vbo_id = uvs1_vbo_id = normals_vbo_id = colors_vbo_id = interleaved_vbo_id = indices_vbo_id = bones_vbo_id = weights_vbo_id = 0;
 	collision_model = NULL;
 
@@ -89,6 +98,8 @@ void Mesh::clear()
     #endif
 
 
+	releaseVertexArrays();
+
 	//VBOs ids
 	vertices_vbo_id = uvs_vbo_id = normals_vbo_id = colors_vbo_id = interleaved_vbo_id = indices_vbo_id = weights_vbo_id = bones_vbo_id = uvs1_vbo_id = 0;
 
@@ -103,6 +114,10 @@ void Mesh::clear()
 	weights.clear();
 	m_uvs1.clear();
 
+	for (int i = 0; i < lods.size(); ++i)
+		delete lods[i];
+	lods.clear();
+
 	if (collision_model)
 		delete (CollisionModel3D*)collision_model;
 }
@@ -267,6 +282,17 @@ void Mesh::render(unsigned int primitive, int submesh_id, int num_instances)
 	}
 	assert((interleaved.size() || vertices.size()) && "No vertices in this mesh");
 
+	//the attributes are already in the vertex array, only bind it
+	unsigned int vertex_array = use_vertex_arrays ? getVertexArray(shader) : 0;
+	if (vertex_array)
+	{
+		GLState::bindVertexArray(vertex_array);
+		drawCall(primitive, submesh_id, num_instances);
+		checkGLErrors();
+		return;
+	}
+	GLState::bindVertexArray(0);
+
 	//bind buffers to attribute locations
 	enableBuffers(shader);
 	checkGLErrors();
@@ -305,8 +331,8 @@ void Mesh::drawCall(unsigned int primitive, int submesh_id, int num_instances)
 		{
 			assert(indices_vbo_id && "indices must be uploaded to the GPU");
 			glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, indices_vbo_id);
-			#ifdef OPENGL_ES3
-				glDrawElementsInstanced(primitive, size, GL_UNSIGNED_INT, (void*)(start + sizeof(Vector3u)), num_instances);
+			#ifdef USE_INSTANCING
+				glDrawElementsInstanced(primitive, size, GL_UNSIGNED_INT, (void*)(start * sizeof(Vector3u)), num_instances);
             #else
 				assert(0 && "not supported in OpenGL ES2");
             #endif
@@ -331,7 +357,7 @@ void Mesh::drawCall(unsigned int primitive, int submesh_id, int num_instances)
 	{
 		if (num_instances > 0)
 		{
-			#ifdef OPENGL_ES3
+			#ifdef USE_INSTANCING
 				glDrawArraysInstanced(primitive, start, size, num_instances);
             #else
 				assert(0 && "not supported in OpenGL ES2");
@@ -358,7 +384,99 @@ void Mesh::disableBuffers(Shader* shader)
 	checkGLErrors();
 }
 
-GLuint instances_buffer_id = 0;
+//points the 4 attributes of the instanced mat4 u_model (a vec4 each) to the models at offset in the buffer
+static void setInstanceAttributes(int location, GLuint buffer, int offset)
+{
+#ifdef USE_INSTANCING
+	glBindBuffer(GL_ARRAY_BUFFER, buffer);
+	for (int k = 0; k < 4; ++k)
+		glVertexAttribPointer(location + k, 4, GL_FLOAT, false, sizeof(Matrix44), (void*)(size_t)(offset + sizeof(float) * 4 * k));
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+#endif
+}
+
+//the same names as the attributes of sVertexLayout
+static const char* attribute_names[NUM_MESH_ATTRIBUTES] = { "a_vertex", "a_normal", "a_coord", "a_coord1", "a_color", "a_bones", "a_weights", "u_model" };
+
+int Mesh::getVertexLayout(Shader* shader)
+{
+	if (shader->vertex_layout != -1)
+		return shader->vertex_layout;
+
+	sVertexLayout layout;
+	for (int i = 0; i < NUM_MESH_ATTRIBUTES; ++i)
+		layout.locations[i] = shader->getAttribLocation(attribute_names[i]);
+
+	//shaders with the same locations share the layout, so they share the vertex arrays too
+	for (int i = 0; i < vertex_layouts.size(); ++i)
+		if (memcmp(&vertex_layouts[i], &layout, sizeof(layout)) == 0)
+			return shader->vertex_layout = i;
+	vertex_layouts.push_back(layout);
+	return shader->vertex_layout = (int)vertex_layouts.size() - 1;
+}
+
+bool Mesh::isInVRAM()
+{
+	if (interleaved.size() ? !interleaved_vbo_id : (!vertices_vbo_id || (uvs.size() && !uvs_vbo_id) || (normals.size() && !normals_vbo_id)))
+		return false;
+	return (!m_uvs1.size() || uvs1_vbo_id) && (!colors.size() || colors_vbo_id) && (!bones.size() || bones_vbo_id) && (!weights.size() || weights_vbo_id);
+}
+
+unsigned int Mesh::getVertexArray(Shader* shader)
+{
+#ifdef USE_VERTEX_ARRAYS
+	//a vertex array can't keep pointers to the arrays in RAM
+	if (!isInVRAM())
+		return 0;
+
+	int layout = getVertexLayout(shader);
+	if (layout >= vertex_arrays.size())
+		vertex_arrays.resize(layout + 1, 0);
+	if (vertex_arrays[layout])
+		return vertex_arrays[layout];
+
+	//the attribute pointers are set only once, in the vertex array
+	GLuint vertex_array = 0;
+	glGenVertexArrays(1, &vertex_array);
+	GLState::bindVertexArray(vertex_array);
+	enableBuffers(shader);
+
+	//instanced shaders read the models from the frame stream (renderInstanced points them to the models of every draw)
+	int model_location = vertex_layouts[layout].locations[NUM_MESH_ATTRIBUTES - 1];
+	if (model_location != -1)
+	{
+		#ifdef USE_INSTANCING
+			for (int k = 0; k < 4; ++k)
+			{
+				glEnableVertexAttribArray(model_location + k);
+				glVertexAttribDivisor(model_location + k, 1);
+			}
+			setInstanceAttributes(model_location, StreamBuffer::getFrameStream()->buffer_id, 0);
+		#endif
+	}
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	checkGLErrors();
+
+	vertex_arrays[layout] = vertex_array;
+	return vertex_array;
+#else
+	return 0;
+#endif
+}
+
+void Mesh::releaseVertexArrays()
+{
+#ifdef USE_VERTEX_ARRAYS
+	for (int i = 0; i < vertex_arrays.size(); ++i)
+	{
+		if (!vertex_arrays[i])
+			continue;
+		GLState::releaseVertexArray(vertex_arrays[i]);
+		glDeleteVertexArrays(1, &vertex_arrays[i]);
+	}
+#endif
+	vertex_arrays.clear();
+}
 
 //should be faster but in some system it is slower
 void Mesh::renderInstanced(unsigned int primitive, const Matrix44* instanced_models, int num_instances)
@@ -366,14 +484,26 @@ void Mesh::renderInstanced(unsigned int primitive, const Matrix44* instanced_mod
 	if (!num_instances)
 		return;
 
-	#ifdef OPENGL_ES3
+	#ifdef USE_INSTANCING
 		Shader* shader = Shader::current;
 		assert(shader && "shader must be enabled");
 
-		if (instances_buffer_id == 0)
-			glGenBuffersARB(1, &instances_buffer_id);
-		glBindBufferARB(GL_ARRAY_BUFFER_ARB, instances_buffer_id);
-		glBufferDataARB(GL_ARRAY_BUFFER_ARB, num_instances * sizeof(Matrix44), instanced_models, GL_STREAM_DRAW_ARB);
+		//the models go to the region of this frame in the stream, no reallocation nor waiting for the GPU
+		StreamBuffer* stream = StreamBuffer::getFrameStream();
+		int models_offset = stream->write(instanced_models, num_instances * sizeof(Matrix44), sizeof(Matrix44));
+
+		//the vertex array of the shader has the instanced attributes enabled, only their offset changes
+		unsigned int vertex_array = use_vertex_arrays ? getVertexArray(shader) : 0;
+		if (vertex_array)
+		{
+			int model_location = vertex_layouts[shader->vertex_layout].locations[NUM_MESH_ATTRIBUTES - 1];
+			assert(model_location != -1 && "shader must have attribute mat4 u_model (not a uniform)");
+			GLState::bindVertexArray(vertex_array);
+			setInstanceAttributes(model_location, stream->buffer_id, models_offset);
+			render(primitive, -1, num_instances);
+			return;
+		}
+		GLState::bindVertexArray(0);
 
 		int attribLocation = shader->getAttribLocation("u_model");
 		assert(attribLocation != -1 && "shader must have attribute mat4 u_model (not a uniform)");
@@ -384,14 +514,12 @@ void Mesh::renderInstanced(unsigned int primitive, const Matrix44* instanced_mod
 		for (int k = 0; k < 4; ++k)
 		{
 			glEnableVertexAttribArray(attribLocation + k );
-			int offset = sizeof(float) * 4 * k;
-			const Uint8* addr = (Uint8*) offset;
-			glVertexAttribPointer(attribLocation + k, 4, GL_FLOAT, false, sizeof(Matrix44), addr);
 			glVertexAttribDivisor(attribLocation + k, 1); // This makes it instanced!
 		}
+		setInstanceAttributes(attribLocation, stream->buffer_id, models_offset);
 
 		//regular render
-		render(primitive, 0, num_instances);
+		render(primitive, -1, num_instances);
 
 		//disable instanced attribs
 		for (int k = 0; k < 4; ++k)
@@ -503,6 +631,9 @@ void Mesh::uploadToVRAM()
 {
 	assert(vertices.size() || interleaved.size());
 
+	//the arrays may change, the vertex arrays are created again with them
+	releaseVertexArrays();
+
 	if (glGenBuffersARB == nullptr)
 	{
 		std::cout << "Error: your graphics cards dont support VBOs. Sorry." << std::endl;
@@ -750,7 +881,8 @@ typedef struct
 	int num_submeshes;
 	Matrix44 bind_matrix;
 	char streams[8]; //Vertex/Interlaved|Normal|Uvs|Color|Indices|Bones|Weights|Extra|Uvs1
-	char extra[32]; //unused
+	float lod_error; //0 if it is not a LOD
+	char extra[28]; //unused
 } sMeshInfo;
 
 bool Mesh::readBin(const char* filename, bool bFromNetwork)
@@ -863,6 +995,7 @@ bool Mesh::readBin(const char* filename, bool bFromNetwork)
 	box.halfsize = info.halfsize;
 	radius = info.radius;
 	bind_matrix = info.bind_matrix;
+	lod_error = info.lod_error;
 
 	submeshes.resize(info.num_submeshes);
 	memcpy(&submeshes[0], pos, sizeof(sSubmeshInfo) * info.num_submeshes);
@@ -902,6 +1035,7 @@ bool Mesh::writeBin(const char* filename)
 	info.num_bones = bones_info.size();
 	info.bind_matrix = bind_matrix;
 	info.num_submeshes = submeshes.size();
+	info.lod_error = lod_error;
 
 	info.streams[0] = interleaved.size() ? 'I' : 'V';
 	info.streams[1] = normals.size() ? 'N' : ' ';
@@ -1505,6 +1639,81 @@ void Mesh::updateBoundingBox()
 	box.halfsize = aabb_max - box.center;
 }
 
+void Mesh::simplifyLODs(float max_error, std::vector< std::vector<unsigned int> >& lod_indices, std::vector<float>& lod_errors)
+{
+	lod_indices.clear();
+	lod_errors.clear();
+	//without indices every triangle has its own vertices, there are no edges to collapse
+	if (m_indices.size() < 3)
+		return;
+
+	const void* positions = interleaved.size() ? (const void*)&interleaved[0].vertex : (const void*)&vertices[0];
+	int stride = interleaved.size() ? sizeof(tInterleaved) : sizeof(Vector3);
+	MeshSimplifier simplifier(positions, stride, getNumVertices(), m_indices);
+	int num_triangles = (int)m_indices.size() / 3;
+	for (int level = 1; level <= MAX_MESH_LODS; ++level)
+	{
+		int previous = simplifier.getNumTriangles();
+		float error = simplifier.simplify(num_triangles >> level, max_error);
+		//not worth another level (the error limit was reached or the borders and seams are most of the mesh)
+		if (simplifier.getNumTriangles() > previous * 0.8f)
+			break;
+		lod_indices.push_back(simplifier.getIndices());
+		lod_errors.push_back(error);
+	}
+}
+
+//copies the elements of the stream used by the LOD, in their new order
+template<typename T> static void copyLODStream(const std::vector<T>& source, std::vector<T>& destination, const std::vector<unsigned int>& used)
+{
+	if (source.empty())
+		return;
+	destination.resize(used.size());
+	for (int i = 0; i < used.size(); ++i)
+		destination[i] = source[used[i]];
+}
+
+Mesh* Mesh::addLOD(const std::vector<unsigned int>& indices, float error)
+{
+	Mesh* lod = new Mesh();
+	lod->name = name + "::lod" + std::to_string(lods.size() + 1);
+	lod->lod_error = error;
+
+	//the vertices in the order the triangles use them
+	std::vector<int> new_index(getNumVertices(), -1);
+	std::vector<unsigned int> used;
+	lod->m_indices.resize(indices.size());
+	for (int i = 0; i < indices.size(); ++i)
+	{
+		unsigned int index = indices[i];
+		if (new_index[index] < 0)
+		{
+			new_index[index] = (int)used.size();
+			used.push_back(index);
+		}
+		lod->m_indices[i] = new_index[index];
+	}
+	copyLODStream(vertices, lod->vertices, used);
+	copyLODStream(normals, lod->normals, used);
+	copyLODStream(uvs, lod->uvs, used);
+	copyLODStream(m_uvs1, lod->m_uvs1, used);
+	copyLODStream(colors, lod->colors, used);
+	copyLODStream(interleaved, lod->interleaved, used);
+	copyLODStream(bones, lod->bones, used);
+	copyLODStream(weights, lod->weights, used);
+	lod->bones_info = bones_info;
+	lod->bind_matrix = bind_matrix;
+
+	//the same bounding as the original, so the culling doesn't change with the level
+	lod->aabb_min = aabb_min;
+	lod->aabb_max = aabb_max;
+	lod->box = box;
+	lod->radius = radius;
+
+	lods.push_back(lod);
+	return lod;
+}
+
 Mesh* wire_box = NULL;
 
 void Mesh::renderBounding( const Matrix44& model, bool world_bounding )
@@ -14,11 +14,25 @@ class Skeleton; //for skinned meshes
 //version from 11/5/2020
 #define MESH_BIN_VERSION 11 //this is used to regenerate bins if the format changes
 
+//simplified levels of a mesh, every one with about half the triangles of the previous one
+#define MAX_MESH_LODS 3
+//error allowed to the simplification, relative to the size of the mesh (the length of the halfsize of its box)
+#define MESH_LOD_ERROR 0.05f
+
 struct BoneInfo {
 	char name[32]; //max 32 chars per bone name
 	Matrix44 bind_pose;
 };
 
+//attributes a mesh can give to a shader: a_vertex, a_normal, a_coord, a_coord1, a_color, a_bones, a_weights and the instanced u_model
+#define NUM_MESH_ATTRIBUTES 8
+
+//locations of the attributes in a shader, the shaders with the same locations can use the same vertex array
+struct sVertexLayout
+{
+	int locations[NUM_MESH_ATTRIBUTES];
+};
+
 struct sSubmeshInfo
 {
 	char name[64];
@@ -34,9 +48,14 @@ public:
 	static bool use_binary; //always load the binary version of a mesh when possible
 	static bool interleave_meshes; //loaded meshes will me automatically interleaved
 	static bool auto_upload_to_vram; //loaded meshes will be stored in the VRAM
+	static bool use_vertex_arrays; //render the meshes in VRAM with a vertex array object per vertex layout
+	static bool use_lod_cache; //store the LODs generated at load in .mbin files next to the source
+	static std::vector<sVertexLayout> vertex_layouts; //all the different layouts of the shaders used
 	static long num_meshes_rendered;
 	static long num_triangles_rendered;
+	static int s_MeshID;
 
+	int m_Id; //unique id, used to group render calls by mesh
 	std::string name;
 
 	std::vector<sSubmeshInfo> submeshes; //contains info about every submesh
@@ -69,6 +88,9 @@ public:
 
 	float radius;
 
+	std::vector<Mesh*> lods; //simplified versions, lods[i] is the level i + 1 (not registered, they have the bounding of this mesh)
+	float lod_error; //distance to the surface of the original mesh when this is a LOD
+
 	unsigned int vertices_vbo_id;
 	unsigned int uvs_vbo_id;
 	unsigned int normals_vbo_id;
@@ -80,6 +102,8 @@ public:
 	unsigned int weights_vbo_id;
 	unsigned int uvs1_vbo_id;
 
+	std::vector<unsigned int> vertex_arrays; //a VAO for every vertex layout it was rendered with (0 if not created)
+
 	Mesh();
 	~Mesh();
 
@@ -95,6 +119,12 @@ public:
 	void drawCall(unsigned int primitive, int submesh_id, int num_instances);
 	void disableBuffers(Shader* shader);
 
+	//the vertex array with the buffers of the mesh in the locations of the shader, created the first time (0 if the mesh is not in VRAM)
+	unsigned int getVertexArray(Shader* shader);
+	void releaseVertexArrays();
+	bool isInVRAM(); //all its arrays are in buffers
+	static int getVertexLayout(Shader* shader);
+
 	bool readBin(const char* filename, bool bFromNetwork);
 	bool writeBin(const char* filename);
 
@@ -125,6 +155,11 @@ public:
 
 	void updateBoundingBox();
 
+	//the indices of every level of the LOD chain, only CPU work so it can run in another thread (nothing if the mesh can't be simplified)
+	void simplifyLODs(float max_error, std::vector< std::vector<unsigned int> >& lod_indices, std::vector<float>& lod_errors);
+	//adds a LOD with the triangles of these indices and only the vertices they use
+	Mesh* addLOD(const std::vector<unsigned int>& indices, float error);
+
 	//optimize meshes
 	void uploadToVRAM();
 	bool interleaveBuffers();
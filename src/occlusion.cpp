@@ -0,0 +1,322 @@
+#include "occlusion.h"
+#include "mesh.h"
+#include "camera.h"
+#include <cmath>
+#include <cfloat>
+#include <cassert>
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+
+#ifdef USE_SSE
+	#include <xmmintrin.h>
+#endif
+
+//vertices closer to the plane of the camera can't be projected
+#define MIN_CLIP_W 0.0001f
+
+OcclusionBuffer::OcclusionBuffer(int width, int height) : num_tests(0), num_occluded(0)
+{
+	assert(width % 4 == 0 && "the rows are rasterized in groups of 4 pixels");
+	this->width = width;
+	this->height = height;
+	num_triangles = 0;
+
+	//every level half the size of the previous one until a single texel
+	int w = width, h = height;
+	levels.push_back(std::vector<float>(w * h, FLT_MAX));
+	while (w > 1 || h > 1)
+	{
+		w = std::max(1, w / 2);
+		h = std::max(1, h / 2);
+		levels.push_back(std::vector<float>(w * h, FLT_MAX));
+	}
+}
+
+void OcclusionBuffer::clear(const Matrix44& viewprojection)
+{
+	this->viewprojection = viewprojection;
+	std::fill(levels[0].begin(), levels[0].end(), FLT_MAX);
+	num_triangles = 0;
+	num_tests = 0;
+	num_occluded = 0;
+}
+
+void OcclusionBuffer::rasterizeMesh(Mesh* mesh, const Matrix44& model)
+{
+	const unsigned int* indices = mesh->m_indices.size() ? &mesh->m_indices[0] : NULL;
+	if (mesh->interleaved.size())
+		rasterizeTriangles(model, &mesh->interleaved[0].vertex, sizeof(Mesh::tInterleaved), (int)mesh->interleaved.size(), indices, (int)mesh->m_indices.size());
+	else if (mesh->vertices.size())
+		rasterizeTriangles(model, &mesh->vertices[0], sizeof(Vector3), (int)mesh->vertices.size(), indices, (int)mesh->m_indices.size());
+}
+
+void OcclusionBuffer::rasterizeTriangles(const Matrix44& model, const void* vertices, int stride, int num_vertices, const unsigned int* indices, int num_indices)
+{
+	//every vertex is transformed once, to pixels and depth
+	Matrix44 mvp = model * viewprojection;
+	clip_vertices.resize(num_vertices);
+	const char* data = (const char*)vertices;
+	for (int i = 0; i < num_vertices; ++i)
+	{
+		Vector4 clip = mvp * Vector4(*(const Vector3*)(data + i * stride), 1.0f);
+		Vector4& v = clip_vertices[i];
+		v.w = clip.w;
+		if (clip.w <= MIN_CLIP_W)
+			continue;
+		float inv_w = 1.0f / clip.w;
+		v.x = (clip.x * inv_w * 0.5f + 0.5f) * width;
+		v.y = (clip.y * inv_w * 0.5f + 0.5f) * height;
+		v.z = clip.z * inv_w;
+	}
+
+	if (indices)
+	{
+		for (int i = 0; i + 2 < num_indices; i += 3)
+			rasterizeTriangle(clip_vertices[indices[i]], clip_vertices[indices[i + 1]], clip_vertices[indices[i + 2]]);
+	}
+	else
+	{
+		for (int i = 0; i + 2 < num_vertices; i += 3)
+			rasterizeTriangle(clip_vertices[i], clip_vertices[i + 1], clip_vertices[i + 2]);
+	}
+}
+
+void OcclusionBuffer::rasterizeTriangle(const Vector4& a, const Vector4& b, const Vector4& c)
+{
+	//triangles that cross the plane of the camera are skipped, they only make the culling less aggressive
+	if (a.w <= MIN_CLIP_W || b.w <= MIN_CLIP_W || c.w <= MIN_CLIP_W)
+		return;
+
+	//both faces are rasterized, the back ones are turned so the inside of the three edges is positive
+	const Vector4* v1 = &b;
+	const Vector4* v2 = &c;
+	float area = (b.x - a.x) * (c.y - a.y) - (b.y - a.y) * (c.x - a.x);
+	if (fabs(area) < 1e-8f)
+		return;
+	if (area < 0)
+	{
+		std::swap(v1, v2);
+		area = -area;
+	}
+
+	int min_x = std::max(0, (int)floor(std::min(a.x, std::min(v1->x, v2->x))));
+	int max_x = std::min(width - 1, (int)ceil(std::max(a.x, std::max(v1->x, v2->x))));
+	int min_y = std::max(0, (int)floor(std::min(a.y, std::min(v1->y, v2->y))));
+	int max_y = std::min(height - 1, (int)ceil(std::max(a.y, std::max(v1->y, v2->y))));
+	if (min_x > max_x || min_y > max_y)
+		return;
+	min_x &= ~3;
+	num_triangles++;
+
+	//edge functions e(p) = ex * p.x + ey * p.y + e0, each one is the weight of the opposite vertex (times the area)
+	const Vector4* edge_start[3] = { v1, v2, &a };
+	const Vector4* edge_end[3] = { v2, &a, v1 };
+	float ex[3], ey[3], e0[3];
+	for (int i = 0; i < 3; ++i)
+	{
+		ex[i] = -(edge_end[i]->y - edge_start[i]->y);
+		ey[i] = edge_end[i]->x - edge_start[i]->x;
+		e0[i] = -ex[i] * edge_start[i]->x - ey[i] * edge_start[i]->y;
+	}
+	//the depth (z / w) is linear in screen space
+	float inv_area = 1.0f / area;
+	float za = a.z * inv_area, z1 = v1->z * inv_area, z2 = v2->z * inv_area;
+
+#ifdef USE_SSE
+	//4 pixels of the row at a time
+	const __m128 offsets = _mm_set_ps(3.5f, 2.5f, 1.5f, 0.5f);
+	const __m128 zero = _mm_setzero_ps();
+	const __m128 za4 = _mm_set1_ps(za), z14 = _mm_set1_ps(z1), z24 = _mm_set1_ps(z2);
+	__m128 step[3], ex4[3];
+	for (int i = 0; i < 3; ++i)
+	{
+		ex4[i] = _mm_set1_ps(ex[i]);
+		step[i] = _mm_set1_ps(ex[i] * 4.0f);
+	}
+	for (int y = min_y; y <= max_y; ++y)
+	{
+		float py = y + 0.5f;
+		float* row = &levels[0][y * width];
+		__m128 px = _mm_add_ps(_mm_set1_ps((float)min_x), offsets);
+		__m128 e[3];
+		for (int i = 0; i < 3; ++i)
+			e[i] = _mm_add_ps(_mm_mul_ps(ex4[i], px), _mm_set1_ps(ey[i] * py + e0[i]));
+		for (int x = min_x; x <= max_x; x += 4)
+		{
+			__m128 inside = _mm_and_ps(_mm_and_ps(_mm_cmpge_ps(e[0], zero), _mm_cmpge_ps(e[1], zero)), _mm_cmpge_ps(e[2], zero));
+			if (_mm_movemask_ps(inside))
+			{
+				__m128 z = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e[0], za4), _mm_mul_ps(e[1], z14)), _mm_mul_ps(e[2], z24));
+				__m128 depth = _mm_loadu_ps(row + x);
+				__m128 nearest = _mm_min_ps(depth, z);
+				_mm_storeu_ps(row + x, _mm_or_ps(_mm_and_ps(inside, nearest), _mm_andnot_ps(inside, depth)));
+			}
+			for (int i = 0; i < 3; ++i)
+				e[i] = _mm_add_ps(e[i], step[i]);
+		}
+	}
+#else
+	for (int y = min_y; y <= max_y; ++y)
+	{
+		float py = y + 0.5f;
+		float* row = &levels[0][y * width];
+		for (int x = min_x; x <= max_x; ++x)
+		{
+			float px = x + 0.5f;
+			float w0 = ex[0] * px + ey[0] * py + e0[0];
+			float w1 = ex[1] * px + ey[1] * py + e0[1];
+			float w2 = ex[2] * px + ey[2] * py + e0[2];
+			if (w0 < 0 || w1 < 0 || w2 < 0)
+				continue;
+			float z = w0 * za + w1 * z1 + w2 * z2;
+			if (z < row[x])
+				row[x] = z;
+		}
+	}
+#endif
+}
+
+void OcclusionBuffer::buildHierarchy()
+{
+	//a texel keeps the farthest depth below it, a box nearer than that is in front of some pixel of the texel
+	int w = width, h = height;
+	for (int l = 1; l < levels.size(); ++l)
+	{
+		const std::vector<float>& previous = levels[l - 1];
+		std::vector<float>& level = levels[l];
+		int pw = w, ph = h;
+		w = std::max(1, w / 2);
+		h = std::max(1, h / 2);
+		for (int y = 0; y < h; ++y)
+		{
+			int y0 = std::min(2 * y, ph - 1), y1 = std::min(2 * y + 1, ph - 1);
+			for (int x = 0; x < w; ++x)
+			{
+				int x0 = std::min(2 * x, pw - 1), x1 = std::min(2 * x + 1, pw - 1);
+				level[y * w + x] = std::max(std::max(previous[y0 * pw + x0], previous[y0 * pw + x1]), std::max(previous[y1 * pw + x0], previous[y1 * pw + x1]));
+			}
+		}
+	}
+}
+
+bool OcclusionBuffer::isOccluded(const Vector3& center, const Vector3& halfsize) const
+{
+	num_tests++;
+
+	//rectangle of the box on screen and its nearest depth (the nearest point of a box is always a corner)
+	float min_x = FLT_MAX, min_y = FLT_MAX, max_x = -FLT_MAX, max_y = -FLT_MAX, min_z = FLT_MAX;
+	for (int i = 0; i < 8; ++i)
+	{
+		Vector3 corner(center.x + (i & 1 ? halfsize.x : -halfsize.x), center.y + (i & 2 ? halfsize.y : -halfsize.y), center.z + (i & 4 ? halfsize.z : -halfsize.z));
+		Vector4 clip = viewprojection * Vector4(corner, 1.0f);
+		//the camera is inside or next to the box
+		if (clip.w <= MIN_CLIP_W)
+			return false;
+		float inv_w = 1.0f / clip.w;
+		float x = (clip.x * inv_w * 0.5f + 0.5f) * width;
+		float y = (clip.y * inv_w * 0.5f + 0.5f) * height;
+		min_x = std::min(min_x, x);
+		max_x = std::max(max_x, x);
+		min_y = std::min(min_y, y);
+		max_y = std::max(max_y, y);
+		min_z = std::min(min_z, clip.z * inv_w);
+	}
+	int x0 = std::max(0, (int)floor(min_x));
+	int x1 = std::min(width - 1, (int)floor(max_x));
+	int y0 = std::max(0, (int)floor(min_y));
+	int y1 = std::min(height - 1, (int)floor(max_y));
+	//out of the screen, that is for the frustum culling to decide
+	if (x0 > x1 || y0 > y1)
+		return false;
+
+	//the level where the rectangle covers 4x4 texels at most
+	int level = 0;
+	while (level + 1 < levels.size() && ((x1 >> level) - (x0 >> level) > 3 || (y1 >> level) - (y0 >> level) > 3))
+		level++;
+	int level_width = std::max(1, width >> level);
+	const std::vector<float>& depth = levels[level];
+	for (int y = y0 >> level; y <= (y1 >> level); ++y)
+		for (int x = x0 >> level; x <= (x1 >> level); ++x)
+			if (min_z - OCCLUSION_DEPTH_BIAS < depth[y * level_width + x])
+				return false;
+
+	num_occluded++;
+	return true;
+}
+
+//the triangles of a box, 8 vertices and 36 indices
+static void addBox(const Vector3& center, const Vector3& halfsize, std::vector<Vector3>& vertices, std::vector<unsigned int>& indices)
+{
+	static const unsigned int box_indices[36] = { 0,2,1, 1,2,3, 4,5,6, 5,7,6, 0,1,4, 1,5,4, 2,6,3, 3,6,7, 0,4,2, 2,4,6, 1,3,5, 3,7,5 };
+	unsigned int first = (unsigned int)vertices.size();
+	for (int i = 0; i < 8; ++i)
+		vertices.push_back(Vector3(center.x + (i & 1 ? halfsize.x : -halfsize.x), center.y + (i & 2 ? halfsize.y : -halfsize.y), center.z + (i & 4 ? halfsize.z : -halfsize.z)));
+	for (int i = 0; i < 36; ++i)
+		indices.push_back(first + box_indices[i]);
+}
+
+bool benchmarkOcclusionBuffer()
+{
+	Camera camera;
+	camera.setPerspective(60.0f, 2.0f, 0.1f, 1000.0f);
+	camera.lookAt(Vector3(0, 0, 0), Vector3(0, 0, -1), Vector3(0, 1, 0));
+
+	//a wall of 16x8 boxes in front of the camera, 80 units wide and 40 high
+	std::vector<Vector3> vertices;
+	std::vector<unsigned int> indices;
+	for (int y = 0; y < 8; ++y)
+		for (int x = 0; x < 16; ++x)
+			addBox(Vector3(-37.5f + x * 5.0f, -17.5f + y * 5.0f, -50.0f), Vector3(2.5f, 2.5f, 1.0f), vertices, indices);
+	Matrix44 model;
+
+	OcclusionBuffer buffer;
+	const int iterations = 100;
+	std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+	for (int i = 0; i < iterations; ++i)
+	{
+		buffer.clear(camera.viewprojection_matrix);
+		buffer.rasterizeTriangles(model, &vertices[0], sizeof(Vector3), (int)vertices.size(), &indices[0], (int)indices.size());
+		buffer.buildHierarchy();
+	}
+	std::chrono::high_resolution_clock::time_point middle = std::chrono::high_resolution_clock::now();
+
+	//random boxes around the wall, always the same ones
+	const int num_boxes = 10000;
+	std::vector<BoundingBox> boxes(num_boxes);
+	srand(0);
+	for (int i = 0; i < num_boxes; ++i)
+		boxes[i] = BoundingBox(Vector3(random(200.0f, -100), random(100.0f, -50), -5.0f - random(195.0f)), Vector3(0.5f + random(4.0f), 0.5f + random(4.0f), 0.5f + random(4.0f)));
+	std::chrono::high_resolution_clock::time_point test_start = std::chrono::high_resolution_clock::now();
+	int occluded = 0;
+	for (int i = 0; i < num_boxes; ++i)
+		occluded += buffer.isOccluded(boxes[i].center, boxes[i].halfsize);
+	std::chrono::high_resolution_clock::time_point end = std::chrono::high_resolution_clock::now();
+
+	//behind the wall, in front of it and beside it
+	bool correct = buffer.isOccluded(Vector3(0, 0, -100), Vector3(2, 2, 2)) && !buffer.isOccluded(Vector3(0, 0, -20), Vector3(2, 2, 2)) && !buffer.isOccluded(Vector3(90, 0, -100), Vector3(2, 2, 2));
+
+	//an occluder is not hidden by its own triangles: walls facing the camera that fill the screen (their depth is the one of
+	//the nearest corner of their box, up to the rounding) and floors, tested with their boxes
+	OcclusionBuffer plane_buffer;
+	for (int i = 0; i < 200; ++i)
+	{
+		bool wall = i % 2 == 0;
+		Vector3 center = wall ? Vector3(0, 0, -3.0f - i * 0.685f) : Vector3(0, -2.0f - i * 0.01f, -100);
+		Vector3 halfsize = wall ? Vector3(300, 300, 0) : Vector3(200, 0, 100);
+		Vector3 plane_vertices[4];
+		for (int j = 0; j < 4; ++j)
+			plane_vertices[j] = center + Vector3(j & 1 ? halfsize.x : -halfsize.x, halfsize.z ? 0 : (j & 2 ? halfsize.y : -halfsize.y), halfsize.z ? (j & 2 ? halfsize.z : -halfsize.z) : 0);
+		const unsigned int plane_indices[6] = { 0, 1, 2, 1, 3, 2 };
+		plane_buffer.clear(camera.viewprojection_matrix);
+		plane_buffer.rasterizeTriangles(model, plane_vertices, sizeof(Vector3), 4, plane_indices, 6);
+		plane_buffer.buildHierarchy();
+		correct = correct && !plane_buffer.isOccluded(center, halfsize);
+	}
+
+	double raster_ms = std::chrono::duration<double, std::milli>(middle - start).count() / iterations;
+	double test_ms = std::chrono::duration<double, std::milli>(end - test_start).count();
+	std::cout << " + Occlusion buffer " << buffer.width << "x" << buffer.height << ": " << raster_ms << " ms rasterizing " << indices.size() / 3 << " triangles, "
+		<< test_ms << " ms testing " << num_boxes << " boxes (" << occluded << " occluded)" << (correct ? "" : " (ERROR: wrong results)") << std::endl;
+	return correct;
+}
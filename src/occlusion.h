@@ -0,0 +1,60 @@
+/*  OcclusionBuffer
+	A small depth buffer rasterized in the CPU with the biggest meshes of the scene (the occluders),
+	so the boxes completely hidden behind them can be discarded before creating their render calls.
+	It keeps a hierarchy of the depth (every texel of a level has the farthest depth of the 4 below it)
+	so a box only reads a few texels whatever its size on screen. It doesn't need the GPU.
+*/
+#ifndef OCCLUSION_H
+#define OCCLUSION_H
+
+#include "culling.h"
+#include <atomic>
+
+class Mesh;
+
+#define OCCLUSION_WIDTH 256
+#define OCCLUSION_HEIGHT 128
+//a box must be this much behind the occluders to be hidden, so the rounding doesn't let an occluder hide itself (in z / w)
+#define OCCLUSION_DEPTH_BIAS 1e-6f
+
+class OcclusionBuffer {
+public:
+	int width; //multiple of 4
+	int height;
+	int num_triangles; //rasterized since the last clear
+	mutable std::atomic<int> num_tests; //boxes tested since the last clear
+	mutable std::atomic<int> num_occluded;
+
+	OcclusionBuffer(int width = OCCLUSION_WIDTH, int height = OCCLUSION_HEIGHT);
+
+	//empties the buffer to rasterize the occluders seen with this matrix
+	void clear(const Matrix44& viewprojection);
+
+	//rasterizes the triangles of the mesh (all of them, front and back faces)
+	void rasterizeMesh(Mesh* mesh, const Matrix44& model);
+	//vertices are positions every stride bytes, without indices every 3 vertices are a triangle
+	void rasterizeTriangles(const Matrix44& model, const void* vertices, int stride, int num_vertices, const unsigned int* indices = NULL, int num_indices = 0);
+
+	//computes the levels of the hierarchy, call it after the occluders and before testing
+	void buildHierarchy();
+
+	//true if the box is completely behind the occluders (it can be skipped)
+	bool isOccluded(const Vector3& center, const Vector3& halfsize) const;
+
+	//depth of the nearest occluder of a pixel (z / w in clip space, FLT_MAX if there is none)
+	float getDepth(int x, int y) const { return levels[0][y * width + x]; }
+
+private:
+	Matrix44 viewprojection;
+	std::vector< std::vector<float> > levels; //level 0 is the depth of every pixel, every level is half the size of the previous one
+	std::vector<Vector4> clip_vertices; //of the mesh being rasterized, kept to avoid allocations
+
+	//x and y in pixels, z the depth, w <= 0 if the vertex is behind the camera
+	void rasterizeTriangle(const Vector4& a, const Vector4& b, const Vector4& c);
+};
+
+//rasterizes a wall of boxes and tests boxes behind, in front and beside it, printing the time and checking the results
+//(false if they are wrong, or if a plane is hidden by its own triangles)
+bool benchmarkOcclusionBuffer();
+
+#endif
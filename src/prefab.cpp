@@ -21,6 +21,7 @@ int Node::s_NodeID = 0;
 Node::Node() : parent(NULL), mesh(NULL), material(NULL), visible(true), layers(0xFF)
 {
 	m_Id = s_NodeID++;
+	index = 0;
 }
 
 Node::~Node()
@@ -179,6 +180,7 @@ void Node::renderInMenu()
 
 Prefab::Prefab()
 {
+	num_nodes = 1;
 }
 
 Prefab::~Prefab()
@@ -249,3 +251,16 @@ void Prefab::updateNodesByName()
 	nodes_by_name.clear();
 	updateInDepth(nodes_by_name, &root);
 }
+
+void indexInDepth(GTR::Node* node, int& index)
+{
+	node->index = index++;
+	for (int i = 0; i < node->children.size(); ++i)
+		indexInDepth(node->children[i], index);
+}
+
+void Prefab::updateNodeIndices()
+{
+	num_nodes = 0;
+	indexInDepth(&root, num_nodes);
+}
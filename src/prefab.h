@@ -40,6 +40,7 @@ namespace GTR {
 		Mesh* mesh;
 		//std::vector<Primitive*> primitives;
 		Material* material;
+		int index; //position in the prefab (depth first), the entities keep their own data of the node there
 
 		Matrix44 model;	//the matrix that defines where is the object (in relation to its parent)
 		Matrix44 global_model;	//the matrix that defines where is the object (in relation to the world)
@@ -97,6 +98,7 @@ namespace GTR {
 		std::string name;
 		std::map<std::string, Node*> nodes_by_name;
 		std::string url;
+		int num_nodes;
 
 		//root node which contains the tree
 		Node root;
@@ -108,6 +110,7 @@ namespace GTR {
 
 		void updateBounding();
 		void updateNodesByName();
+		void updateNodeIndices();
 		Node* getNodeByName(const char* name);
 
 				//Manager to cache loaded prefabs
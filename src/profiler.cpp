@@ -0,0 +1,379 @@
+#include "profiler.h"
+#include <chrono>
+#include <fstream>
+#include <map>
+#include <algorithm>
+#include <cstring>
+#include <cstdio>
+
+static std::chrono::high_resolution_clock::time_point profiler_epoch = std::chrono::high_resolution_clock::now();
+
+//timestamp queries need OpenGL 3.3 or the ARB extension in older contexts
+static bool isTimerQuerySupported()
+{
+	int major = 0, minor = 0;
+	const char* version = (const char*)glGetString(GL_VERSION);
+	if (version)
+		sscanf(version, "%d.%d", &major, &minor);
+	if (major > 3 || (major == 3 && minor >= 3))
+		return true;
+	const char* extensions = (const char*)glGetString(GL_EXTENSIONS);
+	return extensions && strstr(extensions, "GL_ARB_timer_query");
+}
+
+Profiler::Profiler()
+{
+	enabled = true;
+	gpu_timers = false;
+	paused = false;
+	main_thread = std::this_thread::get_id();
+	gpu_checked = false;
+	history.resize(PROFILER_HISTORY);
+	for (int i = 0; i < history.size(); ++i)
+	{
+		history[i].num_queries = 0;
+		history[i].gpu_ready = false;
+	}
+	current = -1;
+	head = 0;
+	num_frames = 0;
+	frame_counter = 0;
+	depth = 0;
+	ignored_depth = 0;
+	frame_start = 0;
+	selected_frame = 0;
+}
+
+Profiler::~Profiler()
+{
+	for (int i = 0; i < history.size(); ++i)
+		if (history[i].queries.size())
+			glDeleteQueries((GLsizei)history[i].queries.size(), &history[i].queries[0]);
+}
+
+Profiler* Profiler::get()
+{
+	static Profiler* profiler = NULL;
+	if (!profiler)
+		profiler = new Profiler();
+	return profiler;
+}
+
+double Profiler::getTime() const
+{
+	return std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - profiler_epoch).count();
+}
+
+void Profiler::beginFrame()
+{
+	frame_counter++;
+
+	//the frames whose queries are ready, usually the ones of two or three frames ago
+	for (int i = 1; i <= num_frames; ++i)
+	{
+		sProfileFrame& frame = history[(head - i + PROFILER_HISTORY) % PROFILER_HISTORY];
+		if (frame.gpu_ready)
+			break; //the GPU finishes the frames in order, the older ones are read
+		readQueries(frame);
+	}
+
+	if (!enabled || paused)
+	{
+		current = -1;
+		return;
+	}
+
+	if (!gpu_checked)
+	{
+		gpu_timers = isTimerQuerySupported();
+		gpu_checked = true;
+	}
+
+	sProfileFrame& frame = history[head];
+	frame.frame = frame_counter;
+	frame.start = frame_start = getTime();
+	frame.cpu_ms = 0;
+	frame.gpu_ms = 0;
+	frame.gpu_ready = false;
+	frame.num_queries = 0;
+	frame.scopes.clear();
+	current = head;
+	depth = 0;
+	ignored_depth = 0;
+	if (gpu_timers)
+		writeTimestamp(frame);
+}
+
+void Profiler::endFrame()
+{
+	if (current == -1)
+		return;
+	while (depth)
+		endScope();
+
+	sProfileFrame& frame = history[current];
+	frame.cpu_ms = getTime() - frame_start;
+	if (gpu_timers)
+		writeTimestamp(frame);
+	else
+		frame.gpu_ready = true; //nothing to wait for
+
+	head = (head + 1) % PROFILER_HISTORY;
+	num_frames = std::min(num_frames + 1, PROFILER_HISTORY);
+	current = -1;
+}
+
+void Profiler::beginScope(const char* name, bool gpu)
+{
+	if (current == -1 || std::this_thread::get_id() != main_thread)
+		return;
+	if (depth == PROFILER_MAX_DEPTH || ignored_depth)
+	{
+		ignored_depth++;
+		return;
+	}
+
+	sProfileFrame& frame = history[current];
+	sProfileScope scope;
+	scope.name = names.insert(name).first->c_str();
+	scope.depth = depth;
+	scope.parent = depth ? open_scopes[depth - 1] : -1;
+	scope.cpu_start = getTime() - frame_start;
+	scope.cpu_end = scope.cpu_start;
+	scope.gpu_begin_query = gpu && gpu_timers ? writeTimestamp(frame) : -1;
+	scope.gpu_end_query = -1;
+	scope.gpu_start = scope.gpu_end = -1;
+	open_scopes[depth++] = (int)frame.scopes.size();
+	frame.scopes.push_back(scope);
+}
+
+void Profiler::endScope()
+{
+	if (current == -1 || std::this_thread::get_id() != main_thread)
+		return;
+	if (ignored_depth)
+	{
+		ignored_depth--;
+		return;
+	}
+	if (!depth)
+		return;
+
+	sProfileFrame& frame = history[current];
+	sProfileScope& scope = frame.scopes[open_scopes[--depth]];
+	scope.cpu_end = getTime() - frame_start;
+	if (scope.gpu_begin_query != -1)
+		scope.gpu_end_query = writeTimestamp(frame);
+}
+
+int Profiler::writeTimestamp(sProfileFrame& frame)
+{
+	if (frame.num_queries == frame.queries.size())
+	{
+		GLuint query;
+		glGenQueries(1, &query);
+		frame.queries.push_back(query);
+	}
+	glQueryCounter(frame.queries[frame.num_queries], GL_TIMESTAMP);
+	return frame.num_queries++;
+}
+
+bool Profiler::readQueries(sProfileFrame& frame)
+{
+	if (frame.gpu_ready || frame.num_queries < 2)
+		return frame.gpu_ready;
+	GLint available = 0;
+	glGetQueryObjectiv(frame.queries[frame.num_queries - 1], GL_QUERY_RESULT_AVAILABLE, &available);
+	if (!available)
+		return false;
+
+	timestamps.resize(frame.num_queries);
+	for (int i = 0; i < frame.num_queries; ++i)
+		glGetQueryObjectui64v(frame.queries[i], GL_QUERY_RESULT, &timestamps[i]);
+	GLuint64 base = timestamps[0];
+	frame.gpu_ms = (timestamps[frame.num_queries - 1] - base) / 1000000.0;
+	for (int i = 0; i < frame.scopes.size(); ++i)
+	{
+		sProfileScope& scope = frame.scopes[i];
+		if (scope.gpu_begin_query == -1 || scope.gpu_end_query == -1)
+			continue;
+		scope.gpu_start = (timestamps[scope.gpu_begin_query] - base) / 1000000.0;
+		scope.gpu_end = (timestamps[scope.gpu_end_query] - base) / 1000000.0;
+	}
+	frame.gpu_ready = true;
+	return true;
+}
+
+const sProfileFrame* Profiler::getLastFrame(int frames_ago) const
+{
+	for (int i = 1; i <= num_frames; ++i)
+	{
+		const sProfileFrame& frame = history[(head - i + PROFILER_HISTORY) % PROFILER_HISTORY];
+		if (frame.gpu_ready && frames_ago-- == 0)
+			return &frame;
+	}
+	return NULL;
+}
+
+static void writeTraceEvent(std::ofstream& file, bool& first, const char* name, int track, double start_ms, double duration_ms)
+{
+	file << (first ? "\n" : ",\n") << "{\"name\":\"";
+	for (const char* c = name; *c; ++c)
+	{
+		if (*c == '"' || *c == '\\')
+			file << '\\';
+		file << *c;
+	}
+	//the times are in microseconds
+	file << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << track << ",\"ts\":" << start_ms * 1000.0 << ",\"dur\":" << duration_ms * 1000.0 << "}";
+	first = false;
+}
+
+bool Profiler::exportTrace(const char* filename) const
+{
+	std::ofstream file(filename);
+	if (!file)
+		return false;
+	file.setf(std::ios::fixed);
+	file.precision(3);
+
+	file << "{\"traceEvents\":[";
+	file << "\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":1,\"args\":{\"name\":\"CPU\"}}";
+	file << ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":2,\"args\":{\"name\":\"GPU\"}}";
+	bool first = false;
+	char frame_name[32];
+	for (int i = num_frames; i >= 1; --i)
+	{
+		const sProfileFrame& frame = history[(head - i + PROFILER_HISTORY) % PROFILER_HISTORY];
+		sprintf(frame_name, "frame %ld", frame.frame);
+		writeTraceEvent(file, first, frame_name, 1, frame.start, frame.cpu_ms);
+		for (int j = 0; j < frame.scopes.size(); ++j)
+		{
+			const sProfileScope& scope = frame.scopes[j];
+			writeTraceEvent(file, first, scope.name, 1, frame.start + scope.cpu_start, scope.cpu_end - scope.cpu_start);
+		}
+
+		//the GPU clock is not the CPU one, the GPU frame is drawn as if it started with the CPU frame
+		if (!frame.gpu_ready || frame.num_queries < 2)
+			continue;
+		writeTraceEvent(file, first, frame_name, 2, frame.start, frame.gpu_ms);
+		for (int j = 0; j < frame.scopes.size(); ++j)
+		{
+			const sProfileScope& scope = frame.scopes[j];
+			if (scope.gpu_start >= 0)
+				writeTraceEvent(file, first, scope.name, 2, frame.start + scope.gpu_start, scope.gpu_end - scope.gpu_start);
+		}
+	}
+	file << "\n]}\n";
+	return true;
+}
+
+void Profiler::renderFlameGraph(const sProfileFrame& frame, bool gpu)
+{
+#ifndef SKIP_IMGUI
+	ImDrawList* draw_list = ImGui::GetWindowDrawList();
+	ImVec2 origin = ImGui::GetCursorScreenPos();
+	float width = std::max(ImGui::GetContentRegionAvail().x, 100.0f);
+	float row_height = ImGui::GetTextLineHeightWithSpacing();
+	double total = gpu ? frame.gpu_ms : frame.cpu_ms;
+	if (total <= 0)
+		total = 1;
+
+	int max_depth = 0;
+	for (int i = 0; i < frame.scopes.size(); ++i)
+	{
+		const sProfileScope& scope = frame.scopes[i];
+		double start = gpu ? scope.gpu_start : scope.cpu_start;
+		double end = gpu ? scope.gpu_end : scope.cpu_end;
+		if (start < 0)
+			continue;
+		max_depth = std::max(max_depth, scope.depth);
+
+		//the same color for a scope in every frame
+		unsigned int hash = 0;
+		for (const char* c = scope.name; *c; ++c)
+			hash = hash * 31 + *c;
+		ImVec2 rect_min(origin.x + float(start / total) * width, origin.y + scope.depth * row_height);
+		ImVec2 rect_max(std::max(origin.x + float(end / total) * width, rect_min.x + 1), rect_min.y + row_height - 1);
+		draw_list->AddRectFilled(rect_min, rect_max, ImColor::HSV((hash % 360) / 360.0f, 0.5f, 0.8f));
+		if (ImGui::CalcTextSize(scope.name).x < rect_max.x - rect_min.x - 4)
+			draw_list->AddText(ImVec2(rect_min.x + 2, rect_min.y), IM_COL32(0, 0, 0, 255), scope.name);
+		if (ImGui::IsMouseHoveringRect(rect_min, rect_max))
+			ImGui::SetTooltip("%s\n%.3f ms (%.1f%%)", scope.name, end - start, (end - start) / total * 100.0);
+	}
+	ImGui::Dummy(ImVec2(width, (max_depth + 1) * row_height));
+#endif
+}
+
+void Profiler::renderInMenu()
+{
+#ifndef SKIP_IMGUI
+	ImGui::Checkbox("Enabled", &enabled);
+	ImGui::SameLine();
+	ImGui::Checkbox("Pause", &paused);
+	if (!gpu_timers)
+		ImGui::Text("No GPU timers (timestamp queries are not supported)");
+
+	//the frame times of the history, the oldest first
+	float cpu_times[PROFILER_HISTORY];
+	float gpu_times[PROFILER_HISTORY];
+	int num_ready = 0;
+	for (int i = num_frames; i >= 1; --i)
+	{
+		const sProfileFrame& frame = history[(head - i + PROFILER_HISTORY) % PROFILER_HISTORY];
+		if (!frame.gpu_ready)
+			continue;
+		cpu_times[num_ready] = (float)frame.cpu_ms;
+		gpu_times[num_ready] = (float)frame.gpu_ms;
+		num_ready++;
+	}
+	if (!num_ready)
+		return;
+	ImGui::PlotLines("CPU ms", cpu_times, num_ready, 0, NULL, 0.0f, FLT_MAX, ImVec2(0, 40));
+	if (gpu_timers)
+		ImGui::PlotLines("GPU ms", gpu_times, num_ready, 0, NULL, 0.0f, FLT_MAX, ImVec2(0, 40));
+
+	ImGui::SliderInt("Frames ago", &selected_frame, 0, num_ready - 1);
+	selected_frame = std::min(selected_frame, num_ready - 1);
+	const sProfileFrame* frame = getLastFrame(selected_frame);
+	ImGui::Text("Frame %ld: CPU %.2f ms, GPU %.2f ms", frame->frame, frame->cpu_ms, frame->gpu_ms);
+	ImGui::Text("CPU");
+	renderFlameGraph(*frame, false);
+	if (gpu_timers)
+	{
+		ImGui::Text("GPU");
+		renderFlameGraph(*frame, true);
+	}
+
+	//the average of every scope in the history
+	if (ImGui::TreeNode("Averages"))
+	{
+		struct sTotal { double cpu_ms; double gpu_ms; int count; };
+		std::map<std::string, sTotal> totals;
+		for (int i = 0; i < num_ready; ++i)
+		{
+			const sProfileFrame* f = getLastFrame(i);
+			for (int j = 0; j < f->scopes.size(); ++j)
+			{
+				const sProfileScope& scope = f->scopes[j];
+				sTotal& total = totals[scope.name];
+				total.cpu_ms += scope.cpu_end - scope.cpu_start;
+				if (scope.gpu_start >= 0)
+					total.gpu_ms += scope.gpu_end - scope.gpu_start;
+				total.count++;
+			}
+		}
+		for (std::map<std::string, sTotal>::iterator it = totals.begin(); it != totals.end(); ++it)
+			ImGui::Text("%s: CPU %.3f ms, GPU %.3f ms", it->first.c_str(), it->second.cpu_ms / num_ready, it->second.gpu_ms / num_ready);
+		ImGui::TreePop();
+	}
+
+	if (ImGui::Button("Export trace"))
+	{
+		if (exportTrace("profile.json"))
+			std::cout << " + Profiler: trace of " << num_frames << " frames written to profile.json (open it in chrome://tracing)" << std::endl;
+		else
+			std::cout << "Error: can't write profile.json" << std::endl;
+	}
+#endif
+}
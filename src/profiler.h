@@ -0,0 +1,107 @@
+/*  Profiler
+	Hierarchical timers of the frame: every scope measures its CPU time and, if it is a GPU scope, the time the GPU spent
+	in its commands (with timestamp queries, so the scopes can be nested). The frames are kept in a ring history,
+	the GPU times of a frame are read some frames later, when the queries are ready, so the profiler never waits for the GPU.
+	Only the main thread is measured, the scopes opened by the workers are ignored.
+
+	{
+		PROFILE_GPU_SCOPE("shadow maps");
+		...
+	}
+*/
+#ifndef PROFILER_H
+#define PROFILER_H
+
+#include "includes.h"
+#include <vector>
+#include <string>
+#include <set>
+#include <thread>
+
+#define PROFILER_HISTORY 120 //frames kept
+#define PROFILER_MAX_DEPTH 16
+
+struct sProfileScope {
+	const char* name; //a copy kept by the profiler, the names of the scopes can be temporary strings
+	int depth;
+	int parent; //index of the parent scope in the frame, -1 for the root scopes
+	double cpu_start; //ms since the start of the frame
+	double cpu_end;
+	int gpu_begin_query; //indices of its timestamps in the queries of the frame, -1 for CPU only scopes
+	int gpu_end_query;
+	double gpu_start; //ms since the first GPU timestamp of the frame, -1 until the queries are read
+	double gpu_end;
+};
+
+struct sProfileFrame {
+	long frame;
+	double start; //ms since the profiler was created
+	double cpu_ms;
+	double gpu_ms;
+	bool gpu_ready; //the queries of the frame have been read
+	int num_queries;
+	std::vector<GLuint> queries; //the first two are the timestamps of the whole frame, the memory is kept for the next use
+	std::vector<sProfileScope> scopes;
+};
+
+class Profiler {
+public:
+	bool enabled;
+	bool gpu_timers; //timestamp queries are supported
+	bool paused; //the history is not updated, to look at a frame
+
+	Profiler();
+	~Profiler();
+
+	//the profiler of the application
+	static Profiler* get();
+
+	void beginFrame();
+	void endFrame();
+
+	void beginScope(const char* name, bool gpu = false);
+	void endScope();
+
+	//the last frame whose GPU times are known (NULL if there is none yet)
+	const sProfileFrame* getLastFrame(int frames_ago = 0) const;
+
+	//writes the history in the trace event format of chrome://tracing (and Perfetto), the GPU scopes in their own track
+	bool exportTrace(const char* filename) const;
+
+	void renderInMenu();
+
+private:
+	std::thread::id main_thread;
+	bool gpu_checked;
+	std::set<std::string> names; //every name used by a scope, their pointers are stable
+	std::vector<GLuint64> timestamps;
+	std::vector<sProfileFrame> history;
+	int current; //frame being recorded, -1 outside beginFrame/endFrame (or while disabled or paused)
+	int head; //where the next frame is written
+	int num_frames; //frames in the history
+	long frame_counter;
+	int open_scopes[PROFILER_MAX_DEPTH];
+	int depth;
+	int ignored_depth; //scopes deeper than PROFILER_MAX_DEPTH are not recorded
+	double frame_start;
+	int selected_frame; //frames before the last one shown in the flame graph
+
+	double getTime() const; //ms since the profiler was created
+	int writeTimestamp(sProfileFrame& frame); //returns the index of the query
+	bool readQueries(sProfileFrame& frame); //false if the GPU has not reached the end of the frame yet
+	void renderFlameGraph(const sProfileFrame& frame, bool gpu);
+};
+
+//measures the scope where it is declared
+class ProfileScope {
+public:
+	ProfileScope(const char* name, bool gpu = false) { Profiler::get()->beginScope(name, gpu); }
+	~ProfileScope() { Profiler::get()->endScope(); }
+};
+
+#define PROFILE_CONCAT_(a, b) a##b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT_(a, b)
+#define PROFILE_SCOPE(name) ProfileScope PROFILE_CONCAT(profile_scope_, __LINE__)(name)
+#define PROFILE_GPU_SCOPE(name) ProfileScope PROFILE_CONCAT(profile_scope_, __LINE__)(name, true)
+
+#endif
@@ -1,18 +1,125 @@
 #include "renderCall.h"
+#include <cstring>
 
 // Constructor
+GTR::RenderCall::RenderCall()
+{
+    this->mesh = NULL;
+    this->material = NULL;
+    this->distance_to_camera = 0.0f;
+    this->sort_key = 0;
+}
+
 GTR::RenderCall::RenderCall(Matrix44* model, Mesh* mesh, Material* material, float distance_to_camera)
 {  
     this->model = *model;
     this->mesh = mesh;
     this->material = material;
     this->distance_to_camera = distance_to_camera;
+    this->sort_key = 0;
 }
     
 // desrtuctor
 //GTR::RenderCall::~RenderCall(){}
 
 
+// Sort key layout, from the most to the less significant bits.
+// Opaque and mask (front to back, grouped by state inside every coarse distance slice):
+//   pass (2) | alpha mode (2) | coarse depth (4) | shader (8) | material (16) | mesh (16) | depth (16)
+// Blend (back to front, the order matters more than the state changes):
+//   pass (2) | alpha mode (2) | inverted depth (20) | shader (8) | material (16) | mesh (16)
+#define SORT_KEY_COARSE_DEPTH_BITS 4
+#define SORT_KEY_FINE_DEPTH_BITS 16
+#define SORT_KEY_BLEND_DEPTH_BITS 20
+
+void GTR::RenderCall::computeSortKey(eRenderPass pass, int shader_id, float far_plane)
+{
+    float depth = clamp(distance_to_camera / far_plane, 0.0f, 1.0f);
+
+    uint64_t key = ((uint64_t)(pass & 0x3) << 62) | ((uint64_t)(material->alpha_mode & 0x3) << 60);
+    uint64_t state = ((uint64_t)(shader_id & 0xFF) << 32)
+        | ((uint64_t)(material->m_Id & 0xFFFF) << 16)
+        | (uint64_t)(mesh->m_Id & 0xFFFF);
+
+    if (material->alpha_mode == BLEND)
+    {
+        //farther objects must be drawn first
+        uint64_t max_depth = (1 << SORT_KEY_BLEND_DEPTH_BITS) - 1;
+        uint64_t inverted_depth = max_depth - (uint64_t)(depth * max_depth);
+        sort_key = key | (inverted_depth << 40) | state;
+    }
+    else
+    {
+        //the slices are distributed with a square root so there are more of them close to the camera
+        uint64_t coarse_depth = (uint64_t)(sqrtf(depth) * ((1 << SORT_KEY_COARSE_DEPTH_BITS) - 1));
+        uint64_t fine_depth = (uint64_t)(depth * ((1 << SORT_KEY_FINE_DEPTH_BITS) - 1));
+        sort_key = key | (coarse_depth << 56) | (state << SORT_KEY_FINE_DEPTH_BITS) | fine_depth;
+    }
+}
+
+struct sSortItem {
+    uint64_t key;
+    GTR::RenderCall* rc;
+};
+
+// LSD radix sort, 8 bits per pass. Works on a copy of the keys so the render calls are not touched while sorting
+void GTR::RenderCall::sortRenderCalls(std::vector<RenderCall*>& rc_vector)
+{
+    //buffers are kept between frames to avoid allocations (only used from the render thread)
+    static std::vector<sSortItem> items;
+    static std::vector<sSortItem> tmp;
+
+    int num = (int)rc_vector.size();
+    if (num < 2)
+        return;
+
+    items.resize(num);
+    tmp.resize(num);
+
+    //build the histograms of every byte in a single pass
+    int histograms[8][256];
+    memset(histograms, 0, sizeof(histograms));
+    for (int i = 0; i < num; ++i)
+    {
+        uint64_t key = rc_vector[i]->sort_key;
+        items[i].key = key;
+        items[i].rc = rc_vector[i];
+        for (int b = 0; b < 8; ++b)
+            histograms[b][(key >> (b * 8)) & 0xFF]++;
+    }
+
+    sSortItem* src = &items[0];
+    sSortItem* dst = &tmp[0];
+    for (int b = 0; b < 8; ++b)
+    {
+        int* histogram = histograms[b];
+        int shift = b * 8;
+
+        //if all the keys have the same byte this pass would not change the order
+        if (histogram[(src[0].key >> shift) & 0xFF] == num)
+            continue;
+
+        //prefix sum to get the first position of every bucket
+        int offsets[256];
+        int total = 0;
+        for (int i = 0; i < 256; ++i)
+        {
+            offsets[i] = total;
+            total += histogram[i];
+        }
+
+        for (int i = 0; i < num; ++i)
+            dst[offsets[(src[i].key >> shift) & 0xFF]++] = src[i];
+
+        sSortItem* swap = src;
+        src = dst;
+        dst = swap;
+    }
+
+    for (int i = 0; i < num; ++i)
+        rc_vector[i] = src[i].rc;
+}
+
 // Operators
 bool GTR::RenderCall::operator == (RenderCall& rc_b){
     return this->material->alpha_mode == rc_b.material->alpha_mode;
@@ -25,3 +132,37 @@ bool GTR::RenderCall::operator > (RenderCall& rc_b){
 bool GTR::RenderCall::operator < (RenderCall& rc_b){
     return this->material->alpha_mode > rc_b.material->alpha_mode;
 }
+
+
+// Arena
+GTR::RenderCallArena::RenderCallArena()
+{
+    this->num_used = 0;
+    this->last_frame_used = 0;
+    this->peak_used = 0;
+}
+
+GTR::RenderCallArena::~RenderCallArena()
+{
+    for (int i = 0; i < blocks.size(); i++)
+        delete[] blocks[i];
+}
+
+GTR::RenderCall* GTR::RenderCallArena::allocate()
+{
+    int block = num_used / BLOCK_SIZE;
+    // only allocates memory when the frame needs more render calls than ever before
+    if (block == blocks.size())
+        blocks.push_back(new RenderCall[BLOCK_SIZE]);
+    RenderCall* rc = &blocks[block][num_used % BLOCK_SIZE];
+    num_used++;
+    return rc;
+}
+
+void GTR::RenderCallArena::reset()
+{
+    last_frame_used = num_used;
+    if (num_used > peak_used)
+        peak_used = num_used;
+    num_used = 0;
+}
@@ -3,10 +3,16 @@
 #include "framework.h"
 #include "mesh.h"
 #include "material.h"
+#include <stdint.h>
 
 
 namespace GTR{
 
+    // Pass that a render call belongs to, it is the most significant field of the sort key
+    enum eRenderPass {
+        MAIN_PASS = 0,
+        SHADOW_PASS = 1
+    };
 
     class RenderCall
     {
@@ -15,7 +21,11 @@ namespace GTR{
         Mesh* mesh;
         Material* material;
         float distance_to_camera;
+        BoundingBox world_bounding; // in world space, to find the lights that reach it
+        // packed key (pass, alpha mode, shader, material, mesh and depth) used to order the draws
+        uint64_t sort_key;
 
+        RenderCall();
         RenderCall(Matrix44* model, Mesh* mesh, Material* material, float distance_to_camera);
         //~RenderCall();
 
@@ -24,16 +34,36 @@ namespace GTR{
         bool operator > (RenderCall& rc_b);
         bool operator < (RenderCall& rc_b);
 
-        // sorting function
-        static bool sorting_renderCalls (const RenderCall* rc_a, const RenderCall* rc_b){
-            if(rc_a->material->alpha_mode < rc_b->material->alpha_mode)
-                return true;
-            return false;
-        }
-        
+        // Build the sort key, far_plane is used to quantize the distance to the camera
+        void computeSortKey(eRenderPass pass, int shader_id, float far_plane);
+
+        // sorting function, radix sort by sort_key (stable and linear with the number of calls)
+        static void sortRenderCalls(std::vector<RenderCall*>& rc_vector);
     };
-    
 
+    // Frame scoped pool of render calls. They are stored by value in fixed size blocks,
+    // so the pointers stay valid during the frame and reset() releases all of them in one step
+    class RenderCallArena
+    {
+        static const int BLOCK_SIZE = 256;
+        std::vector<RenderCall*> blocks;
+        int num_used;
+
+    public:
+        int last_frame_used; // render calls allocated during the last frame
+        int peak_used; // max render calls allocated in a single frame
+
+        RenderCallArena();
+        ~RenderCallArena();
+
+        // returns a render call that lives until the next reset
+        RenderCall* allocate();
+        // frees every render call of the frame (the blocks are kept for the next one)
+        void reset();
+
+        int getCapacity() { return (int)blocks.size() * BLOCK_SIZE; }
+        int getUsed() { return num_used; }
+    };
 
 }
 
@@ -10,34 +10,225 @@
 #include "scene.h"
 #include "extra/hdre.h"
 #include "application.h"
+#include "glstate.h"
+#include "simplify.h"
+#include "commandlist.h"
+#include "profiler.h"
 
 
 using namespace GTR;
+
+//uniforms set in every draw, registered once so the shaders find them with an array lookup
+static UniformHandle u_model("u_model");
+static UniformHandle u_viewprojection("u_viewprojection");
+static UniformHandle u_camera_position("u_camera_position");
+static UniformHandle u_color("u_color");
+static UniformHandle u_has_emissive_light("u_has_emissive_light");
+static UniformHandle u_color_texture("u_color_texture");
+static UniformHandle u_emissive_texture("u_emissive_texture");
+static UniformHandle u_emissive_factor("u_emissive_factor");
+static UniformHandle u_metallic_roughness_texture("u_metallic_roughness_texture");
+static UniformHandle u_normal_texture("u_normal_texture");
+static UniformHandle u_occlusion_texture("u_occlusion_texture");
+static UniformHandle u_alpha_cutoff("u_alpha_cutoff");
+static UniformHandle u_ambient_light("u_ambient_light");
+static UniformHandle u_light_color("u_light_color");
+static UniformHandle u_light_position("u_light_position");
+static UniformHandle u_light_type("u_light_type");
+static UniformHandle u_light_direction("u_light_direction");
+static UniformHandle u_max_distance("u_max_distance");
+static UniformHandle u_cone_angle("u_cone_angle");
+static UniformHandle u_num_lights("u_num_lights");
+
+//instancing needs OpenGL 3.3 or the ARB extensions in older contexts
+static bool isInstancingSupported()
+{
+#ifdef USE_INSTANCING
+	int major = 0, minor = 0;
+	const char* version = (const char*)glGetString(GL_VERSION);
+	if (version)
+		sscanf(version, "%d.%d", &major, &minor);
+	if (major > 3 || (major == 3 && minor >= 3))
+		return true;
+	const char* extensions = (const char*)glGetString(GL_EXTENSIONS);
+	return extensions && strstr(extensions, "GL_ARB_instanced_arrays") && strstr(extensions, "GL_ARB_draw_instanced");
+#else
+	return false;
+#endif
+}
+
+//vertex arrays need OpenGL 3.0 or one of the extensions in older contexts
+static bool isVertexArraySupported()
+{
+#ifdef USE_VERTEX_ARRAYS
+	int major = 0;
+	const char* version = (const char*)glGetString(GL_VERSION);
+	if (version)
+		sscanf(version, "%d", &major);
+	if (major >= 3)
+		return true;
+	const char* extensions = (const char*)glGetString(GL_EXTENSIONS);
+	return extensions && (strstr(extensions, "GL_ARB_vertex_array_object") || strstr(extensions, "GL_APPLE_vertex_array_object"));
+#else
+	return false;
+#endif
+}
+
+//hash of everything that affects a shadow map: the light camera, its tile and the casters it sees (mesh, model and what renderMesh reads of the material)
+static uint64_t hashShadowState(Camera* camera, const Vector4& atlas_rect, const std::vector<RenderCall*>& rc_vector)
+{
+	//FNV-1a
+	uint64_t hash = 14695981039346656037ULL;
+	const uint64_t prime = 1099511628211ULL;
+	const unsigned char* bytes = (const unsigned char*)camera->viewprojection_matrix.m;
+	for (int i = 0; i < sizeof(camera->viewprojection_matrix.m); ++i)
+		hash = (hash ^ bytes[i]) * prime;
+	//moving to another tile of the atlas also needs a new shadow map
+	bytes = (const unsigned char*)&atlas_rect;
+	for (int i = 0; i < sizeof(atlas_rect); ++i)
+		hash = (hash ^ bytes[i]) * prime;
+	for (int i = 0; i < rc_vector.size(); ++i)
+	{
+		RenderCall* rc = rc_vector[i];
+		hash = (hash ^ (uint64_t)rc->mesh->m_Id) * prime;
+		hash = (hash ^ (uint64_t)rc->material->m_Id) * prime;
+		hash = (hash ^ (uint64_t)rc->material->alpha_mode) * prime;
+		//the menu edits the material in place, its id doesn't change
+		hash = (hash ^ (uint64_t)rc->material->two_sided) * prime;
+		Texture* color_texture = rc->material->color_texture.texture;
+		hash = (hash ^ (uint64_t)(color_texture ? color_texture->texture_id : 0)) * prime;
+		bytes = (const unsigned char*)&rc->material->alpha_cutoff;
+		for (int j = 0; j < sizeof(rc->material->alpha_cutoff); ++j)
+			hash = (hash ^ bytes[j]) * prime;
+		bytes = (const unsigned char*)&rc->material->color;
+		for (int j = 0; j < sizeof(rc->material->color); ++j)
+			hash = (hash ^ bytes[j]) * prime;
+		bytes = (const unsigned char*)rc->model.m;
+		for (int j = 0; j < sizeof(rc->model.m); ++j)
+			hash = (hash ^ bytes[j]) * prime;
+	}
+	return hash ? hash : 1; //0 means not rendered
+}
+
+//the material uniforms of the ubo shaders, in the layout of the MaterialData block
+static void fillMaterialBlock(sMaterialBlock& block, GTR::Material* material)
+{
+	block.padding[0] = block.padding[1] = block.padding[2] = 0;
+	block.color = material->color;
+	block.emissive_factor = material->emissive_factor;
+	block.alpha_cutoff = material->alpha_mode == GTR::eAlphaMode::MASK ? material->alpha_cutoff : 0;
+	block.has_emissive_light = material->emissive_texture.texture != NULL;
+}
+
+//the textures of the material in the slots of the light shaders (a white texture for the ones it doesn't have)
+static void getMaterialTextures(GTR::Material* material, Texture** textures)
+{
+	textures[0] = material->color_texture.texture;
+	textures[1] = material->emissive_texture.texture;
+	textures[2] = material->metallic_roughness_texture.texture;
+	textures[3] = material->normal_texture.texture;
+	textures[4] = material->occlusion_texture.texture;
+	for (int t = 0; t < 5; t++)
+		if (!textures[t])
+			textures[t] = Texture::getWhiteTexture();
+}
+
+//draws the mesh once or once per instance if there are instanced models
+static void drawMesh(Mesh* mesh, const Matrix44* instanced_models, int num_instances)
+{
+	if (num_instances > 0)
+		mesh->renderInstanced(GL_TRIANGLES, instanced_models, num_instances);
+	else
+		mesh->render(GL_TRIANGLES);
+}
+
 Renderer::Renderer(GTR::eMultipleLightRendering multiple_light_rendering, std::string shader_name){
 	this->multiple_light_rendering = multiple_light_rendering;
 	this->shader_name = shader_name;
     this->selected_light = 0;
+    this->show_depth_complexity = false;
+    this->fragments_shaded = 0;
+    this->fragments_saved = 0;
+    this->depth_complexity_queries[0] = this->depth_complexity_queries[1] = 0;
+    this->instancing_supported = isInstancingSupported(); //here so we have opengl ready in constructor
+    this->use_instancing = this->instancing_supported;
+    this->vertex_arrays_supported = isVertexArraySupported();
+    Mesh::use_vertex_arrays = this->vertex_arrays_supported;
+    this->num_draw_calls = 0;
+    this->num_draw_calls_saved = 0;
+    this->job_system = new JobSystem();
+    for (int i = 0; i < job_system->getNumThreads(); i++)
+        this->render_call_arenas.push_back(new RenderCallArena());
+    this->use_multithreading = true;
+    this->use_occlusion_culling = true;
+    this->occlusion_buffer = new OcclusionBuffer();
+    this->occlusion_time = 0;
+    this->collect_occlusion = NULL;
+    this->use_lods = true;
+    this->lod_screen_error = 1.0f;
+    this->num_lod_calls = 0;
+    this->collect_lod_camera = NULL;
+    this->shadow_atlas = new ShadowAtlas();
+    this->use_shadow_cache = true;
+    this->num_shadows_rendered = 0;
+    this->num_shadows_cached = 0;
+    this->num_shadows_empty = 0;
+    this->collect_time = 0;
+    this->max_lights_per_object = MAX_LIGHTS_PER_OBJECT;
+    this->num_object_lights = 0;
+    this->light_clusters = new LightClusters();
+    this->cluster_time = 0;
+    this->gbuffers = NULL;
+    this->show_gbuffers = false;
+    this->uniform_buffers_supported = UniformBuffer::isSupported();
+    this->use_uniform_buffers = this->uniform_buffers_supported;
+    this->frame_buffer = NULL;
+    this->lights_buffer = NULL;
+    this->light_block_stride = 0;
+    this->current_material = NULL;
+    this->num_material_uploads = 0;
+    this->use_command_lists = true;
+    this->gl_backend = new GLCommandBackend();
+    this->record_time = 0;
+    this->replay_time = 0;
+    this->num_commands = 0;
+    this->benchmark_command_lists = false;
+    this->command_lists_correct = false;
+    this->use_depth_prepass = false;
+    this->auto_depth_prepass = true;
+    this->overdraw_threshold = 1.5f;
+    this->overdraw = 0;
+    this->depth_prepass_active = false;
+    this->depth_prepass_done = false;
+    this->overdraw_query = 0;
+    this->overdraw_query_pending = false;
+    this->overdraw_query_scale = 0;
+    this->render_graph = new RenderGraph();
 }
 
 void Renderer::changeMultiLightRendering(){
-	this->multiple_light_rendering = static_cast<GTR::eMultipleLightRendering>((this->multiple_light_rendering + 1) % 3);
+	this->multiple_light_rendering = static_cast<GTR::eMultipleLightRendering>((this->multiple_light_rendering + 1) % 5);
 	if(multiple_light_rendering == SINGLEPASS){
 		shader_name = "singlepass";
 	}
-	else if(multiple_light_rendering == MULTIPASS || multiple_light_rendering == NOMULTIPLELIGHT){
+	else if(multiple_light_rendering == MULTIPASS || multiple_light_rendering == NOMULTIPLELIGHT || multiple_light_rendering == DEFERRED){
 		shader_name = "light";
 	}
+	else if(multiple_light_rendering == CLUSTERED){
+		shader_name = "clustered";
+	}
 }
 
-void Renderer::singlepassRendering(std::vector<LightEntity*> light_entities, Shader* shader, Mesh* mesh)
+void Renderer::singlepassRendering(std::vector<LightEntity*>& light_entities, Shader* shader, Mesh* mesh, const Matrix44* instanced_models, int num_instances)
 {
     int number_of_lights = (int)light_entities.size();
-    Vector3 light_color[5];
-    Vector3 light_position[5];
-    eLightType light_type[5];
-    Vector3 target[5];
-    float max_distance[5];
-    float cone_angle[5];
+    assert(number_of_lights <= MAX_LIGHTS_PER_OBJECT && "the singlepass shader has no room for more lights");
+    Vector3 light_color[MAX_LIGHTS_PER_OBJECT];
+    Vector3 light_position[MAX_LIGHTS_PER_OBJECT];
+    eLightType light_type[MAX_LIGHTS_PER_OBJECT];
+    Vector3 target[MAX_LIGHTS_PER_OBJECT];
+    float max_distance[MAX_LIGHTS_PER_OBJECT];
+    float cone_angle[MAX_LIGHTS_PER_OBJECT];
 
     for (int i = 0; i < number_of_lights; i++){
         GTR::LightEntity* light = light_entities[i];
@@ -49,87 +240,230 @@ void Renderer::singlepassRendering(std::vector<LightEntity*> light_entities, Sha
         max_distance[i] = light->max_distance;
         cone_angle[i] = light->cone_angle;
     }
-    shader->setUniform3Array("u_light_color",(float*)&light_color, number_of_lights);
-    shader->setUniform3Array("u_light_position",(float*)&light_position, number_of_lights);
-    shader->setUniform1Array("u_light_type",(int*)&light_type, number_of_lights);
-    shader->setUniform3Array("u_light_direction",(float*)&target, number_of_lights);
-    shader->setUniform1Array("u_max_distance",(float*)&max_distance, number_of_lights);
-    shader->setUniform1Array("u_cone_angle",(float*)&cone_angle, number_of_lights);
-    shader->setUniform1("u_num_lights", number_of_lights);
+    shader->setUniform3Array(u_light_color,(float*)&light_color, number_of_lights);
+    shader->setUniform3Array(u_light_position,(float*)&light_position, number_of_lights);
+    shader->setUniform1Array(u_light_type,(int*)&light_type, number_of_lights);
+    shader->setUniform3Array(u_light_direction,(float*)&target, number_of_lights);
+    shader->setUniform1Array(u_max_distance,(float*)&max_distance, number_of_lights);
+    shader->setUniform1Array(u_cone_angle,(float*)&cone_angle, number_of_lights);
+    shader->setUniform(u_num_lights, number_of_lights);
+    num_object_lights += number_of_lights;
 
     //do the draw call that renders the mesh into the screen
-    mesh->render(GL_TRIANGLES);
+    drawMesh(mesh, instanced_models, num_instances);
+}
+
+void Renderer::selectObjectLights(const BoundingBox* world_bounding, std::vector<LightEntity*>& lights){
+    object_lights.clear();
+    object_light_scores.clear();
+    for (int i = 0; i < lights.size(); i++){
+        LightEntity* light = lights[i];
+        if (!light->visible || (world_bounding && !light->intersectsBox(*world_bounding)))
+            continue;
+        
+        // How much the light can give to the closest point of the box (directional lights reach everything)
+        float score = light->intensity;
+        if (light->light_type == DIRECTIONAL)
+            score += 1e10f;
+        else if (world_bounding){
+            Vector3 light_position = light->model.getTranslation();
+            Vector3 closest = light_position;
+            closest.setMax(world_bounding->center - world_bounding->halfsize);
+            closest.setMin(world_bounding->center + world_bounding->halfsize);
+            score *= 1.0f - std::min(1.0f, (float)closest.distance(light_position) / light->max_distance);
+        }
+        
+        // Insertion in the list sorted by score, the least important ones are dropped when it is full
+        int pos = (int)object_lights.size();
+        while (pos > 0 && object_light_scores[pos - 1] < score)
+            pos--;
+        if (pos >= max_lights_per_object)
+            continue;
+        object_lights.insert(object_lights.begin() + pos, light);
+        object_light_scores.insert(object_light_scores.begin() + pos, score);
+        if (object_lights.size() > max_lights_per_object){
+            object_lights.pop_back();
+            object_light_scores.pop_back();
+        }
+    }
 }
-void Renderer::multipassRendering(std::vector<LightEntity*> lights, Shader* shader, Mesh* mesh, Material* material){
+void Renderer::multipassRendering(std::vector<LightEntity*> lights, Shader* shader, Mesh* mesh, Material* material, const Matrix44* instanced_models, int num_instances, bool uniform_blocks){
     int num_lights = (int)lights.size();
     
     //allow to render pixels that have the same depth as the one in the depth buffer
-    glDepthFunc( GL_LEQUAL );
+    //(after the depth pre-pass only the ones that are exactly the visible surface)
+    GLState::depthFunc( depth_prepass_done ? GL_EQUAL : GL_LEQUAL );
 
     //set blending mode to additive
     //this will collide with materials with blend...
-    glBlendFunc( GL_SRC_ALPHA,GL_ONE );
+    GLState::blendFunc( GL_SRC_ALPHA,GL_ONE );
     
     for(int i = 0; i < num_lights; ++i)
     {
         //first pass doesn't use blending
         if(i == 0 )
-            glDisable( GL_BLEND );
+            GLState::disable( GL_BLEND );
         
         else{
-            glEnable( GL_BLEND );
-            shader->setUniform("u_emissive_factor", Vector3(0,0,0));
-            shader->setUniform("u_ambient_light", Vector3(0,0,0));
+            GLState::enable( GL_BLEND );
+            //the light blocks already have the ambient factor at zero after the first one
+            if (!uniform_blocks){
+                shader->setUniform(u_emissive_factor, Vector3(0,0,0));
+                shader->setUniform(u_ambient_light, Vector3(0,0,0));
+            }
         }
         
         if(material->alpha_mode == GTR::eAlphaMode::BLEND){
-            glEnable(GL_BLEND);
-            glBlendFunc(GL_ONE, GL_ONE);
+            GLState::enable(GL_BLEND);
+            GLState::blendFunc(GL_ONE, GL_ONE);
         }
 
         //pass the light data to the shader
-        lights[i]->setUniforms( shader );
+        if (uniform_blocks)
+            lights_buffer->bindRange(i * light_block_stride, sizeof(sLightBlock));
+        else
+            lights[i]->setUniforms( shader );
 
         //render the mesh
-        mesh->render(GL_TRIANGLES);
+        drawMesh(mesh, instanced_models, num_instances);
     }
 
-    glDisable( GL_BLEND );
-    glDepthFunc( GL_LESS ); //as default
+    GLState::disable( GL_BLEND );
+    GLState::depthFunc( depth_prepass_done ? GL_EQUAL : GL_LESS ); //as default
 }
 
 void Renderer::renderScene(GTR::Scene* scene, Camera* camera)
 {
-    // Collecting render calls
-    collectRenderCall(scene, camera, &this->render_call_vector);
-    // sorting by alpha
-    std::sort(render_call_vector.begin(), render_call_vector.end(), RenderCall::sorting_renderCalls);
-    
-    // Render to depth buffer of every light to create Shadow Maps
+    num_draw_calls = 0;
+    num_draw_calls_saved = 0;
+    num_object_lights = 0;
+    num_commands = 0;
+    record_time = 0;
+    replay_time = 0;
+
     std::vector<GTR::LightEntity*> lights = scene->light_entities;
     
+    // Give a tile of the shadow atlas to every shadow view, the cascades are fitted to the texels of their tile
+    shadow_atlas->assignTiles(lights, camera);
+    for (int i = 0; i < lights.size(); i++)
+        lights[i]->updateShadowViews(camera);
+    
+    // Collecting render calls for the camera and for every shadow view in a single traversal of the scene
+    std::vector<Camera*> cameras(1, camera);
+    std::vector< std::vector<RenderCall*>* > rc_vectors(1, &this->render_call_vector);
     for (int i = 0; i < lights.size(); i++){
-        // Collecting render calls for every light
-        collectRenderCall(scene, lights[i]->camera, & lights[i]->rc);
-        // sorting by alpha
-        std::sort(lights[i]->rc.begin(), lights[i]->rc.end(), RenderCall::sorting_renderCalls);
-        
-        // Rendering the depth buffer to texture
-        renderLightDepthBuffer(lights[i], lights[i]->rc);
+        for (int j = 0; j < lights[i]->num_shadow_views; j++){
+            sShadowView& view = lights[i]->shadow_views[j];
+            if (!view.tile_size)
+                continue;
+            cameras.push_back(view.camera);
+            rc_vectors.push_back(&view.rc);
+        }
+    }
+    // The occluders are rasterized first, the nodes behind them are not collected for the camera (the shadow views still see them)
+    if (use_occlusion_culling){
+        PROFILE_SCOPE("occluders");
+        Uint64 occlusion_start = SDL_GetPerformanceCounter();
+        renderOccluders(scene, camera);
+        occlusion_time = (SDL_GetPerformanceCounter() - occlusion_start) * 1000.0 / SDL_GetPerformanceFrequency();
+        collect_occlusion = occlusion_buffer;
+    }
+    // The shadow views use the same levels as the camera, the shadows are seen from it
+    collect_lod_camera = use_lods ? camera : NULL;
+    Uint64 collect_start = SDL_GetPerformanceCounter();
+    {
+        PROFILE_SCOPE("collect");
+        collectRenderCall(scene, cameras, rc_vectors);
+    }
+    collect_time = (SDL_GetPerformanceCounter() - collect_start) * 1000.0 / SDL_GetPerformanceFrequency();
+    collect_occlusion = NULL;
+    collect_lod_camera = NULL;
+    num_lod_calls = 0;
+    for (int i = 0; i < render_call_vector.size(); i++)
+        if (render_call_vector[i]->mesh->lod_error > 0)
+            num_lod_calls++;
+    // sorting by alpha and state
+    {
+        PROFILE_SCOPE("sort");
+        sortRenderCalls(&this->render_call_vector, MAIN_PASS, camera);
     }
     
-    // Rendering to framebuffer
-    //set the clear color (the background color)
-    glClearColor(scene->background_color.x, scene->background_color.y, scene->background_color.z, 1.0);
-
-    // Clear the color and the depth buffer
-    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-    checkGLErrors();
-
-    for (int i = 0; i < render_call_vector.size(); i++){
-        renderMeshWithMaterial(render_call_vector[i]->model, render_call_vector[i]->mesh, render_call_vector[i]->material, camera);
+    // Asked from the menu, the calls of this frame are recorded and replayed without OpenGL
+    if (benchmark_command_lists){
+        command_lists_correct = benchmarkCommandLists(render_call_vector, camera);
+        benchmark_command_lists = false;
     }
     
+    // The passes of the frame, the ones whose results are not used (the shadows while viewing the overdraw) are culled
+    // and the transient textures (the gbuffers) come from the pool of the graph
+    render_graph->reset();
+    int window = render_graph->importResource("window");
+    int shadows = render_graph->importResource("shadow atlas", shadow_atlas->getTexture());
+    int light_data = render_graph->importResource("lights");
+    render_graph->markOutput(window);
+    num_shadows_rendered = 0;
+    num_shadows_cached = 0;
+    num_shadows_empty = 0;
+    
+    // Render to depth buffer of every shadow view to create Shadow Maps, all of them in one pass over the atlas
+    int pass = render_graph->addPass("shadow maps", [&](RenderGraph& graph) { renderShadowMaps(lights); });
+    render_graph->write(pass, shadows);
+    
+    // The lights are complete (their tiles are known), they are uploaded once for all the draws
+    pass = render_graph->addPass("lights", [&](RenderGraph& graph) {
+        if (use_uniform_buffers)
+            uploadUniformBuffers(scene, camera);
+        
+        // Lists of the lights that reach every cluster of the camera
+        if (multiple_light_rendering == CLUSTERED){
+            Uint64 cluster_start = SDL_GetPerformanceCounter();
+            light_clusters->setLights(lights);
+            light_clusters->assignLights(camera, use_multithreading ? job_system : NULL);
+            cluster_time = (SDL_GetPerformanceCounter() - cluster_start) * 1000.0 / SDL_GetPerformanceFrequency();
+            light_clusters->upload();
+        }
+    });
+    render_graph->read(pass, shadows);
+    render_graph->write(pass, light_data);
+    
+    // With a lot of overdraw the opaque calls write the depth first
+    updateDepthPrepass();
+    
+    if (show_depth_complexity){
+        pass = render_graph->addPass("depth complexity", [&](RenderGraph& graph) {
+            glClearColor(scene->background_color.x, scene->background_color.y, scene->background_color.z, 1.0);
+            glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+            renderDepthComplexity(render_call_vector, camera);
+        });
+        render_graph->write(pass, window);
+    }
+    else if (multiple_light_rendering == DEFERRED)
+        addDeferredPasses(scene, camera, render_call_vector, shadows, light_data, window);
+    else{
+        pass = render_graph->addPass("forward", [&](RenderGraph& graph) {
+            //set the clear color (the background color)
+            glClearColor(scene->background_color.x, scene->background_color.y, scene->background_color.z, 1.0);
+            
+            // Clear the color and the depth buffer
+            glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+            checkGLErrors();
+            
+            renderOpaqueCalls(render_call_vector, camera);
+            renderCalls(render_call_vector, camera, false, true);
+        });
+        render_graph->read(pass, shadows);
+        render_graph->read(pass, light_data);
+        render_graph->write(pass, window);
+    }
+    
+    render_graph->compile();
+    render_graph->execute();
+    
+    //set the render state as it was before to avoid problems with future renders
+    if (Shader::current)
+        Shader::current->disable();
+    GLState::disable(GL_BLEND);
+    
     // View the depth buffer of a light
     //viewDepthBuffer(lights[this->selected_light]);
     
@@ -137,14 +471,588 @@ void Renderer::renderScene(GTR::Scene* scene, Camera* camera)
     clearRenderCall(& this->render_call_vector);
     // Clear rendercall for every light depth texture
     for (int i = 0; i < lights.size(); i++){
-        clearRenderCall(& lights[i]->rc);
+        for (int j = 0; j < MAX_SHADOW_VIEWS; j++)
+            clearRenderCall(& lights[i]->shadow_views[j].rc);
     }
+    // Free all the render calls of this frame at once
+    for (int i = 0; i < render_call_arenas.size(); i++)
+        render_call_arenas[i]->reset();
+}
+
 
+void Renderer::renderShadowMaps(std::vector<LightEntity*>& lights){
+    shadow_atlas->bind();
+    for (int i = 0; i < lights.size(); i++){
+        for (int j = 0; j < lights[i]->num_shadow_views; j++){
+            sShadowView& view = lights[i]->shadow_views[j];
+            // Views without a tile don't cast shadows this frame
+            if (!view.tile_size){
+                view.hash = 0;
+                continue;
+            }
+            
+            // Nothing casts a shadow in this view (usually a face of a point light), it is not rendered nor sampled
+            if (view.rc.empty()){
+                view.atlas_rect = Vector4(0, 0, 0, 0);
+                view.hash = 0;
+                num_shadows_empty++;
+                continue;
+            }
+            
+            // If neither the view nor what it sees changed, the shadow map of the last frame is still valid
+            uint64_t shadow_hash = hashShadowState(view.camera, view.atlas_rect, view.rc);
+            if (use_shadow_cache && shadow_hash == view.hash){
+                num_shadows_cached++;
+                continue;
+            }
+            view.hash = shadow_hash;
+            num_shadows_rendered++;
+            
+            // sorting by alpha and state
+            sortRenderCalls(& view.rc, SHADOW_PASS, view.camera);
+            
+            // Rendering the depth buffer to its tile
+            renderLightDepthBuffer(view);
+        }
+    }
+    shadow_atlas->unbind();
 }
 
+void Renderer::uploadUniformBuffers(GTR::Scene* scene, Camera* camera){
+    std::vector<LightEntity*>& lights = scene->light_entities;
+    if (!frame_buffer){
+        frame_buffer = new UniformBuffer();
+        frame_buffer->create(FRAME_BLOCK_BINDING, sizeof(sFrameBlock));
+        lights_buffer = new UniformBuffer();
+        int alignment = UniformBuffer::getOffsetAlignment();
+        light_block_stride = (sizeof(sLightBlock) + alignment - 1) / alignment * alignment;
+    }
+    int lights_size = std::max(1, (int)lights.size()) * light_block_stride;
+    if (lights_buffer->size < lights_size)
+        lights_buffer->create(LIGHT_BLOCK_BINDING, lights_size);
+    
+    // Frame data
+    sFrameBlock frame;
+    frame.padding0 = frame.padding1 = 0;
+    frame.viewprojection = camera->viewprojection_matrix;
+    frame.camera_position = camera->eye;
+    frame.ambient_light = scene->ambient_light;
+    frame_buffer->update(&frame, sizeof(frame));
+    frame_buffer->bind();
+    
+    // A block for every light, the first one is the first pass of multipass (and the light of NOMULTIPLELIGHT) so it adds the ambient
+    light_blocks_data.assign(lights_size, 0);
+    for (int i = 0; i < lights.size(); i++)
+        lights[i]->fillUniformBlock(*(sLightBlock*)&light_blocks_data[i * light_block_stride]);
+    if (lights.size())
+        ((sLightBlock*)&light_blocks_data[0])->ambient_factor = 1;
+    lights_buffer->update(&light_blocks_data[0], lights_size);
+    
+    // The material is written in the frame stream by the first draw that uses it
+    current_material = NULL;
+    num_material_uploads = 0;
+    
+    // The binding points and the texture slots are state of the program, they don't change between draws
+    // (a shader missing from the atlas is skipped, its draws use the version with normal uniforms)
+    const char* shader_names[] = { "light_ubo", "light_ubo_instanced", "singlepass_ubo", "singlepass_ubo_instanced",
+        "clustered_ubo", "clustered_ubo_instanced", "gbuffers_ubo", "gbuffers_ubo_instanced" };
+    for (int i = 0; i < 8; i++){
+        Shader* shader = Shader::Get(shader_names[i]);
+        if (!shader)
+            continue;
+        // compiled without the blocks (the GLSL doesn't have the extension), use the normal uniforms
+        if (!shader->setUniformBlock("FrameData", FRAME_BLOCK_BINDING)){
+            use_uniform_buffers = uniform_buffers_supported = false;
+            return;
+        }
+        shader->setUniformBlock("LightData", LIGHT_BLOCK_BINDING); // only the light shader has it
+        shader->setUniformBlock("MaterialData", MATERIAL_BLOCK_BINDING);
+        shader->enable();
+        shader->setUniform("u_color_texture", 0);
+        shader->setUniform("u_emissive_texture", 1);
+        shader->setUniform("u_metallic_roughness_texture", 2);
+        shader->setUniform("u_normal_texture", 3);
+        shader->setUniform("u_occlusion_texture", 4);
+        shader->setUniform("u_shadow_atlas", 8);
+        shader->disable();
+    }
+}
+
+void Renderer::renderCalls(std::vector<RenderCall*>& rc_vector, Camera* camera, bool opaque, bool blended){
+    // Recorded by several threads and replayed here
+    if (use_command_lists && canRecordCalls()){
+        Uint64 record_start = SDL_GetPerformanceCounter();
+        int num_lists = 0;
+        {
+            PROFILE_SCOPE("record");
+            num_lists = recordCommandLists(rc_vector, camera, opaque, blended, use_multithreading ? job_system->getNumThreads() : 1);
+        }
+        Uint64 replay_start = SDL_GetPerformanceCounter();
+        {
+            PROFILE_GPU_SCOPE("replay");
+            for (int i = 0; i < num_lists; i++){
+                CommandList* list = command_lists[i];
+                list->replay(gl_backend);
+                num_draw_calls += list->num_draws;
+                num_draw_calls_saved += list->num_draws_saved;
+                num_material_uploads += list->num_material_uploads;
+                num_commands += list->num_commands;
+            }
+        }
+        Uint64 replay_end = SDL_GetPerformanceCounter();
+        record_time += (replay_start - record_start) * 1000.0 / SDL_GetPerformanceFrequency();
+        replay_time += (replay_end - replay_start) * 1000.0 / SDL_GetPerformanceFrequency();
+        
+        // the lists bound their own material blocks, and the state is left as the direct draws leave it
+        current_material = NULL;
+        GLState::depthFunc(depth_prepass_done ? GL_EQUAL : GL_LESS);
+        GLState::depthMask(!depth_prepass_done);
+        return;
+    }
+    
+    for (int i = 0; i < rc_vector.size(); ){
+        RenderCall* rc = rc_vector[i];
+        // Consecutive calls with the same mesh and material are drawn in a single instanced draw
+        int num_instances = getInstanceBatch(rc_vector, i);
+        bool is_blended = rc->material->alpha_mode == GTR::eAlphaMode::BLEND;
+        if (is_blended ? !blended : !opaque){
+            i += num_instances;
+            continue;
+        }
+        // The lights of a batch are the ones that reach any of its instances
+        BoundingBox world_bounding = rc->world_bounding;
+        for (int j = 1; j < num_instances; j++)
+            world_bounding = mergeBoundingBoxes(world_bounding, rc_vector[i + j]->world_bounding);
+        if (num_instances > 1)
+            renderMeshWithMaterial(rc->model, rc->mesh, rc->material, camera, &instanced_models[0], num_instances, &world_bounding);
+        else
+            renderMeshWithMaterial(rc->model, rc->mesh, rc->material, camera, NULL, 0, &world_bounding);
+        i += num_instances;
+    }
+}
+
+bool Renderer::canRecordCalls(){
+    // the light shader gets a whole light per pass (a range of the uniform buffer or its recorded uniforms),
+    // singlepass and clustered select the lights of every draw while rendering
+    if (shader_name != "light")
+        return false;
+    return multiple_light_rendering == NOMULTIPLELIGHT || multiple_light_rendering == MULTIPASS || multiple_light_rendering == DEFERRED;
+}
+
+int Renderer::recordCommandLists(std::vector<RenderCall*>& rc_vector, Camera* camera, bool opaque, bool blended, int num_threads){
+    while (command_lists.size() < num_threads){
+        command_lists.push_back(new CommandList());
+        record_models.push_back(std::vector<Matrix44>());
+    }
+    // created here, the threads only read it
+    Texture::getWhiteTexture();
+    
+    // A part of the calls for every thread, starting where a batch of instances starts
+    int num_calls = (int)rc_vector.size();
+    std::vector<int> starts(num_threads + 1, num_calls);
+    starts[0] = 0;
+    for (int t = 1; t < num_threads; t++){
+        int start = std::max(starts[t - 1], (int)((long)num_calls * t / num_threads));
+        while (use_instancing && start > 0 && start < num_calls && rc_vector[start]->mesh == rc_vector[start - 1]->mesh && rc_vector[start]->material == rc_vector[start - 1]->material)
+            start++;
+        starts[t] = start;
+    }
+    
+    if (num_threads > 1)
+        job_system->parallelFor(num_threads, [&](int index, int thread) {
+            recordCalls(command_lists[index], rc_vector, starts[index], starts[index + 1], camera, opaque, blended, record_models[index]);
+        });
+    else
+        recordCalls(command_lists[0], rc_vector, 0, num_calls, camera, opaque, blended, record_models[0]);
+    return num_threads;
+}
+
+void Renderer::recordCalls(CommandList* list, std::vector<RenderCall*>& rc_vector, int start, int end, Camera* camera, bool opaque, bool blended, std::vector<Matrix44>& models){
+    list->clear();
+    GTR::Material* current = NULL;
+    for (int i = start; i < end; ){
+        RenderCall* rc = rc_vector[i];
+        // the same batches as getInstanceBatch (a part always starts with a batch)
+        int num_instances = 1;
+        if (use_instancing)
+            while (i + num_instances < end && rc_vector[i + num_instances]->mesh == rc->mesh && rc_vector[i + num_instances]->material == rc->material)
+                num_instances++;
+        bool is_blended = rc->material->alpha_mode == GTR::eAlphaMode::BLEND;
+        if (is_blended ? !blended : !opaque){
+            i += num_instances;
+            continue;
+        }
+        if (num_instances > 1){
+            models.resize(num_instances);
+            for (int j = 0; j < num_instances; j++)
+                models[j] = rc_vector[i + j]->model;
+            list->num_draws_saved += num_instances - 1;
+            recordMeshWithMaterial(list, rc->model, rc->mesh, rc->material, camera, &models[0], num_instances, &current);
+        }
+        else
+            recordMeshWithMaterial(list, rc->model, rc->mesh, rc->material, camera, NULL, 0, &current);
+        i += num_instances;
+    }
+}
+
+void Renderer::recordMeshWithMaterial(CommandList* list, const Matrix44& model, Mesh* mesh, GTR::Material* material, Camera* camera, const Matrix44* instanced_models, int num_instances, GTR::Material** current){
+    if (!mesh || !mesh->getNumVertices() || !material)
+        return;
+    
+    // The same shader as renderMeshWithMaterial
+    bool to_gbuffers = multiple_light_rendering == DEFERRED && material->alpha_mode != GTR::eAlphaMode::BLEND;
+    const char* name = to_gbuffers ? "gbuffers" : "light";
+    Shader* shader = NULL;
+    bool uniform_blocks = false;
+    if (use_uniform_buffers){
+        shader = Shader::Get((std::string(name) + (num_instances ? "_ubo_instanced" : "_ubo")).c_str());
+        uniform_blocks = shader != NULL;
+    }
+    if (!shader)
+        shader = Shader::Get((std::string(name) + (num_instances ? "_instanced" : "")).c_str());
+    if (!shader)
+        return;
+    Texture* textures[5];
+    getMaterialTextures(material, textures);
+    
+    sPipelineState state;
+    state.shader = shader;
+    state.blend = material->alpha_mode == GTR::eAlphaMode::BLEND;
+    state.blend_src = GL_SRC_ALPHA;
+    state.blend_dst = GL_ONE_MINUS_SRC_ALPHA;
+    state.cull_face = !material->two_sided;
+    state.depth_func = depth_prepass_done ? GL_EQUAL : GL_LESS;
+    state.depth_mask = !depth_prepass_done;
+    list->bindPipeline(state);
+    if (!num_instances)
+        list->setUniform(u_model, model);
+    
+    if (uniform_blocks){
+        // The frame and the lights are in the uniform buffers, the material is written when it changes
+        if (material != *current){
+            sMaterialBlock block;
+            fillMaterialBlock(block, material);
+            list->setUniformBlock(MATERIAL_BLOCK_BINDING, &block, sizeof(block));
+            *current = material;
+        }
+    }
+    else{
+        // Everything with every draw, the slots of the samplers too
+        list->setUniform(u_viewprojection, camera->viewprojection_matrix);
+        list->setUniform(u_camera_position, camera->eye);
+        list->setUniform(u_color, material->color);
+        list->setUniform(u_has_emissive_light, (int)(material->emissive_texture.texture != NULL));
+        list->setUniform(u_emissive_factor, material->emissive_factor);
+        list->setUniform(u_alpha_cutoff, material->alpha_mode == GTR::eAlphaMode::MASK ? material->alpha_cutoff : 0.0f);
+        list->setUniform(u_ambient_light, Scene::instance->ambient_light);
+        const UniformHandle* samplers[5] = { &u_color_texture, &u_emissive_texture, &u_metallic_roughness_texture, &u_normal_texture, &u_occlusion_texture };
+        for (int t = 0; t < 5; t++)
+            list->setUniform(*samplers[t], t);
+    }
+    for (int t = 0; t < 5; t++)
+        list->bindTexture(t, textures[t]);
+    
+    if (to_gbuffers){
+        // the lights are added later in screen space
+        list->draw(mesh, GL_TRIANGLES, instanced_models, num_instances);
+        return;
+    }
+    list->bindTexture(8, shadow_atlas->getTexture());
+    
+    std::vector<LightEntity*>& lights = Scene::instance->light_entities;
+    if (multiple_light_rendering == NOMULTIPLELIGHT){
+        if (uniform_blocks)
+            list->bindBufferRange(lights_buffer, 0, sizeof(sLightBlock));
+        else
+            lights[0]->recordUniforms(list);
+        list->draw(mesh, GL_TRIANGLES, instanced_models, num_instances);
+        return;
+    }
+    
+    // Multipass: the first light without blending, the rest added (the blended materials add all of them)
+    int num_lights = (int)lights.size();
+    state.depth_func = depth_prepass_done ? GL_EQUAL : GL_LEQUAL;
+    for (int i = 0; i < num_lights; i++){
+        state.blend = i > 0 || material->alpha_mode == GTR::eAlphaMode::BLEND;
+        state.blend_src = material->alpha_mode == GTR::eAlphaMode::BLEND ? GL_ONE : GL_SRC_ALPHA;
+        state.blend_dst = GL_ONE;
+        list->bindPipeline(state);
+        if (uniform_blocks)
+            list->bindBufferRange(lights_buffer, i * light_block_stride, sizeof(sLightBlock));
+        else{
+            // only the first light adds the ambient and the emissive light
+            if (i == 1){
+                list->setUniform(u_emissive_factor, Vector3(0, 0, 0));
+                list->setUniform(u_ambient_light, Vector3(0, 0, 0));
+            }
+            lights[i]->recordUniforms(list);
+        }
+        list->draw(mesh, GL_TRIANGLES, instanced_models, num_instances);
+    }
+}
+
+bool Renderer::benchmarkCommandLists(std::vector<RenderCall*>& rc_vector, Camera* camera){
+    if (!canRecordCalls()){
+        std::cout << " + Command lists: not used with this mode (they need the light shader)" << std::endl;
+        return false;
+    }
+    // Recording in one thread and in all of them, replayed without OpenGL
+    const int repetitions = 100;
+    NullCommandBackend backend;
+    int thread_counts[2] = { 1, job_system->getNumThreads() };
+    int num_draws[2], num_triangles[2];
+    for (int k = 0; k < 2; k++){
+        double record_ms = 0, replay_ms = 0;
+        int num_lists = 0;
+        for (int r = 0; r < repetitions; r++){
+            Uint64 start = SDL_GetPerformanceCounter();
+            num_lists = recordCommandLists(rc_vector, camera, true, true, thread_counts[k]);
+            Uint64 middle = SDL_GetPerformanceCounter();
+            backend.reset();
+            for (int i = 0; i < num_lists; i++)
+                command_lists[i]->replay(&backend);
+            Uint64 end = SDL_GetPerformanceCounter();
+            record_ms += (middle - start) * 1000.0 / SDL_GetPerformanceFrequency();
+            replay_ms += (end - middle) * 1000.0 / SDL_GetPerformanceFrequency();
+        }
+        int num_commands = 0, bytes = 0;
+        for (int i = 0; i < num_lists; i++){
+            num_commands += command_lists[i]->num_commands;
+            bytes += command_lists[i]->getBytes();
+        }
+        std::cout << " + Command lists (" << thread_counts[k] << " threads): " << rc_vector.size() << " calls, " << backend.num_commands[CMD_DRAW] << " draws, "
+            << num_commands << " commands (" << bytes / 1024 << " KB), " << backend.num_triangles << " triangles, record " << record_ms / repetitions
+            << " ms, null replay " << replay_ms / repetitions << " ms" << std::endl;
+        num_draws[k] = backend.num_commands[CMD_DRAW];
+        num_triangles[k] = backend.num_triangles;
+    }
+    // the parts of the threads start with a batch, so they draw the same (only the material blocks are repeated)
+    bool correct = num_draws[0] == num_draws[1] && num_triangles[0] == num_triangles[1];
+    if (!correct)
+        std::cout << " + Command lists: ERROR, the threads recorded different draws" << std::endl;
+    return correct;
+}
+
+void Renderer::renderOpaqueCalls(std::vector<RenderCall*>& rc_vector, Camera* camera){
+    // The pass that writes the depth is the one measured, both see the same fragments (same calls and order)
+    bool measure = !overdraw_query_pending;
+    int num_passes = 1;
+    if (measure){
+        if (!overdraw_query)
+            glGenQueries(1, &overdraw_query);
+        // without the pre-pass multipass shades the same fragments once per light
+        if (!depth_prepass_active && multiple_light_rendering == MULTIPASS)
+            num_passes = std::max(1, (int)Scene::instance->light_entities.size());
+        overdraw_query_scale = 1.0f / ((float)Application::instance->window_width * Application::instance->window_height * num_passes);
+        glBeginQuery(GL_SAMPLES_PASSED, overdraw_query);
+    }
+    
+    if (depth_prepass_active){
+        // Only the depth, with the shadow maps pipeline (the buffer is already clear)
+        renderToTexture(camera, NULL, rc_vector, false);
+        if (measure){
+            glEndQuery(GL_SAMPLES_PASSED);
+            overdraw_query_pending = true;
+        }
+        
+        // Every pixel is shaded once, by the surface that wrote its depth
+        GLState::depthFunc(GL_EQUAL);
+        GLState::depthMask(false);
+        depth_prepass_done = true;
+        renderCalls(rc_vector, camera, true, false);
+        depth_prepass_done = false;
+        GLState::depthFunc(GL_LESS);
+        GLState::depthMask(true);
+        return;
+    }
+    
+    renderCalls(rc_vector, camera, true, false);
+    if (measure){
+        glEndQuery(GL_SAMPLES_PASSED);
+        overdraw_query_pending = true;
+    }
+}
+
+void Renderer::updateDepthPrepass(){
+    // The result of the query arrives some frames later, reading it before would stall until the GPU finishes
+    if (overdraw_query_pending){
+        GLuint available = 0;
+        glGetQueryObjectuiv(overdraw_query, GL_QUERY_RESULT_AVAILABLE, &available);
+        if (available){
+            GLuint fragments = 0;
+            glGetQueryObjectuiv(overdraw_query, GL_QUERY_RESULT, &fragments);
+            overdraw = fragments * overdraw_query_scale;
+            overdraw_query_pending = false;
+        }
+    }
+    
+    // A bit of margin so it doesn't switch every frame when the overdraw is close to the threshold
+    if (auto_depth_prepass){
+        if (overdraw > overdraw_threshold)
+            use_depth_prepass = true;
+        else if (overdraw < overdraw_threshold * 0.9f)
+            use_depth_prepass = false;
+    }
+    depth_prepass_active = use_depth_prepass;
+}
+
+void Renderer::addDeferredPasses(GTR::Scene* scene, Camera* camera, std::vector<RenderCall*>& rc_vector, int shadows, int light_data, int window){
+    // albedo, normal, occlusion-metallic-roughness and emissive, plus the depth
+    sRGTextureDesc color = { Application::instance->window_width, Application::instance->window_height, GL_RGBA, GL_UNSIGNED_BYTE };
+    sRGTextureDesc depth = { color.width, color.height, GL_DEPTH_COMPONENT, GL_UNSIGNED_INT };
+    int gbuffer_textures[5];
+    gbuffer_textures[0] = render_graph->createTexture("albedo", color);
+    gbuffer_textures[1] = render_graph->createTexture("normal", color);
+    gbuffer_textures[2] = render_graph->createTexture("occlusion metallic roughness", color);
+    gbuffer_textures[3] = render_graph->createTexture("emissive", color);
+    gbuffer_textures[4] = render_graph->createTexture("depth", depth);
+    
+    // Geometry pass: every opaque mesh is rendered only once, to the gbuffers
+    int pass = render_graph->addPass("gbuffers", [this, scene, camera, &rc_vector](RenderGraph& graph) {
+        gbuffers = graph.current_fbo;
+        glClearColor(0, 0, 0, 0);
+        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+        renderOpaqueCalls(rc_vector, camera);
+        if (Shader::current)
+            Shader::current->disable();
+    });
+    for (int i = 0; i < 5; i++)
+        render_graph->write(pass, gbuffer_textures[i]);
+    render_graph->read(pass, light_data); // the frame block
+    
+    // Lighting pass: every light only shades the pixels inside its volume
+    // Blended materials can't be in the gbuffers, they use the forward path over the result
+    pass = render_graph->addPass("deferred lights", [this, scene, camera, &rc_vector](RenderGraph& graph) {
+        glClearColor(scene->background_color.x, scene->background_color.y, scene->background_color.z, 1.0);
+        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+        renderDeferredLights(scene, camera);
+        renderCalls(rc_vector, camera, false, true);
+    });
+    for (int i = 0; i < 5; i++)
+        render_graph->read(pass, gbuffer_textures[i]);
+    render_graph->read(pass, shadows);
+    render_graph->read(pass, light_data);
+    render_graph->write(pass, window);
+    
+    if (show_gbuffers){
+        pass = render_graph->addPass("view gbuffers", [this](RenderGraph& graph) { viewGBuffers(); });
+        for (int i = 0; i < 4; i++)
+            render_graph->read(pass, gbuffer_textures[i]);
+        render_graph->write(pass, window);
+    }
+}
+
+void Renderer::setGBuffersUniforms(Shader* shader, Camera* camera){
+    shader->setUniform("u_gb0_texture", gbuffers->color_textures[0], 0);
+    shader->setUniform("u_gb1_texture", gbuffers->color_textures[1], 1);
+    shader->setUniform("u_gb2_texture", gbuffers->color_textures[2], 2);
+    shader->setUniform("u_gb3_texture", gbuffers->color_textures[3], 3);
+    shader->setUniform("u_depth_texture", gbuffers->depth_texture, 4);
+    shader->setUniform("u_iRes", Vector2(1.0 / gbuffers->width, 1.0 / gbuffers->height));
+    Matrix44 inverse_viewprojection = camera->viewprojection_matrix;
+    inverse_viewprojection.inverse();
+    shader->setUniform("u_inverse_viewprojection", inverse_viewprojection);
+}
+
+void Renderer::renderDeferredLights(GTR::Scene* scene, Camera* camera){
+    Mesh* quad = Mesh::getQuad();
+    Mesh* sphere = Mesh::Get("data/meshes/sphere.obj", false);
+    std::vector<LightEntity*>& lights = scene->light_entities;
+    
+    // Ambient and emissive light, it also writes the depth of the gbuffers so the blended objects are tested against it
+    Shader* shader = Shader::Get("deferred_ambient");
+    if (!shader)
+        return;
+    shader->enable();
+    setGBuffersUniforms(shader, camera);
+    shader->setUniform("u_ambient_light", scene->ambient_light);
+    GLState::disable(GL_BLEND);
+    GLState::disable(GL_CULL_FACE);
+    GLState::enable(GL_DEPTH_TEST);
+    GLState::depthFunc(GL_ALWAYS);
+    GLState::depthMask(true);
+    quad->render(GL_TRIANGLES);
+    
+    // Every light adds its light to the pixels it reaches
+    GLState::depthMask(false);
+    GLState::enable(GL_BLEND);
+    GLState::blendFunc(GL_ONE, GL_ONE);
+    for (int i = 0; i < lights.size(); i++){
+        LightEntity* light = lights[i];
+        if (!light->visible)
+            continue;
+        
+        if (light->light_type == DIRECTIONAL){
+            // It reaches every pixel, a quad that covers the screen
+            shader = Shader::Get("deferred_light");
+            GLState::disable(GL_DEPTH_TEST);
+            GLState::disable(GL_CULL_FACE);
+        }
+        else{
+            // The back faces of the sphere of its range, only where the surface is in front of them.
+            // It works with the camera inside the sphere too
+            shader = Shader::Get("deferred_light_volume");
+            GLState::enable(GL_DEPTH_TEST);
+            GLState::depthFunc(GL_GEQUAL);
+            GLState::enable(GL_CULL_FACE);
+            glCullFace(GL_FRONT);
+        }
+        if (!shader)
+            continue;
+        shader->enable();
+        setGBuffersUniforms(shader, camera);
+        light->setUniforms(shader);
+        
+        if (light->light_type == DIRECTIONAL)
+            quad->render(GL_TRIANGLES);
+        else{
+            // a bit bigger, the triangles of the sphere are inside the real sphere
+            Vector3 light_position = light->model.getTranslation();
+            float radius = light->max_distance * 1.05f;
+            Matrix44 model;
+            model.setTranslation(light_position.x, light_position.y, light_position.z);
+            model.scale(radius, radius, radius);
+            shader->setUniform(u_viewprojection, camera->viewprojection_matrix);
+            shader->setUniform(u_model, model);
+            sphere->render(GL_TRIANGLES);
+        }
+    }
+    
+    //back to the default state
+    glCullFace(GL_BACK);
+    GLState::enable(GL_DEPTH_TEST);
+    GLState::depthFunc(GL_LESS);
+    GLState::depthMask(true);
+    GLState::disable(GL_BLEND);
+    if (Shader::current)
+        Shader::current->disable();
+}
+
+void Renderer::viewGBuffers(){
+    // The four textures of the gbuffers, one in every corner of the screen
+    int w = Application::instance->window_width;
+    int h = Application::instance->window_height;
+    GLState::disable(GL_DEPTH_TEST);
+    GLState::disable(GL_BLEND);
+    for (int i = 0; i < 4; i++){
+        glViewport((i % 2) * w / 2, (1 - i / 2) * h / 2, w / 2, h / 2);
+        gbuffers->color_textures[i]->toViewport();
+    }
+    glViewport(0, 0, w, h);
+    GLState::enable(GL_DEPTH_TEST);
+}
 
 void Renderer::collectRenderCall(GTR::Scene* scene, Camera* camera, std::vector<RenderCall*>* rc_vector){
-	//render entities
+	std::vector<Camera*> cameras(1, camera);
+	std::vector< std::vector<RenderCall*>* > rc_vectors(1, rc_vector);
+	collectRenderCall(scene, cameras, rc_vectors);
+}
+
+void Renderer::collectRenderCall(GTR::Scene* scene, std::vector<Camera*>& cameras, std::vector< std::vector<RenderCall*>* >& rc_vectors){
+	assert(cameras.size() == rc_vectors.size());
+
+	//split the entities in items
+	collect_items.clear();
 	for (int i = 0; i < scene->entities.size(); ++i)
 	{
 		BaseEntity* ent = scene->entities[i];
@@ -155,10 +1063,251 @@ void Renderer::collectRenderCall(GTR::Scene* scene, Camera* camera, std::vector<
 		if (ent->entity_type == PREFAB)
 		{
 			PrefabEntity* pent = (GTR::PrefabEntity*)ent;
-			if(pent->prefab)
-				collectPrefabInRenderCall(ent->model, pent->prefab, camera, rc_vector);
+			if (!pent->prefab)
+				continue;
+			//the levels of every instance and camera are kept apart, the entities that share a prefab don't change each other's
+			char* lods = NULL;
+			if (collect_lod_camera)
+			{
+				std::vector<char>& levels = pent->lods[collect_lod_camera];
+				levels.resize(pent->prefab->num_nodes, 0);
+				lods = &levels[0];
+			}
+			addCollectItems(ent->model, pent->prefab, lods);
+		}
+	}
+	int num_items = (int)collect_items.size();
+	bool multithreaded = use_multithreading && job_system->getNumThreads() > 1 && num_items > 1;
+
+	//the frustum set has a limit of cameras, if there are more they are collected in several traversals
+	for (int first = 0; first < cameras.size(); first += MAX_FRUSTUMS)
+	{
+		int num_views = std::min((int)cameras.size() - first, MAX_FRUSTUMS);
+		//the occlusion buffer is only for the first camera
+		if (first > 0)
+			collect_occlusion = NULL;
+		std::vector<RenderCall*>** views_rc = &rc_vectors[first];
+		collect_cameras.assign(cameras.begin() + first, cameras.begin() + first + num_views);
+		collect_frustums.clear();
+		for (int v = 0; v < num_views; ++v)
+			collect_frustums.addFrustum(collect_cameras[v]);
+
+		if (!multithreaded)
+		{
+			for (int i = 0; i < num_items; ++i)
+			{
+				sCollectItem& item = collect_items[i];
+				collectNodesInRenderCall(item.prefab_model, item.node, item.has_parent ? &item.parent_model : NULL, views_rc, render_call_arenas[0], item.recursive, item.lods);
+			}
+			continue;
 		}
+
+		//every item writes in its own vectors (one per view) and allocates from the arena of its thread, so no locks are needed
+		if (collect_results.size() < num_items * num_views)
+			collect_results.resize(num_items * num_views);
+		job_system->parallelFor(num_items, [&](int index, int thread) {
+			sCollectItem& item = collect_items[index];
+			std::vector<RenderCall*>* item_rc[MAX_FRUSTUMS];
+			for (int v = 0; v < num_views; ++v)
+			{
+				item_rc[v] = &collect_results[index * num_views + v];
+				item_rc[v]->clear();
+			}
+			collectNodesInRenderCall(item.prefab_model, item.node, item.has_parent ? &item.parent_model : NULL, item_rc, render_call_arenas[thread], item.recursive, item.lods);
+		}, 16);
+
+		//merging in item order gives the same list as the serial traversal
+		for (int v = 0; v < num_views; ++v)
+			for (int i = 0; i < num_items; ++i)
+			{
+				std::vector<RenderCall*>& result = collect_results[i * num_views + v];
+				views_rc[v]->insert(views_rc[v]->end(), result.begin(), result.end());
+			}
+	}
+}
+
+bool Renderer::testParallelCollect(GTR::Scene* scene, Camera* camera)
+{
+	//the camera and the shadow views of the lights, as in a frame
+	std::vector<GTR::LightEntity*> lights = scene->light_entities;
+	shadow_atlas->assignTiles(lights, camera);
+	std::vector<Camera*> cameras(1, camera);
+	for (int i = 0; i < lights.size(); ++i)
+	{
+		lights[i]->updateShadowViews(camera);
+		for (int j = 0; j < lights[i]->num_shadow_views; ++j)
+			if (lights[i]->shadow_views[j].tile_size)
+				cameras.push_back(lights[i]->shadow_views[j].camera);
+	}
+	int num_views = (int)cameras.size();
+
+	//a pool with several threads even on a single core, so the items are really split
+	JobSystem* frame_job_system = job_system;
+	JobSystem test_job_system(std::max(job_system->getNumThreads(), 4));
+	job_system = &test_job_system;
+	int num_arenas = (int)render_call_arenas.size();
+	while (render_call_arenas.size() < test_job_system.getNumThreads())
+		render_call_arenas.push_back(new RenderCallArena());
+
+	//the levels are chosen in the first collect, the second one keeps them
+	bool frame_multithreading = use_multithreading;
+	std::vector< std::vector<RenderCall*> > results[2];
+	collect_lod_camera = use_lods ? camera : NULL;
+	for (int k = 0; k < 2; ++k)
+	{
+		use_multithreading = k == 0;
+		results[k].resize(num_views);
+		std::vector< std::vector<RenderCall*>* > rc_vectors(num_views);
+		for (int v = 0; v < num_views; ++v)
+			rc_vectors[v] = &results[k][v];
+		collectRenderCall(scene, cameras, rc_vectors);
+	}
+	collect_lod_camera = NULL;
+	use_multithreading = frame_multithreading;
+
+	bool correct = true;
+	int num_calls = 0;
+	for (int v = 0; v < num_views; ++v)
+	{
+		std::vector<RenderCall*>& parallel = results[0][v];
+		std::vector<RenderCall*>& serial = results[1][v];
+		num_calls += (int)serial.size();
+		if (parallel.size() != serial.size())
+		{
+			correct = false;
+			continue;
+		}
+		for (int i = 0; i < serial.size(); ++i)
+		{
+			RenderCall* a = parallel[i];
+			RenderCall* b = serial[i];
+			if (a->mesh != b->mesh || a->material != b->material || a->distance_to_camera != b->distance_to_camera || memcmp(a->model.m, b->model.m, sizeof(a->model.m)) != 0)
+				correct = false;
+		}
+	}
+	std::cout << " + Parallel collect " << (correct ? "OK" : "FAILED (differs from the serial one)") << ": " << num_calls << " calls in " << num_views << " views with "
+		<< test_job_system.getNumThreads() << " threads" << std::endl;
+
+	//the calls of the test are in the arenas until the next frame resets them
+	for (int i = num_arenas; i < render_call_arenas.size(); ++i)
+		delete render_call_arenas[i];
+	render_call_arenas.resize(num_arenas);
+	job_system = frame_job_system;
+	return correct;
+}
+
+Mesh* Renderer::selectLOD(GTR::Node* node, const BoundingBox& world_bounding, char& lod)
+{
+	Mesh* mesh = node->mesh;
+	int num_levels = (int)mesh->lods.size() + 1;
+	//the errors are in the units of the mesh and the node can be scaled
+	float scale = world_bounding.halfsize.length() / std::max(mesh->box.halfsize.length(), 0.000001);
+
+	//a finer level when the error of the current one grows over the limit, a coarser one when its error is clearly under it
+	lod = std::min(std::max((int)lod, 0), num_levels - 1);
+	while (lod > 0 && collect_lod_camera->getProjectedScale(world_bounding.center, mesh->lods[lod - 1]->lod_error * scale) > lod_screen_error)
+		lod--;
+	while (lod + 1 < num_levels && collect_lod_camera->getProjectedScale(world_bounding.center, mesh->lods[lod]->lod_error * scale) < lod_screen_error * LOD_HYSTERESIS)
+		lod++;
+	return lod ? mesh->lods[lod - 1] : mesh;
+}
+
+void Renderer::renderOccluders(GTR::Scene* scene, Camera* camera)
+{
+	occlusion_buffer->clear(camera->viewprojection_matrix);
+	for (int i = 0; i < scene->entities.size(); ++i)
+	{
+		BaseEntity* ent = scene->entities[i];
+		if (!ent->visible || ent->entity_type != PREFAB)
+			continue;
+		PrefabEntity* pent = (GTR::PrefabEntity*)ent;
+		if (pent->is_occluder && pent->prefab)
+			renderOccluderNodes(&pent->prefab->root, ent->model, camera);
+	}
+	occlusion_buffer->buildHierarchy();
+}
+
+void Renderer::renderOccluderNodes(GTR::Node* node, const Matrix44& parent_model, Camera* camera)
+{
+	if (!node->visible)
+		return;
+
+	Matrix44 node_model = node->model * parent_model;
+	//only the opaque meshes in the frustum, the blended ones and the holes of the masked ones would hide what is seen through them
+	if (node->mesh && node->material && node->material->alpha_mode == GTR::eAlphaMode::NO_ALPHA)
+	{
+		BoundingBox world_bounding = transformBoundingBox(node_model, node->mesh->box);
+		if (camera->testBoxInFrustum(world_bounding.center, world_bounding.halfsize) != CLIP_OUTSIDE)
+			occlusion_buffer->rasterizeMesh(node->mesh, node_model);
 	}
+
+	for (int i = 0; i < node->children.size(); ++i)
+		renderOccluderNodes(node->children[i], node_model, camera);
+}
+
+void Renderer::addCollectItems(const Matrix44& model, GTR::Prefab* prefab, char* lods)
+{
+	Node* root = &prefab->root;
+	if (!root->visible)
+		return;
+
+	sCollectItem item;
+	item.prefab_model = model;
+	item.has_parent = false;
+	item.node = root;
+	item.recursive = true;
+	item.lods = lods;
+
+	//a prefab with a single subtree is not split
+	if (root->children.size() < 2)
+	{
+		collect_items.push_back(item);
+		return;
+	}
+
+	//the root alone and then every child, the same order as the recursion
+	item.recursive = false;
+	collect_items.push_back(item);
+	item.parent_model = root->model;
+	item.has_parent = true;
+	item.recursive = true;
+	for (int i = 0; i < root->children.size(); ++i)
+	{
+		item.node = root->children[i];
+		collect_items.push_back(item);
+	}
+}
+
+void Renderer::sortRenderCalls(std::vector<RenderCall*>* rc_vector, eRenderPass pass, Camera* camera){
+    // Shader used to render the calls of this pass
+    Shader* shader = Shader::Get(pass == SHADOW_PASS ? "mesh" : this->shader_name.c_str());
+    int shader_id = shader ? shader->m_Id : 0;
+
+    for (int i = 0; i < rc_vector->size(); i++)
+        (*rc_vector)[i]->computeSortKey(pass, shader_id, camera->far_plane);
+
+    RenderCall::sortRenderCalls(*rc_vector);
+}
+
+int Renderer::getInstanceBatch(std::vector<RenderCall*>& rc_vector, int start){
+    num_draw_calls++;
+    if (!use_instancing)
+        return 1;
+
+    // The calls are sorted by shader, material and mesh, so the ones that can be merged are together
+    RenderCall* first = rc_vector[start];
+    int end = start + 1;
+    while (end < rc_vector.size() && rc_vector[end]->mesh == first->mesh && rc_vector[end]->material == first->material)
+        end++;
+
+    int num_instances = end - start;
+    if (num_instances > 1){
+        instanced_models.resize(num_instances);
+        for (int i = 0; i < num_instances; i++)
+            instanced_models[i] = rc_vector[start + i]->model;
+        num_draw_calls_saved += num_instances - 1;
+    }
+    return num_instances;
 }
 
 void Renderer::clearRenderCall(std::vector<RenderCall*>* rc_vector){
@@ -171,18 +1320,22 @@ void Renderer::clearRenderCall(std::vector<RenderCall*>* rc_vector){
 void Renderer::collectPrefabInRenderCall(const Matrix44& model, GTR::Prefab* prefab, Camera* camera, std::vector<RenderCall*>* rc_vector)
 {
 	assert(prefab && "PREFAB IS NULL");
+	collect_cameras.assign(1, camera);
+	collect_frustums.clear();
+	collect_frustums.addFrustum(camera);
 	//assign the model to the root node
-	collectNodesInRenderCall(model, &prefab->root, camera, rc_vector);
+	collectNodesInRenderCall(model, &prefab->root, NULL, &rc_vector, render_call_arenas[0]);
 }
 
 //renders a node of the prefab and its children
-void Renderer::collectNodesInRenderCall(const Matrix44& prefab_model, GTR::Node* node, Camera* camera, std::vector<RenderCall*>* rc_vector)
+void Renderer::collectNodesInRenderCall(const Matrix44& prefab_model, GTR::Node* node, const Matrix44* parent_model, std::vector<RenderCall*>** rc_vectors, RenderCallArena* arena, bool recursive, char* lods)
 {
 	if (!node->visible)
 		return;
 
-	//compute global matrix
-	Matrix44 node_model = node->getGlobalMatrix(true) * prefab_model;
+	//compute global matrix (same as node->getGlobalMatrix but without writing in the node)
+	Matrix44 node_global = parent_model ? node->model * (*parent_model) : node->model;
+	Matrix44 node_model = node_global * prefab_model;
 
 	//does this node have a mesh? then we must render it
 	if (node->mesh && node->material)
@@ -190,51 +1343,80 @@ void Renderer::collectNodesInRenderCall(const Matrix44& prefab_model, GTR::Node*
 		//compute the bounding box of the object in world space (by using the mesh bounding box transformed to world space)
 		BoundingBox world_bounding = transformBoundingBox(node_model,node->mesh->box);
 		
-		//if bounding box is inside the camera frustum then the object is probably visible
-		if (camera->testBoxInFrustum(world_bounding.center, world_bounding.halfsize) )
+		//test the bounding box against the frustum of every camera at once, a bit for each camera that probably sees it
+		uint32_t visible = collect_frustums.testBox(world_bounding.center, world_bounding.halfsize);
+		//the first camera doesn't see it if it is behind the occluders
+		if ((visible & 1) && collect_occlusion && collect_occlusion->isOccluded(world_bounding.center, world_bounding.halfsize))
+			visible &= ~1u;
+		Mesh* mesh = node->mesh;
+		if (visible && lods && mesh->lods.size())
+			mesh = selectLOD(node, world_bounding, lods[node->index]);
+		for (int v = 0; visible; ++v, visible >>= 1)
 		{
+			if (!(visible & 1))
+				continue;
 			//render node mesh
 			//renderMeshWithMaterial( node_model, node->mesh, node->material, camera );
-			RenderCall* rc = new RenderCall(&node_model, node->mesh, node->material, 10.0f); // De momento forzamos un mismo número de distance to camera
-			rc_vector->push_back(rc);
+			//distance from the camera to the center of the world bounding box, used to sort the calls
+			float distance_to_camera = collect_cameras[v]->eye.distance(world_bounding.center);
+			RenderCall* rc = arena->allocate();
+			*rc = RenderCall(&node_model, mesh, node->material, distance_to_camera);
+			rc->world_bounding = world_bounding;
+			rc_vectors[v]->push_back(rc);
 			//node->mesh->renderBounding(node_model, true);
 		}
 	}
 
 	//iterate recursively with children
+	if (!recursive)
+		return;
 	for (int i = 0; i < node->children.size(); ++i)
-		collectNodesInRenderCall(prefab_model, node->children[i], camera, rc_vector);
+		collectNodesInRenderCall(prefab_model, node->children[i], &node_global, rc_vectors, arena, true, lods);
 }
 
-void Renderer::renderToTexture(Camera* camera, FBO* fbo, std::vector<RenderCall*> rc_vector){
-    fbo->bind();
+void Renderer::renderToTexture(Camera* camera, FBO* fbo, std::vector<RenderCall*> rc_vector, bool clear){
+    //if fbo is NULL the caller has already bound the target
+    if (fbo)
+        fbo->bind();
    
     //you can disable writing to the color buffer to speed up the rendering as we do not need it
-    glColorMask(false,false,false,false);
+    GLState::colorMask(false,false,false,false);
 
     //clear the depth buffer only (don't care of color)
-    glClear( GL_DEPTH_BUFFER_BIT );
+    if (clear)
+        glClear( GL_DEPTH_BUFFER_BIT );
     checkGLErrors();
 
     
-    for (int i = 0; i<rc_vector.size(); i++){
-        renderMesh(rc_vector[i]->model, rc_vector[i]->mesh, camera, rc_vector[i]->material->alpha_mode);
+    for (int i = 0; i<rc_vector.size(); ){
+        RenderCall* rc = rc_vector[i];
+        int num_instances = getInstanceBatch(rc_vector, i);
+        if (num_instances > 1)
+            renderMesh(rc->model, rc->mesh, camera, rc->material->alpha_mode, &instanced_models[0], num_instances, rc->material);
+        else
+            renderMesh(rc->model, rc->mesh, camera, rc->material->alpha_mode, NULL, 0, rc->material);
+        i += num_instances;
     }
-    fbo->unbind();
+    if (Shader::current)
+        Shader::current->disable();
+    if (fbo)
+        fbo->unbind();
     
     //allow to render back to the color buffer
-    glColorMask(true,true,true,true);
+    GLState::colorMask(true,true,true,true);
 
 }
 
-void Renderer::renderLightDepthBuffer(LightEntity* light, std::vector<RenderCall*> rc_vector){
-    renderToTexture(light->camera, light->fbo, rc_vector);
+void Renderer::renderLightDepthBuffer(sShadowView& view){
+    //render only inside the tile of the view (the clear is limited by the scissor), the atlas is already bound
+    shadow_atlas->setTile(view);
+    renderToTexture(view.camera, NULL, view.rc);
 }
 
 void Renderer::viewDepthBuffer(LightEntity* light){
     //remember to disable ztest if rendering quads!
-    glDisable(GL_DEPTH_TEST);
-    FBO* fbo = light->fbo;
+    GLState::disable(GL_DEPTH_TEST);
+    FBO* fbo = shadow_atlas->fbo;
     //to use a special shader
     Shader* zshader = Shader::Get("depth");
     zshader->enable();
@@ -248,12 +1430,141 @@ void Renderer::viewDepthBuffer(LightEntity* light){
     
     zshader->disable();
     
-    glEnable(GL_DEPTH_TEST);
+    GLState::enable(GL_DEPTH_TEST);
+}
+
+// Debug view of the overdraw: every fragment that passes the depth test adds a bit of light,
+// so bright areas are the ones shaded many times. It also measures with occlusion queries
+// how many fragments the front to back order saves compared to drawing the same calls back to front
+void Renderer::renderDepthComplexity(std::vector<RenderCall*>& rc_vector, Camera* camera){
+    Shader* shader = Shader::Get("flat");
+    if (!shader)
+        return;
+
+    if (!depth_complexity_queries[0])
+        glGenQueries(2, depth_complexity_queries);
+
+    shader->enable();
+    shader->setUniform(u_viewprojection, camera->viewprojection_matrix);
+    shader->setUniform(u_color, Vector4(0.1f, 0.1f, 0.1f, 1.0f));
+
+    GLState::enable(GL_BLEND);
+    GLState::blendFunc(GL_ONE, GL_ONE);
+    GLState::enable(GL_CULL_FACE);
+
+    //sorted order (front to back), this is what the real pass shades
+    glBeginQuery(GL_SAMPLES_PASSED, depth_complexity_queries[0]);
+    for (int i = 0; i < rc_vector.size(); i++){
+        if (rc_vector[i]->material->alpha_mode == GTR::eAlphaMode::BLEND)
+            continue;
+        shader->setUniform(u_model, rc_vector[i]->model);
+        rc_vector[i]->mesh->render(GL_TRIANGLES);
+    }
+    glEndQuery(GL_SAMPLES_PASSED);
+
+    //same calls in reverse order without touching the image, to know the fragments we would shade without sorting
+    glClear(GL_DEPTH_BUFFER_BIT);
+    GLState::colorMask(false, false, false, false);
+    glBeginQuery(GL_SAMPLES_PASSED, depth_complexity_queries[1]);
+    for (int i = (int)rc_vector.size() - 1; i >= 0; i--){
+        if (rc_vector[i]->material->alpha_mode == GTR::eAlphaMode::BLEND)
+            continue;
+        shader->setUniform(u_model, rc_vector[i]->model);
+        rc_vector[i]->mesh->render(GL_TRIANGLES);
+    }
+    glEndQuery(GL_SAMPLES_PASSED);
+    GLState::colorMask(true, true, true, true);
+
+    shader->disable();
+    GLState::disable(GL_BLEND);
+
+    //this stalls until the GPU finishes, but it is only a debug view
+    GLuint sorted_fragments = 0;
+    GLuint unsorted_fragments = 0;
+    glGetQueryObjectuiv(depth_complexity_queries[0], GL_QUERY_RESULT, &sorted_fragments);
+    glGetQueryObjectuiv(depth_complexity_queries[1], GL_QUERY_RESULT, &unsorted_fragments);
+    fragments_shaded = sorted_fragments;
+    fragments_saved = (long)unsorted_fragments - (long)sorted_fragments;
 }
 
-void Renderer::renderMesh(const Matrix44 model, Mesh* mesh, Camera* camera, eAlphaMode material_alpha_mode){
+void Renderer::renderInMenu(){
+#ifndef SKIP_IMGUI
+    int used = 0, peak = 0, capacity = 0;
+    for (int i = 0; i < render_call_arenas.size(); i++){
+        used += render_call_arenas[i]->last_frame_used;
+        peak += render_call_arenas[i]->peak_used;
+        capacity += render_call_arenas[i]->getCapacity();
+    }
+    ImGui::Text("Render calls: %d (peak %d, %d KB reserved)", used, peak, (int)(capacity * sizeof(RenderCall) / 1024));
+    ImGui::Checkbox("Multithreaded collect", &use_multithreading);
+    ImGui::Checkbox("Occlusion culling", &use_occlusion_culling);
+    if (use_occlusion_culling)
+        ImGui::Text("Occlusion: %.2f ms, %d triangles, %d of %d nodes culled", occlusion_time, occlusion_buffer->num_triangles, (int)occlusion_buffer->num_occluded, (int)occlusion_buffer->num_tests);
+    if (ImGui::Button("Benchmark occlusion"))
+        benchmarkOcclusionBuffer();
+    ImGui::Checkbox("LODs", &use_lods);
+    if (use_lods){
+        ImGui::SliderFloat("LOD error", &lod_screen_error, 0.1f, 10.0f);
+        ImGui::Text("Calls with a LOD: %d", num_lod_calls);
+    }
+    if (ImGui::Button("Test LODs"))
+        testMeshSimplification();
+    ImGui::Checkbox("Shadow cache", &use_shadow_cache);
+    ImGui::Text("Shadow maps: %d rendered, %d cached, %d empty", num_shadows_rendered, num_shadows_cached, num_shadows_empty);
+    ImGui::Text("Shadow atlas: %dx%d, %d tiles, %d%% used", shadow_atlas->size, shadow_atlas->size, shadow_atlas->num_tiles, (int)(100.0 * shadow_atlas->used_pixels / ((double)shadow_atlas->size * shadow_atlas->size)));
+    ImGui::Text("Collect: %.2f ms (%d threads)", collect_time, job_system->getNumThreads());
+    ImGui::SliderInt("Lights per object", &max_lights_per_object, 1, MAX_LIGHTS_PER_OBJECT);
+    ImGui::Text("Lights uploaded: %d", num_object_lights);
+    if (multiple_light_rendering == CLUSTERED)
+        ImGui::Text("Clusters: %.2f ms, %d lights, %d indices, %d full", cluster_time, (int)light_clusters->lights.size(), (int)light_clusters->indices.size(), light_clusters->num_overflows);
+    if (ImGui::Button("Benchmark clusters"))
+        benchmarkLightClusters(job_system);
+    if (ImGui::Button("Benchmark uniforms") && Shader::Get("light"))
+        benchmarkUniformHandles(Shader::Get("light"));
+    if (multiple_light_rendering == DEFERRED)
+        ImGui::Checkbox("Show gbuffers", &show_gbuffers);
+    if (ImGui::TreeNode("Render graph")){
+        render_graph->renderInMenu();
+        if (ImGui::Button("Test render graph"))
+            testRenderGraph();
+        ImGui::TreePop();
+    }
+    if (uniform_buffers_supported){
+        ImGui::Checkbox("Uniform buffers", &use_uniform_buffers);
+        ImGui::Text("Material uploads: %d", num_material_uploads);
+    }
+    else
+        ImGui::Text("Uniform buffers not supported");
+    ImGui::Checkbox("Command lists", &use_command_lists);
+    if (use_command_lists && canRecordCalls())
+        ImGui::Text("Commands: %d, record %.2f ms, replay %.2f ms", num_commands, record_time, replay_time);
+    if (ImGui::Button("Benchmark command lists"))
+        benchmark_command_lists = true;
+    if (vertex_arrays_supported)
+        ImGui::Checkbox("Vertex arrays", &Mesh::use_vertex_arrays);
+    if (instancing_supported)
+        ImGui::Checkbox("Instancing", &use_instancing);
+    else
+        ImGui::Text("Instancing not supported");
+    ImGui::Text("Draw calls: %d (%d saved by instancing)", num_draw_calls, num_draw_calls_saved);
+    ImGui::Text("GL state changes: %d (%d skipped)", GLState::last_frame_changes, GLState::last_frame_skipped);
+    StreamBuffer* stream = StreamBuffer::getFrameStream();
+    ImGui::Text("Stream buffer: %d KB of %d KB, %d waits (%s)", stream->last_frame_used / 1024, stream->region_size / 1024, stream->num_waits, stream->persistent ? "persistent" : "mapped per write");
+    ImGui::Checkbox("Depth pre-pass", &use_depth_prepass);
+    ImGui::SameLine();
+    ImGui::Checkbox("Auto", &auto_depth_prepass);
+    if (auto_depth_prepass)
+        ImGui::SliderFloat("Overdraw threshold", &overdraw_threshold, 1.0f, 4.0f);
+    ImGui::Text("Overdraw: %.2f fragments per pixel", overdraw);
+    ImGui::Checkbox("Depth complexity", &show_depth_complexity);
+    if (show_depth_complexity)
+        ImGui::Text("Fragments shaded: %ld, saved by sorting: %ld", fragments_shaded, fragments_saved);
+#endif
+}
+
+void Renderer::renderMesh(const Matrix44 model, Mesh* mesh, Camera* camera, eAlphaMode material_alpha_mode, const Matrix44* instanced_models, int num_instances, GTR::Material* material){
     
-    glDisable(GL_BLEND);
+    GLState::disable(GL_BLEND);
     //in case there is nothing to do
     if (!mesh || !mesh->getNumVertices())
         return;
@@ -267,8 +1578,13 @@ void Renderer::renderMesh(const Matrix44 model, Mesh* mesh, Camera* camera, eAlp
         return;
     }
 
-    //chose a shader
-    shader = Shader::Get("mesh");
+    //chose a shader (the instanced version reads the model from the instance attributes)
+    //the masked materials need the alpha of their texture, the rest only the position
+    bool masked = material && material_alpha_mode == GTR::eAlphaMode::MASK;
+    if (masked)
+        shader = Shader::Get(num_instances ? "mesh_masked_instanced" : "mesh_masked");
+    else
+        shader = Shader::Get(num_instances ? "mesh_instanced" : "mesh");
 
     assert(glGetError() == GL_NO_ERROR);
 
@@ -278,19 +1594,32 @@ void Renderer::renderMesh(const Matrix44 model, Mesh* mesh, Camera* camera, eAlp
     shader->enable();
     
     //upload uniforms
-    shader->setUniform("u_viewprojection", camera->viewprojection_matrix);
-    shader->setUniform("u_camera_position", camera->eye);
-    shader->setUniform("u_model", model );
+    shader->setUniform(u_viewprojection, camera->viewprojection_matrix);
+    shader->setUniform(u_camera_position, camera->eye);
+    if (!num_instances)
+        shader->setUniform(u_model, model );
     
-    mesh->render(GL_TRIANGLES);
+    //the same faces as the lighting pass, or the pre-pass would leave holes
+    if (material){
+        if (material->two_sided)
+            GLState::disable(GL_CULL_FACE);
+        else
+            GLState::enable(GL_CULL_FACE);
+    }
+    if (masked){
+        Texture* color_texture = material->color_texture.texture ? material->color_texture.texture : Texture::getWhiteTexture();
+        shader->setUniform(u_color, material->color);
+        shader->setUniform(u_color_texture, color_texture, 0);
+        shader->setUniform(u_alpha_cutoff, material->alpha_cutoff);
+    }
     
-    //disable shader
-    shader->disable();
+    drawMesh(mesh, instanced_models, num_instances);
     
+    //the shader stays enabled, the next call probably uses it too (renderToTexture disables it at the end)
 }
 
 //renders a mesh given its transform and material
-void Renderer::renderMeshWithMaterial(const Matrix44 model, Mesh* mesh, GTR::Material* material, Camera* camera)
+void Renderer::renderMeshWithMaterial(const Matrix44 model, Mesh* mesh, GTR::Material* material, Camera* camera, const Matrix44* instanced_models, int num_instances, const BoundingBox* world_bounding)
 {
 	//in case there is nothing to do
 	if (!mesh || !mesh->getNumVertices() || !material )
@@ -301,7 +1630,7 @@ void Renderer::renderMeshWithMaterial(const Matrix44 model, Mesh* mesh, GTR::Mat
 	Shader* shader = NULL;
 	GTR::Scene* scene = GTR::Scene::instance;
     std::vector<Texture*> texture = std::vector<Texture*>(5);
-    std::vector<GTR::LightEntity*> light_entities = scene->light_entities;
+    std::vector<GTR::LightEntity*>& light_entities = scene->light_entities;
     bool has_emissive_light = true;    
 
     // Define Textures
@@ -320,21 +1649,33 @@ void Renderer::renderMeshWithMaterial(const Matrix44 model, Mesh* mesh, GTR::Mat
 	//select the blending
 	if (material->alpha_mode == GTR::eAlphaMode::BLEND)
 	{
-		glEnable(GL_BLEND);
-		glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+		GLState::enable(GL_BLEND);
+		GLState::blendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
 	}
 	else
-		glDisable(GL_BLEND);
+		GLState::disable(GL_BLEND);
 
 	//select if render both sides of the triangles
 	if(material->two_sided)
-		glDisable(GL_CULL_FACE);
+		GLState::disable(GL_CULL_FACE);
 	else
-		glEnable(GL_CULL_FACE);
+		GLState::enable(GL_CULL_FACE);
     assert(glGetError() == GL_NO_ERROR);
 
-	//chose a shader
-	shader = Shader::Get(this->shader_name.c_str());
+	//chose a shader (the instanced version reads the model from the instance attributes)
+	//in deferred the opaque materials are written to the gbuffers
+	bool to_gbuffers = multiple_light_rendering == DEFERRED && material->alpha_mode != GTR::eAlphaMode::BLEND;
+	std::string name = to_gbuffers ? "gbuffers" : this->shader_name;
+	//the shaders have a version that reads the frame and the material (and the light shader the light) from the uniform buffers,
+	//if it isn't in the atlas the normal one is used
+	bool uniform_blocks = false;
+	if (use_uniform_buffers){
+		shader = Shader::Get((name + (num_instances ? "_ubo_instanced" : "_ubo")).c_str());
+		uniform_blocks = shader != NULL;
+	}
+	if (!shader)
+		shader = Shader::Get((num_instances ? name + "_instanced" : name).c_str());
+	bool light_blocks = uniform_blocks && name == "light";
 
     assert(glGetError() == GL_NO_ERROR);
 
@@ -343,45 +1684,77 @@ void Renderer::renderMeshWithMaterial(const Matrix44 model, Mesh* mesh, GTR::Mat
 		return;
 	shader->enable();
 
-	//upload uniforms
-	shader->setUniform("u_viewprojection", camera->viewprojection_matrix);
-	shader->setUniform("u_camera_position", camera->eye);
-	shader->setUniform("u_model", model );
+	if (uniform_blocks){
+		//the frame and the lights are in the buffers already, the material only when it changes (the calls are sorted by material)
+		if (!num_instances)
+			shader->setUniform(u_model, model );
+		if (material != current_material){
+			sMaterialBlock block;
+			fillMaterialBlock(block, material);
+			//every material gets its own range of the stream, a buffer read by the previous draws is never overwritten
+			StreamBuffer* stream = StreamBuffer::getFrameStream();
+			int offset = stream->write(&block, sizeof(block), UniformBuffer::getOffsetAlignment());
+			stream->bindUniformRange(MATERIAL_BLOCK_BINDING, offset, sizeof(block));
+			current_material = material;
+			num_material_uploads++;
+		}
+		//the slots of the samplers were set once
+		for (int t = 0; t < texture.size(); t++)
+			GLState::bindTexture(t, texture[t]->texture_type, texture[t]->texture_id);
+		GLState::bindTexture(8, GL_TEXTURE_2D, shadow_atlas->getTexture()->texture_id);
+	}
+	else{
+		//upload uniforms
+		shader->setUniform(u_viewprojection, camera->viewprojection_matrix);
+		shader->setUniform(u_camera_position, camera->eye);
+		if (!num_instances)
+			shader->setUniform(u_model, model );
 
-	shader->setUniform("u_color", material->color);
-    shader->setUniform("u_has_emissive_light", has_emissive_light);
-    shader->setUniform("u_color_texture", texture[0], 0);
-    shader->setUniform("u_emissive_texture", texture[1], 1);
-    shader->setUniform("u_emissive_factor", material->emissive_factor);
-    shader->setUniform("u_metallic_roughness_texture", texture[2], 2);
-    shader->setUniform("u_normal_texture", texture[3], 3);
-    shader->setUniform("u_occlusion_texture", texture[4], 4);
-     
+		shader->setUniform(u_color, material->color);
+		shader->setUniform(u_has_emissive_light, has_emissive_light);
+		shader->setUniform(u_color_texture, texture[0], 0);
+		shader->setUniform(u_emissive_texture, texture[1], 1);
+		shader->setUniform(u_emissive_factor, material->emissive_factor);
+		shader->setUniform(u_metallic_roughness_texture, texture[2], 2);
+		shader->setUniform(u_normal_texture, texture[3], 3);
+		shader->setUniform(u_occlusion_texture, texture[4], 4);
 
-	//this is used to say which is the alpha threshold to what we should not paint a pixel on the screen (to cut polygons according to texture alpha)
-	shader->setUniform("u_alpha_cutoff", material->alpha_mode == GTR::eAlphaMode::MASK ? material->alpha_cutoff : 0);
-    
-    shader->setUniform("u_ambient_light", scene->ambient_light);
+		//this is used to say which is the alpha threshold to what we should not paint a pixel on the screen (to cut polygons according to texture alpha)
+		shader->setUniform(u_alpha_cutoff, material->alpha_mode == GTR::eAlphaMode::MASK ? material->alpha_cutoff : 0);
+
+		shader->setUniform(u_ambient_light, scene->ambient_light);
+	}
     
 	// Single pass
 	if(multiple_light_rendering == SINGLEPASS) {
-        singlepassRendering(light_entities, shader, mesh);
+        // Only the lights that reach the object, the shader has room for a few of them
+        selectObjectLights(world_bounding, light_entities);
+        singlepassRendering(object_lights, shader, mesh, instanced_models, num_instances);
 	}
-    else if (multiple_light_rendering == MULTIPASS){
-        multipassRendering(light_entities, shader, mesh, material);
+    else if (multiple_light_rendering == MULTIPASS || (multiple_light_rendering == DEFERRED && !to_gbuffers)){
+        multipassRendering(light_entities, shader, mesh, material, instanced_models, num_instances, light_blocks);
+    }
+    else if (to_gbuffers){
+        // the lights are added later in screen space
+        drawMesh(mesh, instanced_models, num_instances);
+    }
+    else if (multiple_light_rendering == CLUSTERED){
+        // Every pixel reads the lights of its cluster
+        light_clusters->setUniforms(shader);
+        drawMesh(mesh, instanced_models, num_instances);
     }
     else {
         // Use only the first light
-        light_entities[0]->setUniforms(shader);
+        if (light_blocks)
+            lights_buffer->bindRange(0, sizeof(sLightBlock));
+        else
+            light_entities[0]->setUniforms(shader);
 		//do the draw call that renders the mesh into the screen
-		mesh->render(GL_TRIANGLES);
+		drawMesh(mesh, instanced_models, num_instances);
     }
 
-	//disable shader
-	shader->disable();
-
-	//set the render state as it was before to avoid problems with future renders
-	glDisable(GL_BLEND);
+	//the shader and the blending stay as they are, the next call only changes what is different
+	//(renderScene restores the default state after the last call)
 }
 
 
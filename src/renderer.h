@@ -2,6 +2,15 @@
 #include "prefab.h"
 #include "fbo.h"
 #include "renderCall.h"
+#include "jobsystem.h"
+#include "culling.h"
+#include "occlusion.h"
+#include "shadowatlas.h"
+#include "clusters.h"
+#include "uniformbuffer.h"
+#include "streambuffer.h"
+#include "rendergraph.h"
+#include "commandlist.h"
 
 //forward declarations
 class Camera;
@@ -11,10 +20,51 @@ namespace GTR {
 	class Prefab;
 	class Material;
 	
+	// lights that singlepass can evaluate for an object (MAX_LIGHTS in singlepass.fs)
+	#define MAX_LIGHTS_PER_OBJECT 8
+	
 	enum eMultipleLightRendering{
 		SINGLEPASS = 0,
 		MULTIPASS = 1,
-        NOMULTIPLELIGHT = 2
+        NOMULTIPLELIGHT = 2,
+        CLUSTERED = 3,
+        DEFERRED = 4
+	};
+	
+	// binding points of the uniform blocks of the _ubo shaders
+	#define FRAME_BLOCK_BINDING 0
+	#define LIGHT_BLOCK_BINDING 1
+	#define MATERIAL_BLOCK_BINDING 2
+	
+	// The FrameData uniform block (std140 layout)
+	struct sFrameBlock {
+		Matrix44 viewprojection;
+		Vector3 camera_position;
+		float padding0;
+		Vector3 ambient_light;
+		float padding1;
+	};
+	
+	// The MaterialData uniform block (std140 layout)
+	struct sMaterialBlock {
+		Vector4 color;
+		Vector3 emissive_factor;
+		float alpha_cutoff;
+		int has_emissive_light;
+		float padding[3];
+	};
+	
+	// a coarser LOD is only chosen when its error is clearly under the limit, so it doesn't change every frame
+	#define LOD_HYSTERESIS 0.75f
+	
+	// A part of the scene that can be collected on its own: a node with its children (or only the node)
+	struct sCollectItem {
+		Matrix44 prefab_model;
+		Matrix44 parent_model; // global matrix of the parent node
+		bool has_parent;
+		Node* node;
+		bool recursive;
+		char* lods; // levels of the nodes for this entity and the LOD camera, NULL if there is no LOD camera
 	};
 	
 	// This class is in charge of rendering anything in our system.
@@ -22,13 +72,110 @@ namespace GTR {
 	class Renderer
 	{
 		std::vector<RenderCall*> render_call_vector;
+		std::vector<RenderCallArena*> render_call_arenas; // storage of every render call of the frame, one per thread
+		JobSystem* job_system;
+		std::vector<sCollectItem> collect_items;
+		std::vector< std::vector<RenderCall*> > collect_results; // render calls of every item and camera, merged in order
+		FrustumSet collect_frustums; // frustums of the cameras being collected
+		std::vector<Camera*> collect_cameras;
+		OcclusionBuffer* collect_occlusion; // tests the nodes for the first camera of the traversal (the main one), NULL if not used
+		Camera* collect_lod_camera; // the levels of the meshes are chosen by their size in this camera (the main one), NULL to use the full meshes
 		eMultipleLightRendering multiple_light_rendering;
 		std::string shader_name;
+		std::vector<LightEntity*> object_lights; // lights of the object being rendered in singlepass
+		std::vector<float> object_light_scores;
+		std::vector<char> light_blocks_data; // a sLightBlock every light_block_stride bytes
+		std::vector<CommandList*> command_lists; // one per thread recording
+		std::vector< std::vector<Matrix44> > record_models; // models of the batch being recorded by every thread
+		GLCommandBackend* gl_backend;
+		GLuint overdraw_query; // fragments of the pass that writes the depth of the opaque calls
+		bool overdraw_query_pending; // its result is not read yet
+		float overdraw_query_scale; // 1 / (pixels * passes) of that pass
 
 	public:
         // The light number that is selected to control with light controls
         int selected_light;
         
+        // Merge consecutive calls with the same mesh and material in one instanced draw
+        bool use_instancing;
+        bool instancing_supported;
+        bool vertex_arrays_supported; // the meshes keep their attributes in vertex array objects (Mesh::use_vertex_arrays)
+        int num_draw_calls; // draws issued in the last frame
+        int num_draw_calls_saved; // calls merged by instancing in the last frame
+        
+        // Singlepass only uploads the lights that reach every object, the most important first
+        int max_lights_per_object; // up to MAX_LIGHTS_PER_OBJECT
+        int num_object_lights; // lights uploaded in the last frame (adding all the draws)
+        
+        // Lists of lights per cluster of the view frustum for the clustered mode
+        LightClusters* light_clusters;
+        double cluster_time; // ms assigning the lights to the clusters in the last frame
+        
+        // Passes of the frame with the resources they use, its pool has the transient textures
+        RenderGraph* render_graph;
+        
+        // Surface of the opaque objects for the deferred mode (albedo, normal, occlusion-metallic-roughness, emissive and depth)
+        // (the framebuffer of the gbuffers pass of the render graph)
+        FBO* gbuffers;
+        bool show_gbuffers;
+        std::vector<Matrix44> instanced_models; // models of the current batch, kept to avoid allocations
+        
+        // The _ubo shaders read the frame and the material (and the light one the lights) from uniform buffers, per draw only the model is uploaded
+        bool uniform_buffers_supported;
+        bool use_uniform_buffers;
+        UniformBuffer* frame_buffer;
+        UniformBuffer* lights_buffer; // a block per light of the scene, a pass binds the range of its light
+        int light_block_stride; // size of a light block rounded up to the offset alignment
+        GTR::Material* current_material; // the one bound to MATERIAL_BLOCK_BINDING (a range of the frame stream)
+        int num_material_uploads; // in the last frame
+        
+        // The calls of a pass are recorded in command lists by several threads and replayed in order by this one
+        // (with the light shader, singlepass and clustered select the lights of every draw while rendering)
+        bool use_command_lists;
+        int num_commands; // replayed in the last frame
+        double record_time; // ms in the last frame
+        double replay_time;
+        bool benchmark_command_lists; // the next frame measures recording its calls and replaying them with the null backend
+        bool command_lists_correct; // the last benchmark ran and got the same draws with one and with all the threads
+        
+        // Shadow maps of all the lights, in tiles of a single depth texture
+        ShadowAtlas* shadow_atlas;
+        
+        // Only render the shadow map of a light when the light or its casters changed
+        bool use_shadow_cache;
+        int num_shadows_rendered; // in the last frame
+        int num_shadows_cached;
+        int num_shadows_empty; // views without casters, skipped
+        
+        // Occlusion culling of the main camera: the occluders are rasterized in the CPU and the nodes behind them are not collected
+        bool use_occlusion_culling;
+        OcclusionBuffer* occlusion_buffer;
+        double occlusion_time; // ms rasterizing the occluders in the last frame
+        
+        // Simplified meshes far from the camera, the coarsest level with an error under lod_screen_error
+        bool use_lods;
+        float lod_screen_error; // in the units of Camera::getProjectedScale
+        int num_lod_calls; // calls of the camera drawing a LOD in the last frame
+        
+        // Collect the render calls in several threads
+        bool use_multithreading;
+        float collect_time; // ms spent collecting the render calls in the last frame
+        
+        // Overdraw debug view and its stats (fragments that passed the depth test)
+        bool show_depth_complexity;
+        long fragments_shaded;
+        long fragments_saved; // compared to drawing the opaque calls back to front
+        GLuint depth_complexity_queries[2];
+        
+        // Depth pre-pass of the main camera: the opaque calls write the depth with the mesh shader and then
+        // the lighting pass shades only the visible pixels (GL_EQUAL without depth writes)
+        bool use_depth_prepass;
+        bool auto_depth_prepass; // use it while the measured overdraw is above overdraw_threshold
+        float overdraw_threshold;
+        float overdraw; // fragments that passed the depth test per pixel in the opaque pass (or in the pre-pass)
+        bool depth_prepass_active; // in this frame
+        bool depth_prepass_done; // the depth of the opaque calls is already in the depth buffer
+        
         
         Renderer(GTR::eMultipleLightRendering multiple_light_rendering, std::string shader_name);
         
@@ -36,16 +183,68 @@ namespace GTR {
 		void changeMultiLightRendering();
         
         // Singlepass rendering function
-        void singlepassRendering(std::vector<LightEntity*> light_entities, Shader* shader, Mesh* mesh);
+        void singlepassRendering(std::vector<LightEntity*>& light_entities, Shader* shader, Mesh* mesh, const Matrix44* instanced_models = NULL, int num_instances = 0);
+        
+        // Fills object_lights with the lights that reach the box (all of them if it is NULL), sorted by importance
+        void selectObjectLights(const BoundingBox* world_bounding, std::vector<LightEntity*>& lights);
         
         // Multipass rendering function
-		void multipassRendering(std::vector<LightEntity*> lights, Shader* shader, Mesh* mesh, Material* material);
+		// (with uniform_blocks the light i of the scene is read from its range of lights_buffer)
+		void multipassRendering(std::vector<LightEntity*> lights, Shader* shader, Mesh* mesh, Material* material, const Matrix44* instanced_models = NULL, int num_instances = 0, bool uniform_blocks = false);
+        
+        // Renders the shadow maps of the views that changed to their tiles of the atlas
+        void renderShadowMaps(std::vector<LightEntity*>& lights);
+        
+        // Uploads the frame and the lights to the uniform buffers and binds the blocks of the _ubo shaders
+        void uploadUniformBuffers(GTR::Scene* scene, Camera* camera);
         
         //renders several elements of the scene
         void renderScene(GTR::Scene* scene, Camera* camera);
+        
+        // Renders the calls in order, only the opaque or the blended ones if asked
+        void renderCalls(std::vector<RenderCall*>& rc_vector, Camera* camera, bool opaque, bool blended);
+        
+        // The mode sends everything the draws need in the commands
+        bool canRecordCalls();
+        
+        // Records the calls of renderCalls in command_lists, a part for every thread, returns the lists used
+        int recordCommandLists(std::vector<RenderCall*>& rc_vector, Camera* camera, bool opaque, bool blended, int num_threads);
+        void recordCalls(CommandList* list, std::vector<RenderCall*>& rc_vector, int start, int end, Camera* camera, bool opaque, bool blended, std::vector<Matrix44>& models);
+        
+        // The commands of renderMeshWithMaterial (current is the material block already in the list)
+        void recordMeshWithMaterial(CommandList* list, const Matrix44& model, Mesh* mesh, GTR::Material* material, Camera* camera, const Matrix44* instanced_models, int num_instances, GTR::Material** current);
+        
+        // Records the calls with one and with all the threads and replays them with the null backend, prints the times
+        // (false if the mode can't record them or the threads get different draws)
+        bool benchmarkCommandLists(std::vector<RenderCall*>& rc_vector, Camera* camera);
+        
+        // Renders the opaque calls (after the depth pre-pass if it is active) and measures their overdraw
+        void renderOpaqueCalls(std::vector<RenderCall*>& rc_vector, Camera* camera);
+        
+        // Reads the overdraw of a previous frame (only when the GPU has it) and decides if the pre-pass is used
+        void updateDepthPrepass();
+        
+        // Deferred shading: the opaque objects write the gbuffers once and the lights are added in screen space
+        // (adds its passes to the render graph, the lights read the shadows and the light data and write the window)
+        void addDeferredPasses(GTR::Scene* scene, Camera* camera, std::vector<RenderCall*>& rc_vector, int shadows, int light_data, int window);
+        void renderDeferredLights(GTR::Scene* scene, Camera* camera);
+        void setGBuffersUniforms(Shader* shader, Camera* camera);
+        void viewGBuffers();
 
-		//Sort render call
+		//Collect render calls
 		void collectRenderCall(GTR::Scene* scene, Camera* camera, std::vector<RenderCall*>* rc_vector);
+		
+		// Collect the render calls of several cameras in a single traversal, rc_vectors[i] gets the calls seen by cameras[i]
+		void collectRenderCall(GTR::Scene* scene, std::vector<Camera*>& cameras, std::vector< std::vector<RenderCall*>* >& rc_vectors);
+		
+		// Collects the camera and the shadow views with several threads and in one, false if the calls differ
+		bool testParallelCollect(GTR::Scene* scene, Camera* camera);
+        
+        // Compute the sort keys of the render calls for a pass and sort them
+        void sortRenderCalls(std::vector<RenderCall*>* rc_vector, eRenderPass pass, Camera* camera);
+        
+        // Number of consecutive calls from start that can be drawn together (fills instanced_models)
+        int getInstanceBatch(std::vector<RenderCall*>& rc_vector, int start);
         
         // Clear render_call_vector
 		void clearRenderCall(std::vector<RenderCall*>* rc_vector);
@@ -54,22 +253,42 @@ namespace GTR {
 		void collectPrefabInRenderCall(const Matrix44& model, GTR::Prefab* prefab, Camera* camera, std::vector<RenderCall*>* rc_vector);
 
 		//to render one node from the prefab and its children
-		void collectNodesInRenderCall(const Matrix44& model, GTR::Node* node, Camera* camera, std::vector<RenderCall*>* rc_vector);
+		//the global matrix of the node is computed from parent_model (NULL for the root) instead of storing it in the node, so it can run in several threads
+		//the node is tested against all the collect_frustums, rc_vectors has a vector for each one
+		//lods are the levels chosen for the nodes of this instance of the prefab, every node only writes its own one
+		void collectNodesInRenderCall(const Matrix44& model, GTR::Node* node, const Matrix44* parent_model, std::vector<RenderCall*>** rc_vectors, RenderCallArena* arena, bool recursive = true, char* lods = NULL);
+		
+		// The level of the mesh of the node to draw (the mesh itself or one of its LODs), lod is the level of the last frame and it is updated
+		Mesh* selectLOD(GTR::Node* node, const BoundingBox& world_bounding, char& lod);
+		
+		// Rasterizes the meshes of the occluder prefabs seen by the camera in the occlusion buffer
+		void renderOccluders(GTR::Scene* scene, Camera* camera);
+		void renderOccluderNodes(GTR::Node* node, const Matrix44& parent_model, Camera* camera);
+		
+		// Splits a prefab in items for collectRenderCall (the root alone and a subtree for every child)
+		void addCollectItems(const Matrix44& model, GTR::Prefab* prefab, char* lods);
         
         // Render to texture function
-        void renderToTexture(Camera* camera, FBO* fbo, std::vector<RenderCall*> rc_vector);
+        void renderToTexture(Camera* camera, FBO* fbo, std::vector<RenderCall*> rc_vector, bool clear = true);
 
         // Rendering light depth buffer for shadow maps
-        void renderLightDepthBuffer(LightEntity* light, std::vector<RenderCall*> rc_vector);
+        void renderLightDepthBuffer(sShadowView& view);
 
         // View the depth buffer
         void viewDepthBuffer(LightEntity* light);
         
+        // Render the overdraw of the opaque calls and measure the fragments saved by sorting
+        void renderDepthComplexity(std::vector<RenderCall*>& rc_vector, Camera* camera);
+        
+        // Show renderer stats in the debug GUI
+        void renderInMenu();
+        
         // Render only the mesh for depth buffer texture
-        void renderMesh(const Matrix44 model, Mesh* mesh, Camera* camera, eAlphaMode material_alpha_mode);
+        // (with the material the masked ones discard the pixels under the cutoff and the two sided ones are not culled)
+        void renderMesh(const Matrix44 model, Mesh* mesh, Camera* camera, eAlphaMode material_alpha_mode, const Matrix44* instanced_models = NULL, int num_instances = 0, GTR::Material* material = NULL);
 
-		//to render one mesh given its material and transformation matrix
-		void renderMeshWithMaterial(const Matrix44 model, Mesh* mesh, GTR::Material* material, Camera* camera);
+		//to render one mesh given its material and transformation matrix (or several instances of it)
+		void renderMeshWithMaterial(const Matrix44 model, Mesh* mesh, GTR::Material* material, Camera* camera, const Matrix44* instanced_models = NULL, int num_instances = 0, const BoundingBox* world_bounding = NULL);
 	};
 
 	Texture* CubemapFromHDRE(const char* filename);
@@ -0,0 +1,426 @@
+#include "rendergraph.h"
+#include "glstate.h"
+#include "profiler.h"
+#include <cassert>
+#include <algorithm>
+
+using namespace GTR;
+
+int sRGTextureDesc::getBytes() const
+{
+	int channels = 4;
+	if (format == GL_RED || format == GL_DEPTH_COMPONENT)
+		channels = 1;
+	else if (format == GL_RG)
+		channels = 2;
+	else if (format == GL_RGB)
+		channels = 3;
+	int size = 1;
+	if (type == GL_HALF_FLOAT)
+		size = 2;
+	else if (type == GL_FLOAT || type == GL_UNSIGNED_INT)
+		size = 4;
+	return width * height * channels * size;
+}
+
+//the same parameters as the textures of FBO::create
+static Texture* createPoolTexture(const sRGTextureDesc& desc)
+{
+	Texture* texture = new Texture(desc.width, desc.height, desc.format, desc.type, false);
+	if (desc.format == GL_DEPTH_COMPONENT)
+		return texture;
+	GLState::bindTexture(texture->texture_type, texture->texture_id);
+	glTexParameteri(texture->texture_type, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glTexParameteri(texture->texture_type, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(texture->texture_type, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(texture->texture_type, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	return texture;
+}
+
+RenderGraph::RenderGraph()
+{
+	use_aliasing = true;
+	num_passes = 0;
+	num_passes_culled = 0;
+	num_transient_textures = 0;
+	num_pool_textures = 0;
+	transient_bytes = 0;
+	pool_bytes = 0;
+	current_fbo = NULL;
+}
+
+RenderGraph::~RenderGraph()
+{
+	for (int i = 0; i < pool.size(); ++i)
+		releasePoolTexture(i);
+}
+
+int RenderGraph::createTexture(const char* name, const sRGTextureDesc& desc)
+{
+	sResource resource;
+	resource.name = name;
+	resource.desc = desc;
+	resource.texture = NULL;
+	resource.transient = true;
+	resource.output = false;
+	resource.first_pass = resource.last_pass = -1;
+	resource.pool_index = -1;
+	resources.push_back(resource);
+	return (int)resources.size() - 1;
+}
+
+int RenderGraph::importResource(const char* name, Texture* texture)
+{
+	sRGTextureDesc desc = { 0, 0, 0, 0 };
+	if (texture)
+	{
+		desc.width = texture->width;
+		desc.height = texture->height;
+		desc.format = texture->format;
+		desc.type = texture->type;
+	}
+	int index = createTexture(name, desc);
+	resources[index].texture = texture;
+	resources[index].transient = false;
+	return index;
+}
+
+void RenderGraph::markOutput(int resource)
+{
+	resources[resource].output = true;
+}
+
+int RenderGraph::addPass(const char* name, RGExecute execute)
+{
+	sPass pass;
+	pass.name = name;
+	pass.execute = execute;
+	pass.side_effects = false;
+	pass.culled = false;
+	passes.push_back(pass);
+	return (int)passes.size() - 1;
+}
+
+void RenderGraph::read(int pass, int resource)
+{
+	passes[pass].reads.push_back(resource);
+}
+
+void RenderGraph::write(int pass, int resource)
+{
+	passes[pass].writes.push_back(resource);
+}
+
+void RenderGraph::setSideEffects(int pass)
+{
+	passes[pass].side_effects = true;
+}
+
+void RenderGraph::compile()
+{
+	//from the last pass to the first, a pass is needed if it writes an output or something a later needed pass reads
+	std::vector<char> needed(resources.size(), 0);
+	for (int i = 0; i < resources.size(); ++i)
+		needed[i] = resources[i].output;
+	num_passes = (int)passes.size();
+	num_passes_culled = 0;
+	for (int p = num_passes - 1; p >= 0; --p)
+	{
+		sPass& pass = passes[p];
+		pass.culled = !pass.side_effects;
+		for (int i = 0; i < pass.writes.size() && pass.culled; ++i)
+			pass.culled = !needed[pass.writes[i]];
+		if (pass.culled)
+		{
+			num_passes_culled++;
+			continue;
+		}
+		for (int i = 0; i < pass.reads.size(); ++i)
+			needed[pass.reads[i]] = 1;
+	}
+
+	//a resource is alive from the first pass that uses it to the last one
+	for (int i = 0; i < resources.size(); ++i)
+	{
+		resources[i].first_pass = resources[i].last_pass = -1;
+		resources[i].pool_index = -1;
+	}
+	for (int p = 0; p < num_passes; ++p)
+	{
+		if (passes[p].culled)
+			continue;
+		for (int k = 0; k < 2; ++k)
+		{
+			std::vector<int>& used = k ? passes[p].writes : passes[p].reads;
+			for (int i = 0; i < used.size(); ++i)
+			{
+				sResource& resource = resources[used[i]];
+				if (resource.first_pass == -1)
+					resource.first_pass = p;
+				resource.last_pass = p;
+			}
+		}
+	}
+
+	//in order of first use, a transient texture takes a texture of the pool with its description that is free
+	//(the resource that had it died in an earlier pass), or a new one
+	std::vector<char> pool_used(pool.size(), 0);
+	for (int i = 0; i < pool.size(); ++i)
+		pool[i].free_after = -1;
+	std::vector<int> order;
+	for (int i = 0; i < resources.size(); ++i)
+		if (resources[i].transient && resources[i].first_pass != -1)
+			order.push_back(i);
+	std::stable_sort(order.begin(), order.end(), [this](int a, int b) { return resources[a].first_pass < resources[b].first_pass; });
+	num_transient_textures = (int)order.size();
+	transient_bytes = 0;
+	for (int i = 0; i < order.size(); ++i)
+	{
+		sResource& resource = resources[order[i]];
+		transient_bytes += resource.desc.getBytes();
+		int index = -1;
+		for (int j = 0; j < pool.size() && index == -1; ++j)
+			if (pool[j].desc == resource.desc && (!pool_used[j] || (use_aliasing && pool[j].free_after < resource.first_pass)))
+				index = j;
+		if (index == -1)
+		{
+			sPoolTexture texture;
+			texture.desc = resource.desc;
+			texture.texture = NULL;
+			texture.unused_frames = 0;
+			pool.push_back(texture);
+			pool_used.push_back(0);
+			index = (int)pool.size() - 1;
+		}
+		pool_used[index] = 1;
+		pool[index].free_after = resource.last_pass;
+		resource.pool_index = index;
+	}
+
+	num_pool_textures = 0;
+	pool_bytes = 0;
+	for (int i = 0; i < pool.size(); ++i)
+	{
+		if (!pool_used[i])
+		{
+			pool[i].unused_frames++;
+			continue;
+		}
+		pool[i].unused_frames = 0;
+		num_pool_textures++;
+		pool_bytes += pool[i].desc.getBytes();
+	}
+}
+
+void RenderGraph::execute()
+{
+	for (int i = 0; i < pool.size(); ++i)
+		if (!pool[i].unused_frames && !pool[i].texture)
+			pool[i].texture = createPoolTexture(pool[i].desc);
+
+	std::vector<Texture*> colors;
+	for (int p = 0; p < passes.size(); ++p)
+	{
+		sPass& pass = passes[p];
+		if (pass.culled)
+			continue;
+
+		//the transient textures written by the pass are its framebuffer
+		colors.clear();
+		Texture* depth = NULL;
+		for (int i = 0; i < pass.writes.size(); ++i)
+		{
+			sResource& resource = resources[pass.writes[i]];
+			if (!resource.transient)
+				continue;
+			Texture* texture = pool[resource.pool_index].texture;
+			if (resource.desc.format == GL_DEPTH_COMPONENT)
+				depth = texture;
+			else
+				colors.push_back(texture);
+		}
+		PROFILE_GPU_SCOPE(pass.name.c_str());
+		current_fbo = colors.size() || depth ? getFramebuffer(colors, depth) : NULL;
+		if (current_fbo)
+			current_fbo->bind();
+		pass.execute(*this);
+		if (current_fbo)
+			current_fbo->unbind();
+		current_fbo = NULL;
+	}
+}
+
+void RenderGraph::reset()
+{
+	resources.clear();
+	passes.clear();
+
+	//the textures nobody used for a while are deleted (the ones of another size or another mode)
+	for (int i = (int)pool.size() - 1; i >= 0; --i)
+	{
+		if (pool[i].unused_frames <= RG_MAX_UNUSED_FRAMES)
+			continue;
+		releasePoolTexture(i);
+		pool.erase(pool.begin() + i);
+	}
+}
+
+Texture* RenderGraph::getTexture(int resource)
+{
+	sResource& r = resources[resource];
+	if (!r.transient)
+		return r.texture;
+	return r.pool_index == -1 ? NULL : pool[r.pool_index].texture;
+}
+
+FBO* RenderGraph::getFramebuffer(std::vector<Texture*>& colors, Texture* depth)
+{
+	std::vector<Texture*> attachments = colors;
+	attachments.push_back(depth);
+	for (int i = 0; i < framebuffers.size(); ++i)
+		if (framebuffers[i].attachments == attachments)
+			return framebuffers[i].fbo;
+
+	//the framebuffer doesn't own the textures, they stay in the pool
+	sFramebuffer framebuffer;
+	framebuffer.attachments = attachments;
+	framebuffer.fbo = new FBO();
+	framebuffer.fbo->setTextures(colors, depth);
+	framebuffers.push_back(framebuffer);
+	return framebuffer.fbo;
+}
+
+void RenderGraph::releasePoolTexture(int index)
+{
+	Texture* texture = pool[index].texture;
+	if (!texture)
+		return;
+	for (int i = (int)framebuffers.size() - 1; i >= 0; --i)
+	{
+		std::vector<Texture*>& attachments = framebuffers[i].attachments;
+		if (std::find(attachments.begin(), attachments.end(), texture) == attachments.end())
+			continue;
+		delete framebuffers[i].fbo;
+		framebuffers.erase(framebuffers.begin() + i);
+	}
+	delete texture;
+	pool[index].texture = NULL;
+}
+
+void RenderGraph::renderInMenu()
+{
+#ifndef SKIP_IMGUI
+	ImGui::Checkbox("Alias textures", &use_aliasing);
+	ImGui::Text("Passes: %d (%d culled)", num_passes, num_passes_culled);
+	ImGui::Text("Textures: %d in %d of the pool", num_transient_textures, num_pool_textures);
+	ImGui::Text("Memory: %.1f MB (%.1f MB without aliasing)", pool_bytes / (1024.0f * 1024.0f), transient_bytes / (1024.0f * 1024.0f));
+	if (ImGui::TreeNode("Passes"))
+	{
+		for (int p = 0; p < passes.size(); ++p)
+			ImGui::Text("%s%s", passes[p].name.c_str(), passes[p].culled ? " (culled)" : "");
+		ImGui::TreePop();
+	}
+	if (ImGui::TreeNode("Resources"))
+	{
+		for (int i = 0; i < resources.size(); ++i)
+		{
+			sResource& resource = resources[i];
+			if (!resource.transient)
+				ImGui::Text("%s: imported", resource.name.c_str());
+			else if (resource.pool_index == -1)
+				ImGui::Text("%s: not used", resource.name.c_str());
+			else
+				ImGui::Text("%s: texture %d, passes %d-%d", resource.name.c_str(), resource.pool_index, resource.first_pass, resource.last_pass);
+		}
+		ImGui::TreePop();
+	}
+#endif
+}
+
+static void emptyPass(RenderGraph& graph)
+{
+}
+
+bool GTR::testRenderGraph()
+{
+	RenderGraph graph;
+	sRGTextureDesc color = { 1280, 720, GL_RGBA, GL_UNSIGNED_BYTE };
+	sRGTextureDesc hdr = { 1280, 720, GL_RGBA, GL_FLOAT };
+	sRGTextureDesc depth = { 1280, 720, GL_DEPTH_COMPONENT, GL_UNSIGNED_INT };
+
+	int gb[4];
+	gb[0] = graph.createTexture("albedo", color);
+	gb[1] = graph.createTexture("normal", color);
+	gb[2] = graph.createTexture("material", color);
+	gb[3] = graph.createTexture("emissive", color);
+	int gb_depth = graph.createTexture("depth", depth);
+	int ssao = graph.createTexture("ssao", color);
+	int ssao_blurred = graph.createTexture("ssao blurred", color);
+	int light = graph.createTexture("hdr", hdr);
+	int bright = graph.createTexture("bright", hdr);
+	int bloom_h = graph.createTexture("bloom horizontal", hdr);
+	int bloom = graph.createTexture("bloom", hdr);
+	int ldr = graph.createTexture("ldr", color);
+	int debug = graph.createTexture("debug", color);
+	int window = graph.importResource("window");
+	graph.markOutput(window);
+
+	int pass = graph.addPass("gbuffers", emptyPass);
+	for (int i = 0; i < 4; ++i)
+		graph.write(pass, gb[i]);
+	graph.write(pass, gb_depth);
+	pass = graph.addPass("ssao", emptyPass);
+	graph.read(pass, gb[1]);
+	graph.read(pass, gb_depth);
+	graph.write(pass, ssao);
+	pass = graph.addPass("ssao blur", emptyPass);
+	graph.read(pass, ssao);
+	graph.write(pass, ssao_blurred);
+	pass = graph.addPass("lighting", emptyPass);
+	for (int i = 0; i < 4; ++i)
+		graph.read(pass, gb[i]);
+	graph.read(pass, gb_depth);
+	graph.read(pass, ssao_blurred);
+	graph.write(pass, light);
+	pass = graph.addPass("bloom extract", emptyPass);
+	graph.read(pass, light);
+	graph.write(pass, bright);
+	pass = graph.addPass("bloom horizontal", emptyPass);
+	graph.read(pass, bright);
+	graph.write(pass, bloom_h);
+	pass = graph.addPass("bloom vertical", emptyPass);
+	graph.read(pass, bloom_h);
+	graph.write(pass, bloom);
+	pass = graph.addPass("tonemap", emptyPass);
+	graph.read(pass, light);
+	graph.read(pass, bloom);
+	graph.write(pass, ldr);
+	pass = graph.addPass("fxaa", emptyPass);
+	graph.read(pass, ldr);
+	graph.write(pass, window);
+	int debug_pass = graph.addPass("debug view", emptyPass);
+	graph.read(debug_pass, gb[0]);
+	graph.write(debug_pass, debug);
+	graph.compile();
+
+	//only the debug view is culled, nothing reads what it writes
+	bool correct = graph.num_passes_culled == 1 && graph.isCulled(debug_pass) && graph.getPoolIndex(debug) == -1;
+
+	//the textures that share memory have the same description and never overlap
+	for (int a = 0; a <= debug; ++a)
+		for (int b = a + 1; b <= debug; ++b)
+		{
+			int index = graph.getPoolIndex(a);
+			if (index == -1 || index != graph.getPoolIndex(b))
+				continue;
+			bool overlap = graph.getFirstPass(a) <= graph.getLastPass(b) && graph.getFirstPass(b) <= graph.getLastPass(a);
+			if (overlap)
+				correct = false;
+		}
+	correct = correct && graph.num_pool_textures < graph.num_transient_textures;
+
+	std::cout << " + Render graph " << (correct ? "OK" : "FAILED") << ": " << graph.num_passes_culled << " of " << graph.num_passes << " passes culled, "
+		<< graph.num_transient_textures << " textures in " << graph.num_pool_textures << " of the pool, "
+		<< graph.pool_bytes / (1024 * 1024) << " MB instead of " << graph.transient_bytes / (1024 * 1024) << " MB" << std::endl;
+	return correct;
+}
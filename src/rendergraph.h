@@ -0,0 +1,123 @@
+#ifndef RENDERGRAPH_H
+#define RENDERGRAPH_H
+
+#include "fbo.h"
+#include <vector>
+#include <string>
+#include <functional>
+
+namespace GTR {
+
+	// frames a texture of the pool can stay unused before it is deleted (after a resize or a change of mode)
+	#define RG_MAX_UNUSED_FRAMES 60
+
+	// What a transient texture of the graph looks like, textures with the same description can be shared
+	struct sRGTextureDesc
+	{
+		int width;
+		int height;
+		int format; // GL_RGBA, GL_DEPTH_COMPONENT...
+		int type; // GL_UNSIGNED_BYTE, GL_FLOAT...
+
+		bool operator==(const sRGTextureDesc& other) const { return width == other.width && height == other.height && format == other.format && type == other.type; }
+		int getBytes() const;
+	};
+
+	class RenderGraph;
+	typedef std::function<void(RenderGraph& graph)> RGExecute;
+
+	// The passes of a frame, declared in the order they run with the resources they read and write.
+	// compile removes the passes whose results nobody uses and gives every transient texture a texture of the pool,
+	// the same one to textures with the same description that are never alive at the same time.
+	// execute binds a framebuffer with the transient textures written by every pass before running it,
+	// the passes that only write imported resources (the window, the shadow atlas) bind their own targets.
+	class RenderGraph
+	{
+	public:
+		bool use_aliasing;
+		int num_passes; // declared in the last compile
+		int num_passes_culled;
+		int num_transient_textures;
+		int num_pool_textures; // used by the last compile
+		long transient_bytes; // of all the transient textures, as if every one had its own texture
+		long pool_bytes; // of the textures of the pool used by the last compile
+		FBO* current_fbo; // the framebuffer of the pass being executed (NULL if it has no transient textures)
+
+		RenderGraph();
+		~RenderGraph();
+
+		// Resources, the handles are valid until reset
+		int createTexture(const char* name, const sRGTextureDesc& desc);
+		// texture is NULL for the resources that are not textures of the graph (the window, the uniform buffers)
+		int importResource(const char* name, Texture* texture = NULL);
+		// the results of the frame, the passes that contribute to them are not culled
+		void markOutput(int resource);
+
+		// Passes, in the order they are executed
+		int addPass(const char* name, RGExecute execute);
+		void read(int pass, int resource);
+		void write(int pass, int resource);
+		void setSideEffects(int pass); // never culled
+
+		// Culls the passes and assigns the textures of the pool (it doesn't touch the GPU)
+		void compile();
+		// Creates the textures of the pool that are missing and runs the passes that were not culled
+		void execute();
+		// Forgets the passes and resources of the frame, the pool is kept for the next one
+		void reset();
+
+		// The texture of a resource (only valid after compile)
+		Texture* getTexture(int resource);
+		bool isCulled(int pass) { return passes[pass].culled; }
+		int getPoolIndex(int resource) { return resources[resource].pool_index; }
+		int getFirstPass(int resource) { return resources[resource].first_pass; }
+		int getLastPass(int resource) { return resources[resource].last_pass; }
+
+		// Passes and pool in the debug GUI
+		void renderInMenu();
+
+	private:
+		struct sResource {
+			std::string name;
+			sRGTextureDesc desc;
+			Texture* texture; // imported
+			bool transient;
+			bool output;
+			int first_pass; // alive passes that use it, -1 if none
+			int last_pass;
+			int pool_index;
+		};
+		struct sPass {
+			std::string name;
+			RGExecute execute;
+			std::vector<int> reads;
+			std::vector<int> writes;
+			bool side_effects;
+			bool culled;
+		};
+		struct sPoolTexture {
+			sRGTextureDesc desc;
+			Texture* texture; // NULL until the first execute that uses it
+			int free_after; // last pass of the resource assigned in this compile, -1 if not used
+			int unused_frames;
+		};
+		struct sFramebuffer {
+			std::vector<Texture*> attachments; // colors and then the depth (or NULL)
+			FBO* fbo;
+		};
+
+		std::vector<sResource> resources;
+		std::vector<sPass> passes;
+		std::vector<sPoolTexture> pool;
+		std::vector<sFramebuffer> framebuffers;
+
+		FBO* getFramebuffer(std::vector<Texture*>& colors, Texture* depth);
+		void releasePoolTexture(int index);
+	};
+
+	// Compiles a deferred frame with ssao and bloom and an unused debug pass, checks the culling and that
+	// the textures sharing memory are never alive at the same time, prints the memory saved (false if a check fails)
+	bool testRenderGraph();
+};
+
+#endif
@@ -4,6 +4,8 @@
 #include "prefab.h"
 #include "extra/cJSON.h"
 #include "application.h"
+#include "commandlist.h"
+#include <algorithm>
 
 GTR::Scene* GTR::Scene::instance = NULL;
 
@@ -160,6 +162,7 @@ GTR::PrefabEntity::PrefabEntity()
 {
 	entity_type = PREFAB;
 	prefab = NULL;
+	is_occluder = false;
 }
 
 void GTR::PrefabEntity::configure(cJSON* json)
@@ -169,6 +172,8 @@ void GTR::PrefabEntity::configure(cJSON* json)
 		filename = cJSON_GetObjectItem(json, "filename")->valuestring;
 		prefab = GTR::Prefab::Get( (std::string("data/") + filename).c_str());
 	}
+	if (cJSON_GetObjectItem(json, "occluder"))
+		is_occluder = cJSON_IsTrue(cJSON_GetObjectItem(json, "occluder"));
 }
 
 void GTR::PrefabEntity::renderInMenu()
@@ -177,6 +182,7 @@ void GTR::PrefabEntity::renderInMenu()
 
 #ifndef SKIP_IMGUI
 	ImGui::Text("filename: %s", filename.c_str()); // Edit 3 floats representing a color
+	ImGui::Checkbox("Occluder", &is_occluder);
 	if (prefab && ImGui::TreeNode(prefab, "Prefab Info"))
 	{
 		prefab->root.renderInMenu();
@@ -193,9 +199,17 @@ GTR::LightEntity::LightEntity() : GTR::BaseEntity(){
 	this->max_distance = 0;
 	this->cone_angle = 0;
 	this->camera = new Camera();
-	this->fbo = new FBO();
-	this->fbo->create(Application::instance->window_width, Application::instance->window_height);
     this->shadow_bias = 0.0001;
+    this->num_cascades = MAX_CASCADES;
+    this->cascade_lambda = 0.75;
+    this->shadow_atlas = NULL;
+    for (int i = 0; i < MAX_SHADOW_VIEWS; i++){
+        sShadowView& view = this->shadow_views[i];
+        view.camera = i == 0 ? this->camera : new Camera();
+        view.tile_x = view.tile_y = view.tile_size = 0;
+        view.hash = 0;
+    }
+    this->num_shadow_views = 0;
 }
 
 GTR::LightEntity::~LightEntity(){}
@@ -212,22 +226,90 @@ void GTR::LightEntity::changeLightPosition(Vector3 delta){
     this->camera->move(delta);
 }
 
+//the light uniforms are set for every draw in multipass, they are registered once (see UniformHandle)
+static UniformHandle u_light_color("u_light_color");
+static UniformHandle u_light_position("u_light_position");
+static UniformHandle u_light_type("u_light_type");
+static UniformHandle u_light_direction("u_light_direction");
+static UniformHandle u_max_distance("u_max_distance");
+static UniformHandle u_cone_angle("u_cone_angle");
+static UniformHandle u_intensity("u_intensity");
+static UniformHandle u_num_shadow_views("u_num_shadow_views");
+static UniformHandle u_shadow_viewproj("u_shadow_viewproj");
+static UniformHandle u_shadow_atlas_rect("u_shadow_atlas_rect");
+static UniformHandle u_shadow_atlas("u_shadow_atlas");
+static UniformHandle u_shadow_bias("u_shadow_bias");
+static UniformHandle u_cone_exp("u_cone_exp");
+
 void GTR::LightEntity::setUniforms(Shader* shader){
 	// Light properties uniforms
-    shader->setUniform("u_light_color", this->color);
-	shader->setUniform("u_light_position",this->model.getTranslation());
-	shader->setUniform("u_light_type",this->light_type);
-	shader->setUniform("u_light_direction",this->model.frontVector());
-	shader->setUniform("u_max_distance",this->max_distance);
-	shader->setUniform("u_cone_angle",this->cone_angle);
-    shader->setUniform("u_intensity", this->intensity);
+    shader->setUniform(u_light_color, this->color);
+	shader->setUniform(u_light_position,this->model.getTranslation());
+	shader->setUniform(u_light_type,this->light_type);
+	shader->setUniform(u_light_direction,this->model.frontVector());
+	shader->setUniform(u_max_distance,this->max_distance);
+	shader->setUniform(u_cone_angle,this->cone_angle);
+    shader->setUniform(u_intensity, this->intensity);
     
-    //Shadow map uniforms
-    shader->setUniform("u_shadow_viewproj", this->camera->viewprojection_matrix);
+    //Shadow map uniforms, a matrix and a tile of the shadow atlas for every view (an empty rect means that view has no shadow)
+    Matrix44 shadow_viewproj[MAX_SHADOW_VIEWS];
+    Vector4 shadow_atlas_rect[MAX_SHADOW_VIEWS];
+    for (int i = 0; i < MAX_SHADOW_VIEWS; i++){
+        shadow_viewproj[i] = this->shadow_views[i].camera->viewprojection_matrix;
+        shadow_atlas_rect[i] = i < this->num_shadow_views ? this->shadow_views[i].atlas_rect : Vector4(0, 0, 0, 0);
+    }
+    shader->setUniform(u_num_shadow_views, this->shadow_atlas ? this->num_shadow_views : 0);
+    shader->setMatrix44Array(u_shadow_viewproj, shadow_viewproj, MAX_SHADOW_VIEWS);
+    shader->setUniform4Array(u_shadow_atlas_rect, (float*)shadow_atlas_rect, MAX_SHADOW_VIEWS);
     //shader->setUniform("u_shadow_camera_position", this->camera->eye);
-    shader->setTexture("u_shadowmap", this->fbo->depth_texture, 8);
-    shader->setUniform("u_shadow_bias", this->shadow_bias );
-    shader->setUniform("u_cone_exp", this->cone_exp);
+    if (this->shadow_atlas)
+        shader->setUniform(u_shadow_atlas, this->shadow_atlas, 8);
+    shader->setUniform(u_shadow_bias, this->shadow_bias );
+    shader->setUniform(u_cone_exp, this->cone_exp);
+}
+
+void GTR::LightEntity::recordUniforms(CommandList* list){
+    list->setUniform(u_light_color, this->color);
+    list->setUniform(u_light_position, this->model.getTranslation());
+    list->setUniform(u_light_type, (int)this->light_type);
+    list->setUniform(u_light_direction, this->model.frontVector());
+    list->setUniform(u_max_distance, this->max_distance);
+    list->setUniform(u_cone_angle, this->cone_angle);
+    list->setUniform(u_intensity, this->intensity);
+    
+    Matrix44 shadow_viewproj[MAX_SHADOW_VIEWS];
+    Vector4 shadow_atlas_rect[MAX_SHADOW_VIEWS];
+    for (int i = 0; i < MAX_SHADOW_VIEWS; i++){
+        shadow_viewproj[i] = this->shadow_views[i].camera->viewprojection_matrix;
+        shadow_atlas_rect[i] = i < this->num_shadow_views ? this->shadow_views[i].atlas_rect : Vector4(0, 0, 0, 0);
+    }
+    list->setUniform(u_num_shadow_views, this->shadow_atlas ? this->num_shadow_views : 0);
+    list->setUniformArray(u_shadow_viewproj, UNIFORM_MATRIX44, shadow_viewproj, MAX_SHADOW_VIEWS);
+    list->setUniformArray(u_shadow_atlas_rect, UNIFORM_VECTOR4, shadow_atlas_rect, MAX_SHADOW_VIEWS);
+    if (this->shadow_atlas){
+        list->setUniform(u_shadow_atlas, 8);
+        list->bindTexture(8, this->shadow_atlas);
+    }
+    list->setUniform(u_shadow_bias, this->shadow_bias);
+    list->setUniform(u_cone_exp, this->cone_exp);
+}
+
+void GTR::LightEntity::fillUniformBlock(sLightBlock& block){
+    block.position = this->model.getTranslation();
+    block.max_distance = this->max_distance;
+    block.color = this->color;
+    block.intensity = this->intensity;
+    block.direction = this->model.frontVector();
+    block.cone_angle = this->cone_angle;
+    block.light_type = this->light_type;
+    block.cone_exp = this->cone_exp;
+    block.shadow_bias = this->shadow_bias;
+    block.num_shadow_views = this->shadow_atlas ? this->num_shadow_views : 0;
+    for (int i = 0; i < MAX_SHADOW_VIEWS; i++){
+        block.shadow_viewproj[i] = this->shadow_views[i].camera->viewprojection_matrix;
+        block.shadow_atlas_rect[i] = i < this->num_shadow_views ? this->shadow_views[i].atlas_rect : Vector4(0, 0, 0, 0);
+    }
+    block.ambient_factor = 0;
 }
 
 // Configuring special json fields for Light entity
@@ -291,6 +373,14 @@ void GTR::LightEntity::configure(cJSON* json)
     {
         this->area_size = readJSONNumber(json, "area_size", 0);
     }
+    if (cJSON_GetObjectItem(json, "cascades"))
+    {
+        this->num_cascades = (int)clamp(readJSONNumber(json, "cascades", MAX_CASCADES), 1, MAX_CASCADES);
+    }
+    if (cJSON_GetObjectItem(json, "cascade_lambda"))
+    {
+        this->cascade_lambda = readJSONNumber(json, "cascade_lambda", 0.75f);
+    }
     
     setCameraLight();
     
@@ -309,13 +399,75 @@ void GTR::LightEntity::setCameraLight(){
         camera->setOrthographic(-area_size/2, area_size/2, -area_size/2, area_size/2, -this->max_distance, this->max_distance);
     }
     else if(this->light_type == POINT){
-        // De momento nada... Pero se puede applicar un cube map
+        // The shadow is a cube map, every face has its own camera (see updateShadowViews)
+        camera->setPerspective(90.0f, 1.0f, 1.0f, this->max_distance);
     }
     
     // Set the camera look at
     setCameraAsLight();
 }
 
+int GTR::LightEntity::getNumShadowViews(){
+    if (this->light_type == SPOT)
+        return 1;
+    if (this->light_type == DIRECTIONAL)
+        return this->num_cascades;
+    if (this->light_type == POINT)
+        return 6;
+    return 0;
+}
+
+void GTR::LightEntity::updateShadowViews(Camera* camera){
+    if (this->light_type == POINT){
+        // Faces of the cube in the order of GL_TEXTURE_CUBE_MAP_POSITIVE_X...NEGATIVE_Z
+        static const Vector3 face_front[6] = { Vector3(1,0,0), Vector3(-1,0,0), Vector3(0,1,0), Vector3(0,-1,0), Vector3(0,0,1), Vector3(0,0,-1) };
+        static const Vector3 face_up[6] = { Vector3(0,-1,0), Vector3(0,-1,0), Vector3(0,0,1), Vector3(0,0,-1), Vector3(0,-1,0), Vector3(0,-1,0) };
+        Vector3 light_position = this->model.getTranslation();
+        for (int i = 0; i < this->num_shadow_views; i++){
+            Camera* face_camera = this->shadow_views[i].camera;
+            face_camera->setPerspective(90.0f, 1.0f, 1.0f, this->max_distance);
+            face_camera->lookAt(light_position, light_position + face_front[i], face_up[i]);
+        }
+        return;
+    }
+    
+    if (this->light_type != DIRECTIONAL || this->num_cascades == 1)
+        return;
+    
+    // The cascades cover the camera frustum up to where the light reaches
+    float far_plane = std::min(camera->far_plane, this->max_distance);
+    float splits[MAX_CASCADES];
+    computeCascadeSplits(camera->near_plane, far_plane, this->num_cascades, this->cascade_lambda, splits);
+    
+    float split_near = camera->near_plane;
+    for (int i = 0; i < this->num_shadow_views; i++){
+        sShadowView& view = this->shadow_views[i];
+        if (view.tile_size)
+            fitCascadeCamera(camera, split_near, splits[i], this->model.frontVector(), this->max_distance, view.tile_size, view.camera);
+        split_near = splits[i];
+    }
+}
+
+bool GTR::LightEntity::intersectsBox(const BoundingBox& box){
+    if (this->light_type == DIRECTIONAL)
+        return true;
+    
+    // Sphere of the range of the light
+    Vector3 light_position = this->model.getTranslation();
+    if (!BoundingBoxSphereOverlap(box, light_position, this->max_distance))
+        return false;
+    if (this->light_type != SPOT || this->cone_angle >= PI * 0.5f)
+        return true;
+    
+    // Cone of the spot against the sphere around the box, using the distance to the side of the cone
+    Vector3 direction = this->model.frontVector().normalize();
+    Vector3 to_center = box.center - light_position;
+    float distance_along = dot(to_center, direction);
+    float distance_to_axis = (float)(to_center - direction * distance_along).length();
+    float distance_to_cone = distance_to_axis * cos(this->cone_angle) - distance_along * sin(this->cone_angle);
+    return distance_to_cone <= box.halfsize.length();
+}
+
 void GTR::LightEntity::setCameraAsLight(){
 	Vector3 light_position = this->model.getTranslation();
 	Vector3 light_front = this->model.frontVector();
@@ -5,12 +5,15 @@
 #include "shader.h"
 #include "camera.h"
 #include <string>
+#include <map>
 #include "camera.h"
 #include "fbo.h"
 #include "renderCall.h"
+#include "cascades.h"
 
 //forward declaration
 class cJSON; 
+class CommandList;
 
 
 //our namespace
@@ -58,12 +61,46 @@ namespace GTR {
 	public:
 		std::string filename;
 		Prefab* prefab;
+		bool is_occluder; // its meshes are rasterized in the occlusion buffer to cull what is behind them
+		std::map<Camera*, std::vector<char> > lods; // level chosen in the last frame for every node of the prefab (by Node::index), for every camera that chooses them
 		
 		PrefabEntity();
 		virtual void renderInMenu();
 		virtual void configure(cJSON* json);
 	};
 
+	// the six faces of the cube of a point light, the cascades of a directional light fit too
+	#define MAX_SHADOW_VIEWS 6
+
+	// One of the cameras a light renders its shadow from (a spot light has one, a directional light one per cascade, a point light one per face of a cube)
+	struct sShadowView {
+		Camera* camera;
+		std::vector<RenderCall*> rc; // render calls seen by the camera
+		int tile_x;
+		int tile_y;
+		int tile_size; // tile in the shadow atlas, 0 if it has no tile this frame
+		Vector4 atlas_rect; // the tile in uv coordinates (x, y, width, height)
+		uint64_t hash; // state of the camera and its casters when the tile was rendered (0 if never)
+	};
+
+	// The data of a light in the LightData uniform block of light.fs (std140 layout, 560 bytes)
+	struct sLightBlock {
+		Matrix44 shadow_viewproj[MAX_SHADOW_VIEWS];
+		Vector4 shadow_atlas_rect[MAX_SHADOW_VIEWS];
+		Vector3 position;
+		float max_distance;
+		Vector3 color;
+		float intensity;
+		Vector3 direction;
+		float cone_angle;
+		int light_type;
+		float cone_exp;
+		float shadow_bias;
+		int num_shadow_views;
+		float ambient_factor; // 1 for the light that also adds the ambient and emissive light, 0 for the rest
+		float padding[3];
+	};
+
 	//represents one light in the scene
 	class LightEntity : public GTR::BaseEntity
 	{
@@ -78,10 +115,13 @@ namespace GTR {
 		float cone_angle; // In degrees
         float cone_exp;
 		float area_size;
-		Camera* camera; // For shadow maps
-		FBO* fbo;
+		Camera* camera; // For shadow maps (the camera of the first shadow view)
         float shadow_bias;
-        std::vector<RenderCall*> rc; // render call for the fbo rendering
+        int num_cascades; // for directional lights, 1 uses a single camera of area_size
+        float cascade_lambda; // 1.0 logarithmic cascade splits, 0.0 uniform
+        Texture* shadow_atlas; // where the tiles of the shadow views are (assigned by the renderer)
+        sShadowView shadow_views[MAX_SHADOW_VIEWS];
+        int num_shadow_views;
 		
 		//Constructor
 		LightEntity();
@@ -93,7 +133,18 @@ namespace GTR {
 		void changeLightPosition(Vector3 delta);
 		void configure(cJSON* json);
 		void setUniforms(Shader* shader);
+		// The same data that setUniforms sends, to upload it in an uniform buffer
+		void fillUniformBlock(sLightBlock& block);
+		// The same uniforms, recorded in a command list (the shadow atlas is bound to the slot 8)
+		void recordUniforms(CommandList* list);
         void setCameraLight();
+        // Number of shadow maps the light needs
+        int getNumShadowViews();
+        // Places the cameras of the shadow views: the cascades of a directional light are fitted
+        // to the camera (needs the tiles assigned) and the cube faces of a point light follow its position
+        void updateShadowViews(Camera* camera);
+        // If the light can reach something inside the box (conservative)
+        bool intersectsBox(const BoundingBox& box);
 		void setCameraAsLight();
 	};
 
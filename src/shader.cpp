@@ -8,6 +8,8 @@
 #include <locale>
 
 #include "texture.h"
+#include "glstate.h"
+#include <chrono>
 
 std::string Shader::s_shader_atlas_filename;
 std::map<std::string, std::string> Shader::s_shaders_atlas;
@@ -56,14 +58,44 @@ std::map<std::string, std::string> Shader::s_shaders_atlas;
 std::map<std::string,Shader*> Shader::s_Shaders;
 bool Shader::s_ready = false;
 Shader* Shader::current = NULL;
+int Shader::s_ShaderID = 0;
+
+//the names of all the handles, the index of a name is its handle
+static std::map<std::string, int>& getHandleNames()
+{
+	//inside a function so it exists before the static handles of other files are constructed
+	static std::map<std::string, int> names;
+	return names;
+}
+
+UniformHandle::UniformHandle(const char* name)
+{
+	this->name = name;
+	std::map<std::string, int>& names = getHandleNames();
+	std::map<std::string, int>::iterator it = names.find(name);
+	if (it != names.end())
+		index = it->second;
+	else
+	{
+		index = (int)names.size();
+		names[name] = index;
+	}
+}
+
+int UniformHandle::getNumHandles()
+{
+	return (int)getHandleNames().size();
+}
 
 Shader::Shader()
 {
 	if(!Shader::s_ready)
 		Shader::init();
+	m_Id = s_ShaderID++;
 	vs = fs = 0;
 	compiled = false;
 	from_atlas = false;
+	vertex_layout = -1;
 }
 
 Shader::~Shader()
@@ -379,6 +411,15 @@ bool Shader::createShaderObject(unsigned int type, GLuint& handle, const std::st
 	std::string prefix = "";//"#define DESKTOP\n";
 
     std::string fullcode = prefix + code;
+	//the #version must be the first line, but the macros of the atlas and the includes are added before it
+	size_t version = fullcode.find("#version");
+	if (version != std::string::npos && version != 0)
+	{
+		size_t end = fullcode.find('\n', version);
+		std::string version_line = fullcode.substr(version, end == std::string::npos ? std::string::npos : end - version);
+		fullcode.erase(version, version_line.size());
+		fullcode = version_line + "\n" + fullcode;
+	}
 	const char* ptr = fullcode.c_str();
 	glShaderSource(handle, 1, &ptr, NULL);
 	assert( glGetError() == GL_NO_ERROR );
@@ -427,12 +468,16 @@ void Shader::release()
 
 	if (program)
 	{
+		GLState::releaseProgram(program);
 		glDeleteProgram(program);
 		assert (glGetError() == GL_NO_ERROR);
 		program = 0;
 	}
 
 	locations.clear();
+	handle_locations.clear();
+	//the attributes may be in other locations after compiling again, the meshes use the vertex arrays of its new layout
+	vertex_layout = -1;
 
 	compiled = false;
 }
@@ -445,7 +490,7 @@ void Shader::enable()
 
 	current = this;
 
-	glUseProgram(program);
+	GLState::useProgram(program);
     GLuint err = glGetError();
 	assert (err == GL_NO_ERROR);
 
@@ -457,14 +502,14 @@ void Shader::disable()
 {
 	current = NULL;
 
-	glUseProgram(0);
+	GLState::useProgram(0);
 	//glActiveTexture(GL_TEXTURE0);
 	assert (glGetError() == GL_NO_ERROR);
 }
 
 void Shader::disableShaders()
 {
-	glUseProgram(0);
+	GLState::useProgram(0);
 	assert (glGetError() == GL_NO_ERROR);
 }
 
@@ -539,6 +584,16 @@ GLint Shader::getLocation(const char* varname,loctable* table)
 	return loc;
 }
 
+GLint Shader::resolveLocation(const UniformHandle& handle)
+{
+	if (handle_locations.size() < UniformHandle::getNumHandles())
+		handle_locations.resize(UniformHandle::getNumHandles(), UNRESOLVED_LOCATION);
+	//unlike the table of names, a uniform that is not in the shader is also stored
+	GLint loc = glGetUniformLocation(program, handle.name);
+	handle_locations[handle.index] = loc;
+	return loc;
+}
+
 int Shader::getAttribLocation(const char* varname)
 {
 	int loc = glGetAttribLocation(program, varname);
@@ -562,12 +617,33 @@ int Shader::getUniformLocation(const char* varname)
 	return loc;
 }
 
+bool Shader::hasUniformBlock(const char* block_name)
+{
+#ifdef USE_UNIFORM_BUFFERS
+	return glGetUniformBlockIndex(program, block_name) != GL_INVALID_INDEX;
+#else
+	return false;
+#endif
+}
+
+bool Shader::setUniformBlock(const char* block_name, int binding)
+{
+#ifdef USE_UNIFORM_BUFFERS
+	GLuint index = glGetUniformBlockIndex(program, block_name);
+	if (index == GL_INVALID_INDEX)
+		return false;
+	glUniformBlockBinding(program, index, binding);
+	assert(glGetError() == GL_NO_ERROR);
+	return true;
+#else
+	return false;
+#endif
+}
+
 void Shader::setTexture(const char* varname, Texture* tex, int slot)
 {
-	glActiveTexture(GL_TEXTURE0 + slot);
-	glBindTexture(tex->texture_type, tex->texture_id);
+	GLState::bindTexture(slot, tex->texture_type, tex->texture_id);
 	setUniform1(varname, slot);
-	glActiveTexture(GL_TEXTURE0 + slot);
 }
 
 /*
@@ -741,6 +817,146 @@ void Shader::setMatrix44Array( const char* varname, Matrix44* m_array, int num )
 	assert(glGetError() == GL_NO_ERROR);
 }
 
+void Shader::setUniform(const UniformHandle& handle, bool input)
+{
+	assert(current == this);
+	GLint loc = getLocation(handle);
+	CHECK_SHADER_VAR(loc, handle.name);
+	glUniform1i(loc, input);
+	assert(glGetError() == GL_NO_ERROR);
+}
+
+void Shader::setUniform(const UniformHandle& handle, int input)
+{
+	assert(current == this);
+	GLint loc = getLocation(handle);
+	CHECK_SHADER_VAR(loc, handle.name);
+	glUniform1i(loc, input);
+	assert(glGetError() == GL_NO_ERROR);
+}
+
+void Shader::setUniform(const UniformHandle& handle, float input)
+{
+	assert(current == this);
+	GLint loc = getLocation(handle);
+	CHECK_SHADER_VAR(loc, handle.name);
+	glUniform1f(loc, input);
+	assert(glGetError() == GL_NO_ERROR);
+}
+
+void Shader::setUniform(const UniformHandle& handle, const Vector2& input)
+{
+	assert(current == this);
+	GLint loc = getLocation(handle);
+	CHECK_SHADER_VAR(loc, handle.name);
+	glUniform2f(loc, input.x, input.y);
+	assert(glGetError() == GL_NO_ERROR);
+}
+
+void Shader::setUniform(const UniformHandle& handle, const Vector3& input)
+{
+	assert(current == this);
+	GLint loc = getLocation(handle);
+	CHECK_SHADER_VAR(loc, handle.name);
+	glUniform3f(loc, input.x, input.y, input.z);
+	assert(glGetError() == GL_NO_ERROR);
+}
+
+void Shader::setUniform(const UniformHandle& handle, const Vector4& input)
+{
+	assert(current == this);
+	GLint loc = getLocation(handle);
+	CHECK_SHADER_VAR(loc, handle.name);
+	glUniform4f(loc, input.x, input.y, input.z, input.w);
+	assert(glGetError() == GL_NO_ERROR);
+}
+
+void Shader::setUniform(const UniformHandle& handle, const Matrix44& input)
+{
+	assert(current == this);
+	GLint loc = getLocation(handle);
+	CHECK_SHADER_VAR(loc, handle.name);
+	glUniformMatrix4fv(loc, 1, GL_FALSE, input.m);
+	assert(glGetError() == GL_NO_ERROR);
+}
+
+void Shader::setUniform(const UniformHandle& handle, Texture* texture, int slot)
+{
+	assert(current == this);
+	GLState::bindTexture(slot, texture->texture_type, texture->texture_id);
+	setUniform(handle, slot);
+}
+
+void Shader::setUniform1Array(const UniformHandle& handle, const float* input, const int count)
+{
+	GLint loc = getLocation(handle);
+	CHECK_SHADER_VAR(loc, handle.name);
+	glUniform1fv(loc, count, input);
+	assert(glGetError() == GL_NO_ERROR);
+}
+
+void Shader::setUniform1Array(const UniformHandle& handle, const int* input, const int count)
+{
+	GLint loc = getLocation(handle);
+	CHECK_SHADER_VAR(loc, handle.name);
+	glUniform1iv(loc, count, input);
+	assert(glGetError() == GL_NO_ERROR);
+}
+
+void Shader::setUniform3Array(const UniformHandle& handle, const float* input, const int count)
+{
+	GLint loc = getLocation(handle);
+	CHECK_SHADER_VAR(loc, handle.name);
+	glUniform3fv(loc, count, input);
+	assert(glGetError() == GL_NO_ERROR);
+}
+
+void Shader::setUniform4Array(const UniformHandle& handle, const float* input, const int count)
+{
+	GLint loc = getLocation(handle);
+	CHECK_SHADER_VAR(loc, handle.name);
+	glUniform4fv(loc, count, input);
+	assert(glGetError() == GL_NO_ERROR);
+}
+
+void Shader::setMatrix44Array(const UniformHandle& handle, const Matrix44* m_array, int num)
+{
+	GLint loc = getLocation(handle);
+	CHECK_SHADER_VAR(loc, handle.name);
+	glUniformMatrix4fv(loc, num, GL_FALSE, (GLfloat*)m_array);
+	assert(glGetError() == GL_NO_ERROR);
+}
+
+bool benchmarkUniformHandles(Shader* shader, int num_calls)
+{
+	//the vec3 of a draw with the light shader and one it doesn't have (renderMeshWithMaterial always sets u_camera_position)
+	const int num_names = 6;
+	const char* names[num_names] = { "u_ambient_light", "u_emissive_factor", "u_light_position", "u_light_color", "u_light_direction", "u_camera_position" };
+	std::vector<UniformHandle> handles;
+	for (int i = 0; i < num_names; ++i)
+		handles.push_back(UniformHandle(names[i]));
+
+	bool correct = true;
+	for (int i = 0; i < num_names; ++i)
+		correct = correct && shader->getLocation(handles[i]) == shader->getUniformLocation(names[i]);
+
+	Vector3 value(1, 1, 1);
+	shader->enable();
+	std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+	for (int i = 0; i < num_calls; ++i)
+		shader->setUniform(names[i % num_names], value);
+	std::chrono::high_resolution_clock::time_point middle = std::chrono::high_resolution_clock::now();
+	for (int i = 0; i < num_calls; ++i)
+		shader->setUniform(handles[i % num_names], value);
+	std::chrono::high_resolution_clock::time_point end = std::chrono::high_resolution_clock::now();
+	shader->disable();
+
+	double names_ms = std::chrono::duration<double, std::milli>(middle - start).count();
+	double handles_ms = std::chrono::duration<double, std::milli>(end - middle).count();
+	std::cout << " + " << num_calls << " setUniform: " << names_ms << " ms by name, " << handles_ms << " ms with handles" << (correct ? "" : " (ERROR: wrong locations)") << std::endl;
+	return correct;
+}
+
 void Shader::init()
 {
 	static bool firsttime = true;
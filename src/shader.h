@@ -8,6 +8,7 @@
 #include "includes.h"
 #include <string>
 #include <map>
+#include <vector>
 #include "framework.h"
 #include <cassert>
 
@@ -18,8 +19,24 @@
 	#define CHECK_SHADER_VAR(a,b) if (a == -1) return
 #endif
 
+//location of a handle that hasn't been used yet in the shader
+#define UNRESOLVED_LOCATION -2
+
 class Texture;
 
+//a uniform name registered once as a small number, the same for every shader.
+//declare them static (static UniformHandle u_model("u_model")) and the shaders find their location with an array lookup
+class UniformHandle
+{
+public:
+	int index;
+	const char* name;
+
+	explicit UniformHandle(const char* name);
+
+	static int getNumHandles();
+};
+
 class Shader
 {
 	static bool s_ready; //used to initialize shader vars
@@ -27,6 +44,9 @@ class Shader
 public:
     int last_slot;
 	static Shader* current;
+	static int s_ShaderID;
+	int m_Id; //unique id, used to group render calls by shader
+	int vertex_layout; //locations of the attributes of the meshes, an index in Mesh::vertex_layouts (-1 until a mesh is rendered with it)
 
 	Shader();
 	virtual ~Shader();
@@ -63,6 +83,21 @@ public:
 	//for textures you must specify an slot (a number from 0 to 16) where this texture is stored in the shader
 	void setUniform(const char* varname, Texture* texture, int slot) { assert(current == this); setTexture(varname, texture, slot); }
 
+	//upload using handles (faster than by name, use them in code that runs for every draw)
+	void setUniform(const UniformHandle& handle, bool input);
+	void setUniform(const UniformHandle& handle, int input);
+	void setUniform(const UniformHandle& handle, float input);
+	void setUniform(const UniformHandle& handle, const Vector2& input);
+	void setUniform(const UniformHandle& handle, const Vector3& input);
+	void setUniform(const UniformHandle& handle, const Vector4& input);
+	void setUniform(const UniformHandle& handle, const Matrix44& input);
+	void setUniform(const UniformHandle& handle, Texture* texture, int slot);
+	void setUniform1Array(const UniformHandle& handle, const float* input, const int count);
+	void setUniform1Array(const UniformHandle& handle, const int* input, const int count);
+	void setUniform3Array(const UniformHandle& handle, const float* input, const int count);
+	void setUniform4Array(const UniformHandle& handle, const float* input, const int count);
+	void setMatrix44Array(const UniformHandle& handle, const Matrix44* m_array, int num);
+
 
 	virtual void setInt(const char* varname, const int& input) { setUniform1(varname, input); }
 	virtual void setFloat(const char* varname, const float& input) { setUniform1(varname, input); }
@@ -101,6 +136,10 @@ public:
 	virtual int getAttribLocation(const char* varname);
 	virtual int getUniformLocation(const char* varname);
 
+	//uniform blocks read their data from the uniform buffer bound to a binding point (see UniformBuffer)
+	bool hasUniformBlock(const char* block_name);
+	bool setUniformBlock(const char* block_name, int binding);
+
 	std::string getInfoLog() const;
 	bool hasInfoLog() const;
 	bool compiled;
@@ -152,9 +191,22 @@ private:
 	};	
 	typedef std::map<const char*, int, ltstr> loctable;
 
+	std::vector<GLint> handle_locations; //location of every UniformHandle, -1 if the shader doesn't have it
+	GLint resolveLocation(const UniformHandle& handle);
+
 public:
 	GLint getLocation( const char* varname, loctable* table );
 	loctable locations;	
+
+	GLint getLocation(const UniformHandle& handle) {
+		if (handle.index < handle_locations.size() && handle_locations[handle.index] != UNRESOLVED_LOCATION)
+			return handle_locations[handle.index];
+		return resolveLocation(handle);
+	}
 };
 
+//times num_calls setUniform by name and with handles in the shader and prints it
+//(false if a handle doesn't resolve to the location of its name)
+bool benchmarkUniformHandles(Shader* shader, int num_calls = 1000000);
+
 #endif
@@ -0,0 +1,183 @@
+#include "shadowatlas.h"
+#include "scene.h"
+#include "camera.h"
+#include "glstate.h"
+#include <algorithm>
+#include <cmath>
+
+using namespace GTR;
+
+ShadowAtlas::ShadowAtlas(int size)
+{
+	this->size = size;
+	this->min_tile_size = 256;
+	this->max_tile_size = size / 2;
+	this->num_tiles = 0;
+	this->used_pixels = 0;
+	this->fbo = new FBO();
+	this->fbo->setDepthOnly(size, size);
+}
+
+ShadowAtlas::~ShadowAtlas()
+{
+	delete fbo;
+}
+
+float GTR::computeLightImportance(LightEntity* light, Camera* camera)
+{
+	//a directional light affects the whole screen
+	if (light->light_type == DIRECTIONAL)
+		return 1.0f;
+
+	//sphere around what the light can reach (for a spot the cone fits in the sphere over half its range)
+	Vector3 position = light->model.getTranslation();
+	float radius = light->max_distance;
+	if (light->light_type == SPOT)
+	{
+		radius *= 0.5f;
+		position = position + light->model.frontVector().normalize() * radius;
+	}
+
+	float distance = camera->eye.distance(position);
+	if (distance <= radius)
+		return 1.0f;
+
+	//projected radius in screen heights
+	float tan_half_fov = tan(camera->fov * 0.5f * DEG2RAD);
+	if (camera->type == Camera::ORTHOGRAPHIC)
+		return std::min(1.0f, 2.0f * radius / (camera->top - camera->bottom));
+	return std::min(1.0f, radius / (distance * tan_half_fov));
+}
+
+struct sTileRequest {
+	sShadowView* view;
+	float importance;
+	int size;
+};
+
+//biggest tiles first, so the quadtree packing never leaves holes
+static bool compareTileRequests(const sTileRequest& a, const sTileRequest& b)
+{
+	if (a.size != b.size)
+		return a.size > b.size;
+	return a.importance > b.importance;
+}
+
+void ShadowAtlas::assignTiles(std::vector<LightEntity*>& lights, Camera* camera)
+{
+	std::vector<sTileRequest> requests;
+	for (int i = 0; i < lights.size(); ++i)
+	{
+		LightEntity* light = lights[i];
+		light->shadow_atlas = getTexture();
+		light->num_shadow_views = light->visible ? light->getNumShadowViews() : 0;
+		float importance = computeLightImportance(light, camera);
+
+		//a light that can't reach anything the camera sees doesn't need a shadow
+		bool in_view = light->light_type == DIRECTIONAL ||
+			camera->testSphereInFrustum(light->model.getTranslation(), light->max_distance) != CLIP_OUTSIDE;
+
+		for (int j = 0; j < light->num_shadow_views; ++j)
+		{
+			sShadowView& view = light->shadow_views[j];
+			view.tile_size = 0;
+			view.atlas_rect = Vector4(0, 0, 0, 0);
+			if (!in_view)
+				continue;
+
+			sTileRequest request;
+			request.view = &view;
+			//the farther cascades are less important, they are the first to lose resolution
+			request.importance = light->light_type == DIRECTIONAL ? importance / (j + 1) : importance;
+			//smallest power of two that covers the importance
+			request.size = min_tile_size;
+			while (request.size < max_tile_size && request.size < request.importance * max_tile_size)
+				request.size *= 2;
+			requests.push_back(request);
+		}
+	}
+
+	//make the tiles smaller until they fit in the atlas, starting by the biggest with less importance
+	long area = 0;
+	for (int i = 0; i < requests.size(); ++i)
+		area += (long)requests[i].size * requests[i].size;
+	while (area > (long)size * size)
+	{
+		int candidate = -1;
+		for (int i = 0; i < requests.size(); ++i)
+		{
+			if (requests[i].size <= min_tile_size)
+				continue;
+			if (candidate == -1 || requests[i].size > requests[candidate].size ||
+				(requests[i].size == requests[candidate].size && requests[i].importance < requests[candidate].importance))
+				candidate = i;
+		}
+		//all of them are as small as possible, the least important ones will have no shadow
+		if (candidate == -1)
+			break;
+		area -= (long)requests[candidate].size * requests[candidate].size * 3 / 4;
+		requests[candidate].size /= 2;
+	}
+
+	std::sort(requests.begin(), requests.end(), compareTileRequests);
+
+	//quadtree packing: take the smallest free square that fits and split it until it has the size of the tile
+	struct sFreeTile { int x, y, size; };
+	std::vector<sFreeTile> free_tiles;
+	sFreeTile whole = { 0, 0, size };
+	free_tiles.push_back(whole);
+
+	num_tiles = 0;
+	used_pixels = 0;
+	for (int i = 0; i < requests.size(); ++i)
+	{
+		int best = -1;
+		for (int j = 0; j < free_tiles.size(); ++j)
+			if (free_tiles[j].size >= requests[i].size && (best == -1 || free_tiles[j].size < free_tiles[best].size))
+				best = j;
+		if (best == -1)
+			continue;
+
+		sFreeTile tile = free_tiles[best];
+		free_tiles.erase(free_tiles.begin() + best);
+		while (tile.size > requests[i].size)
+		{
+			int half = tile.size / 2;
+			sFreeTile right = { tile.x + half, tile.y, half };
+			sFreeTile top = { tile.x, tile.y + half, half };
+			sFreeTile corner = { tile.x + half, tile.y + half, half };
+			free_tiles.push_back(right);
+			free_tiles.push_back(top);
+			free_tiles.push_back(corner);
+			tile.size = half;
+		}
+
+		sShadowView* view = requests[i].view;
+		view->tile_x = tile.x;
+		view->tile_y = tile.y;
+		view->tile_size = tile.size;
+		view->atlas_rect = Vector4(tile.x / (float)size, tile.y / (float)size, tile.size / (float)size, tile.size / (float)size);
+		num_tiles++;
+		used_pixels += tile.size * tile.size;
+	}
+}
+
+void ShadowAtlas::bind()
+{
+	fbo->bind();
+	//the scissor keeps the clear inside the tile, the other tiles may be cached
+	GLState::enable(GL_SCISSOR_TEST);
+}
+
+void ShadowAtlas::setTile(sShadowView& view)
+{
+	assert(view.tile_size && "view without tile");
+	glViewport(view.tile_x, view.tile_y, view.tile_size, view.tile_size);
+	glScissor(view.tile_x, view.tile_y, view.tile_size, view.tile_size);
+}
+
+void ShadowAtlas::unbind()
+{
+	GLState::disable(GL_SCISSOR_TEST);
+	fbo->unbind();
+}
@@ -0,0 +1,46 @@
+#ifndef SHADOWATLAS_H
+#define SHADOWATLAS_H
+
+#include "fbo.h"
+#include <vector>
+
+class Camera;
+
+namespace GTR {
+
+	class LightEntity;
+	struct sShadowView;
+
+	// A single depth texture shared by the shadow maps of all the lights.
+	// Every light gets a square tile, bigger when the light covers more of the screen,
+	// and the tiles are made smaller when they don't fit in the atlas
+	class ShadowAtlas
+	{
+	public:
+		FBO* fbo;
+		int size; // width and height of the atlas in pixels
+		int min_tile_size;
+		int max_tile_size;
+		int num_tiles; // shadow views with a tile in the last assignment
+		int used_pixels;
+
+		ShadowAtlas(int size = 4096);
+		~ShadowAtlas();
+
+		Texture* getTexture() { return fbo->depth_texture; }
+
+		// Gives a tile to every shadow view of the lights (the tile is stored in the view)
+		void assignTiles(std::vector<LightEntity*>& lights, Camera* camera);
+
+		// Binds the atlas, all the tiles are rendered between bind and unbind
+		void bind();
+		void unbind();
+		// Restricts rendering to the tile of the view
+		void setTile(sShadowView& view);
+	};
+
+	// Fraction of the screen height covered by the light, used to size its shadow map
+	float computeLightImportance(LightEntity* light, Camera* camera);
+};
+
+#endif
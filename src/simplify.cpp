@@ -0,0 +1,375 @@
+#include "simplify.h"
+#include <algorithm>
+#include <cmath>
+#include <cfloat>
+#include <chrono>
+#include <iostream>
+
+MeshSimplifier::MeshSimplifier(const void* positions, int stride, int num_vertices, const std::vector<unsigned int>& indices) : indices(indices)
+{
+	error = 0;
+	const char* data = (const char*)positions;
+	this->positions.resize(num_vertices);
+	for (int i = 0; i < num_vertices; ++i)
+		this->positions[i] = *(const Vector3*)(data + i * stride);
+
+	//the vertices with the same position (the wedges of a seam) are a ring, the first one represents them
+	std::vector<unsigned int> order(num_vertices);
+	for (int i = 0; i < num_vertices; ++i)
+		order[i] = i;
+	std::sort(order.begin(), order.end(), [this](unsigned int a, unsigned int b) {
+		const Vector3& pa = this->positions[a];
+		const Vector3& pb = this->positions[b];
+		return pa.x < pb.x || (pa.x == pb.x && (pa.y < pb.y || (pa.y == pb.y && (pa.z < pb.z || (pa.z == pb.z && a < b)))));
+	});
+	canonical.resize(num_vertices);
+	wedge_next.resize(num_vertices);
+	for (int i = 0; i < num_vertices; )
+	{
+		int count = 1;
+		const Vector3& p = this->positions[order[i]];
+		while (i + count < num_vertices && this->positions[order[i + count]].x == p.x && this->positions[order[i + count]].y == p.y && this->positions[order[i + count]].z == p.z)
+			count++;
+		for (int j = 0; j < count; ++j)
+		{
+			canonical[order[i + j]] = order[i];
+			wedge_next[order[i + j]] = order[i + (j + 1) % count];
+		}
+		i += count;
+	}
+
+	//every position starts with the planes of its triangles
+	sQuadric zero = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 };
+	quadrics.assign(num_vertices, zero);
+	for (int i = 0; i + 2 < this->indices.size(); i += 3)
+	{
+		const Vector3& p0 = this->positions[this->indices[i]];
+		const Vector3& p1 = this->positions[this->indices[i + 1]];
+		const Vector3& p2 = this->positions[this->indices[i + 2]];
+		double ux = p1.x - p0.x, uy = p1.y - p0.y, uz = p1.z - p0.z;
+		double vx = p2.x - p0.x, vy = p2.y - p0.y, vz = p2.z - p0.z;
+		double a = uy * vz - uz * vy, b = uz * vx - ux * vz, c = ux * vy - uy * vx;
+		double length = sqrt(a * a + b * b + c * c);
+		if (length < 1e-12)
+			continue;
+		a /= length;
+		b /= length;
+		c /= length;
+		double d = -(a * p0.x + b * p0.y + c * p0.z);
+		for (int j = 0; j < 3; ++j)
+		{
+			sQuadric& q = quadrics[canonical[this->indices[i + j]]];
+			q.a2 += a * a; q.ab += a * b; q.ac += a * c; q.ad += a * d;
+			q.b2 += b * b; q.bc += b * c; q.bd += b * d;
+			q.c2 += c * c; q.cd += c * d;
+			q.d2 += d * d;
+		}
+	}
+
+	//the edges of a single triangle are borders of the surface, their positions are locked (the seams are not borders)
+	//the edges of more than two triangles too, collapsing them could break the surface
+	locked.assign(num_vertices, 0);
+	std::vector<uint64_t> edges;
+	edges.reserve(this->indices.size());
+	for (int i = 0; i + 2 < this->indices.size(); i += 3)
+		for (int j = 0; j < 3; ++j)
+		{
+			uint64_t a = canonical[this->indices[i + j]], b = canonical[this->indices[i + (j + 1) % 3]];
+			edges.push_back(a < b ? (a << 32) | b : (b << 32) | a);
+		}
+	std::sort(edges.begin(), edges.end());
+	for (int i = 0; i < edges.size(); )
+	{
+		int count = 1;
+		while (i + count < edges.size() && edges[i + count] == edges[i])
+			count++;
+		if (count != 2)
+		{
+			locked[edges[i] >> 32] = 1;
+			locked[edges[i] & 0xFFFFFFFF] = 1;
+		}
+		i += count;
+	}
+}
+
+double MeshSimplifier::evaluate(const sQuadric& q, const Vector3& p)
+{
+	double x = p.x, y = p.y, z = p.z;
+	double result = q.a2 * x * x + 2 * q.ab * x * y + 2 * q.ac * x * z + 2 * q.ad * x
+		+ q.b2 * y * y + 2 * q.bc * y * z + 2 * q.bd * y
+		+ q.c2 * z * z + 2 * q.cd * z
+		+ q.d2;
+	return std::max(result, 0.0);
+}
+
+void MeshSimplifier::buildAdjacency()
+{
+	triangle_offsets.assign(positions.size() + 1, 0);
+	for (int i = 0; i < indices.size(); ++i)
+		triangle_offsets[indices[i] + 1]++;
+	for (int v = 0; v < positions.size(); ++v)
+		triangle_offsets[v + 1] += triangle_offsets[v];
+	vertex_triangles.resize(indices.size());
+	std::vector<unsigned int> filled(triangle_offsets.begin(), triangle_offsets.end() - 1);
+	for (int i = 0; i < indices.size(); ++i)
+		vertex_triangles[filled[indices[i]]++] = i / 3;
+}
+
+bool MeshSimplifier::findPartners(unsigned int source, unsigned int target)
+{
+	//every wedge of the source moves to the wedge of the target it shares a triangle with (the same side of the seam),
+	//if one doesn't have it the collapse would change the uvs or the normals of its triangles
+	unsigned int wedge = source;
+	do
+	{
+		unsigned int partner = wedge;
+		for (unsigned int k = triangle_offsets[wedge]; k < triangle_offsets[wedge + 1] && partner == wedge; ++k)
+		{
+			const unsigned int* triangle = &indices[vertex_triangles[k] * 3];
+			for (int j = 0; j < 3; ++j)
+				if (canonical[triangle[j]] == target)
+					partner = triangle[j];
+		}
+		if (partner == wedge && triangle_offsets[wedge] != triangle_offsets[wedge + 1])
+			return false;
+		remap[wedge] = partner;
+		wedge = wedge_next[wedge];
+	} while (wedge != source);
+	return true;
+}
+
+bool MeshSimplifier::flipsTriangles(unsigned int source, unsigned int target)
+{
+	//the triangles that stay (the ones with the edge disappear) must keep facing the same side
+	unsigned int wedge = source;
+	do
+	{
+		for (unsigned int k = triangle_offsets[wedge]; k < triangle_offsets[wedge + 1]; ++k)
+		{
+			const unsigned int* triangle = &indices[vertex_triangles[k] * 3];
+			if (canonical[triangle[0]] == target || canonical[triangle[1]] == target || canonical[triangle[2]] == target)
+				continue;
+			Vector3 p[3], moved[3];
+			for (int j = 0; j < 3; ++j)
+			{
+				p[j] = positions[triangle[j]];
+				moved[j] = canonical[triangle[j]] == source ? positions[target] : p[j];
+			}
+			Vector3 before = cross(p[1] - p[0], p[2] - p[0]);
+			Vector3 after = cross(moved[1] - moved[0], moved[2] - moved[0]);
+			if (dot(before, after) <= 0)
+				return true;
+		}
+		wedge = wedge_next[wedge];
+	} while (wedge != source);
+	return false;
+}
+
+float MeshSimplifier::simplify(int target_triangles, float max_error)
+{
+	double max_cost = (double)max_error * max_error;
+	remap.resize(positions.size());
+	while (getNumTriangles() > target_triangles)
+	{
+		buildAdjacency();
+
+		//every edge between two positions in both directions, a locked position can be the target but not the source
+		collapses.clear();
+		for (int i = 0; i + 2 < indices.size(); i += 3)
+			for (int j = 0; j < 3; ++j)
+			{
+				unsigned int a = canonical[indices[i + j]], b = canonical[indices[i + (j + 1) % 3]];
+				for (int dir = 0; dir < 2; ++dir)
+				{
+					unsigned int source = dir ? b : a, target = dir ? a : b;
+					if (locked[source])
+						continue;
+					const sQuadric& qs = quadrics[source];
+					const sQuadric& qt = quadrics[target];
+					sQuadric sum = { qs.a2 + qt.a2, qs.ab + qt.ab, qs.ac + qt.ac, qs.ad + qt.ad, qs.b2 + qt.b2, qs.bc + qt.bc, qs.bd + qt.bd, qs.c2 + qt.c2, qs.cd + qt.cd, qs.d2 + qt.d2 };
+					sCollapse collapse = { source, target, evaluate(sum, positions[target]) };
+					if (collapse.cost <= max_cost)
+						collapses.push_back(collapse);
+				}
+			}
+		if (collapses.empty())
+			break;
+		std::sort(collapses.begin(), collapses.end(), [](const sCollapse& a, const sCollapse& b) { return a.cost < b.cost; });
+
+		//the cheapest first, a position near a collapse waits for the next pass (its triangles changed)
+		for (unsigned int v = 0; v < remap.size(); ++v)
+			remap[v] = v;
+		touched.assign(positions.size(), 0);
+		int num_triangles = getNumTriangles();
+		int num_collapses = 0;
+		for (int i = 0; i < collapses.size() && num_triangles > target_triangles; ++i)
+		{
+			const sCollapse& collapse = collapses[i];
+			if (touched[collapse.source] || touched[collapse.target] || flipsTriangles(collapse.source, collapse.target))
+				continue;
+			if (!findPartners(collapse.source, collapse.target))
+			{
+				//undo the wedges already moved
+				unsigned int wedge = collapse.source;
+				do
+				{
+					remap[wedge] = wedge;
+					wedge = wedge_next[wedge];
+				} while (wedge != collapse.source);
+				continue;
+			}
+			unsigned int wedge = collapse.source;
+			do
+			{
+				for (unsigned int k = triangle_offsets[wedge]; k < triangle_offsets[wedge + 1]; ++k)
+				{
+					const unsigned int* triangle = &indices[vertex_triangles[k] * 3];
+					if (canonical[triangle[0]] == collapse.target || canonical[triangle[1]] == collapse.target || canonical[triangle[2]] == collapse.target)
+						num_triangles--;
+					for (int j = 0; j < 3; ++j)
+						touched[canonical[triangle[j]]] = 1;
+				}
+				wedge = wedge_next[wedge];
+			} while (wedge != collapse.source);
+			sQuadric& qt = quadrics[collapse.target];
+			const sQuadric& qs = quadrics[collapse.source];
+			qt.a2 += qs.a2; qt.ab += qs.ab; qt.ac += qs.ac; qt.ad += qs.ad;
+			qt.b2 += qs.b2; qt.bc += qs.bc; qt.bd += qs.bd;
+			qt.c2 += qs.c2; qt.cd += qs.cd;
+			qt.d2 += qs.d2;
+			error = std::max(error, collapse.cost);
+			num_collapses++;
+		}
+		if (!num_collapses)
+			break;
+
+		//move the indices and remove the triangles that lost an edge
+		int count = 0;
+		for (int i = 0; i + 2 < indices.size(); i += 3)
+		{
+			unsigned int a = remap[indices[i]], b = remap[indices[i + 1]], c = remap[indices[i + 2]];
+			if (canonical[a] == canonical[b] || canonical[b] == canonical[c] || canonical[a] == canonical[c])
+				continue;
+			indices[count++] = a;
+			indices[count++] = b;
+			indices[count++] = c;
+		}
+		indices.resize(count);
+	}
+	return getError();
+}
+
+//distance from p to the triangle abc (to its closest point, inside or on the edges)
+static float distanceToTriangle(const Vector3& p, const Vector3& a, const Vector3& b, const Vector3& c)
+{
+	Vector3 ab = b - a, ac = c - a, ap = p - a;
+	float d1 = dot(ab, ap), d2 = dot(ac, ap);
+	if (d1 <= 0 && d2 <= 0)
+		return ap.length();
+	Vector3 bp = p - b;
+	float d3 = dot(ab, bp), d4 = dot(ac, bp);
+	if (d3 >= 0 && d4 <= d3)
+		return bp.length();
+	float vc = d1 * d4 - d3 * d2;
+	if (vc <= 0 && d1 >= 0 && d3 <= 0)
+		return (p - (a + ab * (d1 / (d1 - d3)))).length();
+	Vector3 cp = p - c;
+	float d5 = dot(ab, cp), d6 = dot(ac, cp);
+	if (d6 >= 0 && d5 <= d6)
+		return cp.length();
+	float vb = d5 * d2 - d1 * d6;
+	if (vb <= 0 && d2 >= 0 && d6 <= 0)
+		return (p - (a + ac * (d2 / (d2 - d6)))).length();
+	float va = d3 * d6 - d5 * d4;
+	if (va <= 0 && (d4 - d3) >= 0 && (d5 - d6) >= 0)
+		return (p - (b + (c - b) * ((d4 - d3) / ((d4 - d3) + (d5 - d6))))).length();
+	float denom = 1.0f / (va + vb + vc);
+	return (p - (a + ab * (vb * denom) + ac * (vc * denom))).length();
+}
+
+//the farthest original vertex from the simplified surface
+static float maxDistanceToMesh(const std::vector<Vector3>& vertices, const std::vector<unsigned int>& indices)
+{
+	float max_distance = 0;
+	for (int v = 0; v < vertices.size(); ++v)
+	{
+		float distance = FLT_MAX;
+		for (int i = 0; i + 2 < indices.size(); i += 3)
+			distance = std::min(distance, distanceToTriangle(vertices[v], vertices[indices[i]], vertices[indices[i + 1]], vertices[indices[i + 2]]));
+		max_distance = std::max(max_distance, distance);
+	}
+	return max_distance;
+}
+
+bool testMeshSimplification()
+{
+	//a sphere of radius 1 with a uv seam (the last column repeats the positions of the first one) and single vertices at the poles
+	const int rings = 32, segments = 64, columns = segments + 1;
+	std::vector<Vector3> vertices;
+	std::vector<unsigned int> indices;
+	vertices.push_back(Vector3(0, 1, 0));
+	for (int r = 1; r < rings; ++r)
+		for (int s = 0; s < columns; ++s)
+		{
+			float theta = r * (float)PI / rings, phi = (s % segments) * 2.0f * (float)PI / segments;
+			vertices.push_back(Vector3(sin(theta) * cos(phi), cos(theta), sin(theta) * sin(phi)));
+		}
+	vertices.push_back(Vector3(0, -1, 0));
+	unsigned int bottom = (unsigned int)vertices.size() - 1;
+	for (int s = 0; s < segments; ++s)
+	{
+		unsigned int next = s + 1;
+		indices.push_back(0); indices.push_back(1 + next); indices.push_back(1 + s);
+		for (int r = 0; r < rings - 2; ++r)
+		{
+			unsigned int a = 1 + r * columns + s, b = 1 + r * columns + next;
+			unsigned int c = a + columns, d = b + columns;
+			indices.push_back(a); indices.push_back(b); indices.push_back(c);
+			indices.push_back(b); indices.push_back(d); indices.push_back(c);
+		}
+		indices.push_back(bottom); indices.push_back(1 + (rings - 2) * columns + s); indices.push_back(1 + (rings - 2) * columns + next);
+	}
+
+	//a chain of 3 levels, every one with half the triangles of the previous
+	bool correct = true;
+	const float max_error = 0.1f;
+	int num_triangles = (int)indices.size() / 3;
+	double ms = 0;
+	MeshSimplifier simplifier(&vertices[0], sizeof(Vector3), (int)vertices.size(), indices);
+	for (int level = 1; level <= 3; ++level)
+	{
+		int target = num_triangles >> level;
+		std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+		float error = simplifier.simplify(target, max_error);
+		ms += std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+		float distance = maxDistanceToMesh(vertices, simplifier.getIndices());
+		bool level_correct = simplifier.getNumTriangles() <= target && error <= max_error && distance <= error;
+		correct = correct && level_correct;
+		std::cout << " + Sphere LOD " << level << ": " << simplifier.getNumTriangles() << " of " << num_triangles << " triangles (target " << target
+			<< "), error " << error << ", farthest vertex " << distance << (level_correct ? "" : " (ERROR)") << std::endl;
+	}
+
+	//a flat grid, the inside can be removed without error (the border is locked)
+	const int cells = 64;
+	vertices.clear();
+	indices.clear();
+	for (int y = 0; y <= cells; ++y)
+		for (int x = 0; x <= cells; ++x)
+			vertices.push_back(Vector3((float)x, 0, (float)y));
+	for (int y = 0; y < cells; ++y)
+		for (int x = 0; x < cells; ++x)
+		{
+			unsigned int a = y * (cells + 1) + x, b = a + 1, c = a + cells + 1, d = c + 1;
+			indices.push_back(a); indices.push_back(c); indices.push_back(b);
+			indices.push_back(b); indices.push_back(c); indices.push_back(d);
+		}
+	MeshSimplifier plane_simplifier(&vertices[0], sizeof(Vector3), (int)vertices.size(), indices);
+	int target = (int)indices.size() / 3 / 10;
+	float error = plane_simplifier.simplify(target, 0.001f);
+	bool plane_correct = plane_simplifier.getNumTriangles() <= target && error < 1e-4f;
+	correct = correct && plane_correct;
+	std::cout << " + Plane: " << plane_simplifier.getNumTriangles() << " of " << indices.size() / 3 << " triangles (target " << target << "), error " << error << (plane_correct ? "" : " (ERROR)") << std::endl;
+
+	std::cout << " + Mesh simplification " << (correct ? "OK" : "FAILED") << ", the sphere chain took " << ms << " ms" << std::endl;
+	return correct;
+}
@@ -0,0 +1,56 @@
+/*  MeshSimplifier
+	Reduces the triangles of an indexed mesh collapsing its edges, the cheapest first, with the quadric error metric
+	(the sum of the squared distances to the planes of the original triangles that end in a vertex).
+	A vertex only moves to the position of another one, so the vertices of the mesh don't change, only the indices.
+	It works with positions: the vertices of a seam (same position, different uvs or normals) move together along the
+	seam, so it doesn't open cracks, and the vertices on a border of the mesh never move.
+	Calling simplify several times with less triangles gives a chain of LODs.
+*/
+#ifndef SIMPLIFY_H
+#define SIMPLIFY_H
+
+#include "framework.h"
+#include <vector>
+
+class MeshSimplifier {
+public:
+	//positions every stride bytes
+	MeshSimplifier(const void* positions, int stride, int num_vertices, const std::vector<unsigned int>& indices);
+
+	//collapses edges until the mesh has target_triangles or the next collapse would have more error than max_error
+	//returns the error of the mesh (the distance to the original planes, in the units of the positions)
+	float simplify(int target_triangles, float max_error);
+
+	const std::vector<unsigned int>& getIndices() const { return indices; }
+	int getNumTriangles() const { return (int)indices.size() / 3; }
+	float getError() const { return sqrt(error); }
+
+private:
+	struct sQuadric { double a2, ab, ac, ad, b2, bc, bd, c2, cd, d2; };
+	struct sCollapse { unsigned int source; unsigned int target; double cost; };
+
+	std::vector<Vector3> positions;
+	std::vector<sQuadric> quadrics;
+	std::vector<char> locked; //by canonical vertex
+	std::vector<unsigned int> canonical; //first vertex with the same position, the quadrics are stored there
+	std::vector<unsigned int> wedge_next; //next vertex with the same position (a ring)
+	std::vector<unsigned int> indices;
+	double error; //squared, the highest cost of the collapses done
+
+	//triangles of every vertex (CSR: the triangles of v are vertex_triangles[triangle_offsets[v]...triangle_offsets[v + 1]])
+	std::vector<unsigned int> triangle_offsets;
+	std::vector<unsigned int> vertex_triangles;
+	std::vector<sCollapse> collapses;
+	std::vector<unsigned int> remap;
+	std::vector<char> touched; //by canonical vertex
+
+	void buildAdjacency();
+	bool findPartners(unsigned int source, unsigned int target); //fills remap for the wedges of source
+	bool flipsTriangles(unsigned int source, unsigned int target);
+	static double evaluate(const sQuadric& q, const Vector3& p);
+};
+
+//simplifies a sphere and a plane, checks the triangles removed and that the original vertices stay within the error, prints the results
+bool testMeshSimplification();
+
+#endif
@@ -0,0 +1,178 @@
+#include "streambuffer.h"
+#include <cassert>
+#include <cstring>
+#include <cstdio>
+#include <iostream>
+
+//the version and extensions are checked once
+static int getGLVersion()
+{
+	int major = 0, minor = 0;
+	const char* version = (const char*)glGetString(GL_VERSION);
+	if (version)
+		sscanf(version, "%d.%d", &major, &minor);
+	return major * 10 + minor;
+}
+
+static bool hasExtension(const char* name)
+{
+	const char* extensions = (const char*)glGetString(GL_EXTENSIONS);
+	return extensions && strstr(extensions, name);
+}
+
+StreamBuffer::StreamBuffer(int region_size, int num_regions)
+{
+	assert(num_regions > 0 && num_regions <= STREAM_MAX_REGIONS);
+	this->buffer_id = 0;
+	this->num_regions = num_regions;
+	this->region = 0;
+	this->head = 0;
+	this->mapped = NULL;
+	this->used = 0;
+	this->last_frame_used = 0;
+	this->num_waits = 0;
+	for (int i = 0; i < STREAM_MAX_REGIONS; ++i)
+		fences[i] = NULL;
+
+#ifdef USE_MAPPED_BUFFERS
+	int version = getGLVersion();
+	use_fences = version >= 32 || (hasExtension("GL_ARB_sync") && hasExtension("GL_ARB_map_buffer_range"));
+	persistent = use_fences && (version >= 44 || hasExtension("GL_ARB_buffer_storage"));
+#else
+	use_fences = false;
+	persistent = false;
+#endif
+	create(region_size);
+}
+
+StreamBuffer::~StreamBuffer()
+{
+	releaseFences();
+	if (buffer_id)
+		glDeleteBuffers(1, &buffer_id);
+}
+
+void StreamBuffer::create(int region_size)
+{
+	//a new buffer, OpenGL keeps the old one alive until the draws that read it are done
+	releaseFences();
+	if (buffer_id)
+		glDeleteBuffers(1, &buffer_id);
+	this->region_size = region_size;
+	int size = region_size * num_regions;
+
+	glGenBuffers(1, &buffer_id);
+	glBindBuffer(GL_ARRAY_BUFFER, buffer_id);
+#ifdef USE_MAPPED_BUFFERS
+	if (persistent)
+	{
+		GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+		glBufferStorage(GL_ARRAY_BUFFER, size, NULL, flags);
+		mapped = (char*)glMapBufferRange(GL_ARRAY_BUFFER, 0, size, flags);
+		assert(mapped && "persistent mapping failed");
+	}
+	else
+#endif
+		glBufferData(GL_ARRAY_BUFFER, size, NULL, GL_STREAM_DRAW);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	assert(glGetError() == GL_NO_ERROR);
+
+	head = region * region_size;
+}
+
+void StreamBuffer::releaseFences()
+{
+#ifdef USE_MAPPED_BUFFERS
+	for (int i = 0; i < STREAM_MAX_REGIONS; ++i)
+		if (fences[i])
+			glDeleteSync((GLsync)fences[i]);
+#endif
+	for (int i = 0; i < STREAM_MAX_REGIONS; ++i)
+		fences[i] = NULL;
+}
+
+int StreamBuffer::write(const void* data, int size, int alignment)
+{
+	int offset = (head + alignment - 1) / alignment * alignment;
+	if (offset + size > (region + 1) * region_size)
+	{
+		//the region is full, a bigger buffer (the draws already sent still read the old one)
+		int new_size = region_size * 2;
+		while (new_size < size + alignment)
+			new_size *= 2;
+		std::cout << " + Stream buffer grows to " << new_size / 1024 << " KB per frame" << std::endl;
+		create(new_size);
+		offset = (head + alignment - 1) / alignment * alignment;
+	}
+
+#ifdef USE_MAPPED_BUFFERS
+	if (persistent)
+		memcpy(mapped + offset, data, size);
+	else if (use_fences)
+	{
+		//the fences already guarantee the GPU isn't reading this range
+		glBindBuffer(GL_ARRAY_BUFFER, buffer_id);
+		void* ptr = glMapBufferRange(GL_ARRAY_BUFFER, offset, size, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_RANGE_BIT | GL_MAP_UNSYNCHRONIZED_BIT);
+		memcpy(ptr, data, size);
+		glUnmapBuffer(GL_ARRAY_BUFFER);
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
+	}
+	else
+#endif
+	{
+		glBindBuffer(GL_ARRAY_BUFFER, buffer_id);
+		glBufferSubData(GL_ARRAY_BUFFER, offset, size, data);
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
+	}
+
+	used += offset + size - head;
+	head = offset + size;
+	return offset;
+}
+
+void StreamBuffer::nextFrame()
+{
+#ifdef USE_MAPPED_BUFFERS
+	if (use_fences)
+	{
+		//the GPU is done with this region when it reaches this point of the commands
+		if (fences[region])
+			glDeleteSync((GLsync)fences[region]);
+		fences[region] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	}
+#endif
+	region = (region + 1) % num_regions;
+	head = region * region_size;
+	last_frame_used = used;
+	used = 0;
+
+#ifdef USE_MAPPED_BUFFERS
+	if (fences[region])
+	{
+		GLenum result = glClientWaitSync((GLsync)fences[region], GL_SYNC_FLUSH_COMMANDS_BIT, 0);
+		if (result == GL_TIMEOUT_EXPIRED)
+		{
+			num_waits++;
+			while (result == GL_TIMEOUT_EXPIRED)
+				result = glClientWaitSync((GLsync)fences[region], GL_SYNC_FLUSH_COMMANDS_BIT, 1000000); //1 ms
+		}
+		glDeleteSync((GLsync)fences[region]);
+		fences[region] = NULL;
+	}
+#endif
+}
+
+void StreamBuffer::bindUniformRange(int binding, int offset, int size)
+{
+#ifdef USE_UNIFORM_BUFFERS
+	glBindBufferRange(GL_UNIFORM_BUFFER, binding, buffer_id, offset, size);
+#endif
+}
+
+StreamBuffer* StreamBuffer::getFrameStream()
+{
+	static StreamBuffer* stream = NULL;
+	if (!stream)
+		stream = new StreamBuffer();
+	return stream;
+}
@@ -0,0 +1,51 @@
+#ifndef STREAMBUFFER_H
+#define STREAMBUFFER_H
+
+#include "includes.h"
+
+#define STREAM_MAX_REGIONS 4
+
+//StreamBuffer
+//a ring buffer in the GPU for the data that changes in every draw (instance models, skinning palettes, per draw uniforms).
+//every frame writes in its own region, so the GPU can still read the regions of the previous frames while the CPU writes.
+//a fence per region tells when it can be used again, so the driver never has to reallocate the buffer or stall on it
+
+class StreamBuffer {
+public:
+	GLuint buffer_id;
+	int region_size; //bytes every frame can write
+	int num_regions;
+	bool persistent; //mapped once (GL_ARB_buffer_storage), otherwise every write maps its range or uses glBufferSubData
+
+	//stats
+	int used; //bytes written in this frame
+	int last_frame_used;
+	int num_waits; //frames that had to wait for the GPU to free their region
+
+	StreamBuffer(int region_size = 4 * 1024 * 1024, int num_regions = 3);
+	~StreamBuffer();
+
+	//copies the data in the region of the frame and returns its offset in the buffer (a multiple of alignment)
+	int write(const void* data, int size, int alignment = 16);
+
+	//moves to the region of the next frame, waits if the GPU is still reading it
+	void nextFrame();
+
+	//to use a part of the buffer as an uniform block
+	void bindUniformRange(int binding, int offset, int size);
+
+	//the stream of the application, nextFrame is called when a new frame starts
+	static StreamBuffer* getFrameStream();
+
+private:
+	int region; //of the current frame
+	int head; //next free byte in the region
+	char* mapped; //persistent mapping of the whole buffer
+	bool use_fences; //synchronization and unsynchronized mapping are available
+	void* fences[STREAM_MAX_REGIONS]; //GLsync of the last frame that wrote every region
+
+	void create(int region_size);
+	void releaseFences();
+};
+
+#endif
@@ -0,0 +1,80 @@
+#include "tests.h"
+#include "application.h"
+#include "renderer.h"
+#include "cascades.h"
+#include "clusters.h"
+#include "rendergraph.h"
+#include "occlusion.h"
+#include "simplify.h"
+#include "jobsystem.h"
+#include "shader.h"
+
+#include <iostream>
+
+//globals of the application
+extern Camera* camera;
+extern GTR::Scene* scene;
+extern GTR::Renderer* renderer;
+
+struct sTest {
+	const char* name;
+	bool benchmark; //run with --benchmark, the others with --test (a check that is fast enough is in both)
+	bool (*run)(); //false if a result is wrong
+};
+
+static bool lightClusters()
+{
+	JobSystem job_system; //a thread per core
+	return GTR::benchmarkLightClusters(&job_system);
+}
+
+static bool uniformHandles()
+{
+	Shader* shader = Shader::Get("light");
+	return shader && benchmarkUniformHandles(shader);
+}
+
+static bool parallelCollect()
+{
+	return renderer->testParallelCollect(scene, camera);
+}
+
+static bool commandLists()
+{
+	//with the calls of a frame of the scene
+	renderer->benchmark_command_lists = true;
+	Application::instance->render();
+	return renderer->command_lists_correct;
+}
+
+static const sTest tests[] = {
+	{ "cascades", false, GTR::testCascades },
+	{ "render graph", false, GTR::testRenderGraph },
+	{ "mesh simplification", false, testMeshSimplification },
+	{ "parallel collect", false, parallelCollect },
+	{ "occlusion buffer", false, benchmarkOcclusionBuffer },
+	{ "occlusion buffer", true, benchmarkOcclusionBuffer },
+	{ "light clusters", true, lightClusters },
+	{ "uniform handles", true, uniformHandles },
+	{ "command lists", true, commandLists },
+};
+
+int runTests(bool benchmarks, const std::string& filter)
+{
+	int num_tests = 0, num_failed = 0;
+	for (int i = 0; i < sizeof(tests) / sizeof(sTest); ++i)
+	{
+		const sTest& test = tests[i];
+		if (test.benchmark != benchmarks || std::string(test.name).find(filter) == std::string::npos)
+			continue;
+		std::cout << (benchmarks ? "Benchmark: " : "Test: ") << test.name << std::endl;
+		num_tests++;
+		if (!test.run())
+		{
+			num_failed++;
+			std::cout << " + FAILED: " << test.name << std::endl;
+		}
+	}
+	std::cout << num_tests << (benchmarks ? " benchmarks, " : " tests, ") << num_failed << " failed" << std::endl;
+	return num_failed;
+}
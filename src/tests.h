@@ -0,0 +1,18 @@
+/*  Tests and benchmarks
+	The checks and the benchmarks of the modules, run from the command line in the offscreen context of the headless mode
+	(after the scene is loaded, so they can use its shaders and its render calls). The exit code is 1 if any of them fails.
+
+	main --test [name]       the checks of the results (only the ones whose name contains name)
+	main --benchmark [name]  the measures of the times, they also fail if their results are wrong
+
+	Every one is a function that returns false when a result is wrong, listed in tests.cpp.
+*/
+#ifndef TESTS_H
+#define TESTS_H
+
+#include <string>
+
+//runs the tests (or the benchmarks) whose name contains filter, returns how many failed
+int runTests(bool benchmarks, const std::string& filter);
+
+#endif
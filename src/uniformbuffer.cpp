@@ -0,0 +1,88 @@
+#include "uniformbuffer.h"
+#include <cassert>
+#include <cstring>
+#include <cstdio>
+
+UniformBuffer::UniformBuffer()
+{
+	buffer_id = 0;
+	size = 0;
+	binding = 0;
+}
+
+UniformBuffer::~UniformBuffer()
+{
+#ifdef USE_UNIFORM_BUFFERS
+	if (buffer_id)
+		glDeleteBuffers(1, &buffer_id);
+#endif
+}
+
+void UniformBuffer::create(int binding, int size)
+{
+	assert(size > 0);
+	this->binding = binding;
+	this->size = size;
+#ifdef USE_UNIFORM_BUFFERS
+	if (!buffer_id)
+		glGenBuffers(1, &buffer_id);
+	glBindBuffer(GL_UNIFORM_BUFFER, buffer_id);
+	//the content changes every frame
+	glBufferData(GL_UNIFORM_BUFFER, size, NULL, GL_DYNAMIC_DRAW);
+	glBindBuffer(GL_UNIFORM_BUFFER, 0);
+	assert(glGetError() == GL_NO_ERROR);
+#endif
+}
+
+void UniformBuffer::update(const void* data, int size, int offset)
+{
+	assert(buffer_id && offset + size <= this->size && "update out of the buffer");
+#ifdef USE_UNIFORM_BUFFERS
+	glBindBuffer(GL_UNIFORM_BUFFER, buffer_id);
+	glBufferSubData(GL_UNIFORM_BUFFER, offset, size, data);
+	glBindBuffer(GL_UNIFORM_BUFFER, 0);
+	assert(glGetError() == GL_NO_ERROR);
+#endif
+}
+
+void UniformBuffer::bind()
+{
+	assert(buffer_id);
+#ifdef USE_UNIFORM_BUFFERS
+	glBindBufferBase(GL_UNIFORM_BUFFER, binding, buffer_id);
+#endif
+}
+
+void UniformBuffer::bindRange(int offset, int size)
+{
+	assert(buffer_id && offset + size <= this->size && offset % getOffsetAlignment() == 0);
+#ifdef USE_UNIFORM_BUFFERS
+	glBindBufferRange(GL_UNIFORM_BUFFER, binding, buffer_id, offset, size);
+#endif
+}
+
+bool UniformBuffer::isSupported()
+{
+#ifdef USE_UNIFORM_BUFFERS
+	int major = 0, minor = 0;
+	const char* version = (const char*)glGetString(GL_VERSION);
+	if (version)
+		sscanf(version, "%d.%d", &major, &minor);
+	if (major > 3 || (major == 3 && minor >= 1))
+		return true;
+	const char* extensions = (const char*)glGetString(GL_EXTENSIONS);
+	return extensions && strstr(extensions, "GL_ARB_uniform_buffer_object");
+#else
+	return false;
+#endif
+}
+
+int UniformBuffer::getOffsetAlignment()
+{
+	static int alignment = 0;
+#ifdef USE_UNIFORM_BUFFERS
+	if (!alignment)
+		glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &alignment);
+#endif
+	return alignment ? alignment : 256;
+}
@@ -0,0 +1,31 @@
+#ifndef UNIFORMBUFFER_H
+#define UNIFORMBUFFER_H
+
+#include "includes.h"
+
+//UniformBufferObject
+//a buffer in the GPU with the data of an uniform block (declared with layout(std140) in the shader),
+//it is uploaded once and read by all the shaders that have the block, instead of setting every uniform in every shader
+
+class UniformBuffer {
+public:
+	GLuint buffer_id;
+	int size; // in bytes
+	int binding; // binding point where the shaders find it
+
+	UniformBuffer();
+	~UniformBuffer();
+
+	void create(int binding, int size);
+	void update(const void* data, int size, int offset = 0);
+
+	//binds the whole buffer to its binding point, or only a part of it (the offset must be a multiple of getOffsetAlignment)
+	void bind();
+	void bindRange(int offset, int size);
+
+	//needs OpenGL 3.1 or GL_ARB_uniform_buffer_object
+	static bool isSupported();
+	static int getOffsetAlignment();
+};
+
+#endif
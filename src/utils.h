@@ -29,6 +29,9 @@ bool checkGLErrors();
 //returns the current path
 std::string getPath();
 
+//creates the folder (and the ones of the path that don't exist), true if it exists after the call
+bool createFolder(const std::string& path);
+
 Vector2 getDesktopSize( int display_index = 0 );
 
 std::vector<std::string> tokenize(const std::string& source, const char* delimiters, bool process_strings = false);